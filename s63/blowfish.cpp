@@ -1,4 +1,6 @@
 #include "blowfish.h"
+#include "blowfish_simd.h"
+#include "blowfish_internal.h"
 /*
  * BlowFish.cpp
  *
@@ -13,6 +15,7 @@
 #include <exception>
 #include <iostream>
 #include <cassert>
+#include <cstdint>
 
  //Initialization with a fixed string which consists of the hexadecimal digits of PI (less the initial 3)
  //P-array, 18 32-bit subkeys
@@ -297,13 +300,32 @@ CBlowFish::CBlowFish(const std::string& key, const SBlock& roChain) {
 }
 
 void CBlowFish::setKey(const std::string& key) {
+	initKey(key);
+	//Reflect P and S boxes through the evolving Blowfish
+	SBlock block(0UL, 0UL); //all-zero block
+	unsigned int i, j;
+	for (i = 0; i < 18; )
+		Encrypt(block), m_auiP[i++] = block.m_uil, m_auiP[i++] = block.m_uir;
+	for (j = 0; j < 4; j++)
+		for (int k = 0; k < 256; )
+			Encrypt(block), m_auiS[j][k++] = block.m_uil, m_auiS[j][k++] = block.m_uir;
+
+}
+
+void CBlowFish::setKeys(CBlowFish* bf, const std::string* keys, size_t count) {
+	size_t done = BlowFishSimd::expandKeys(bf, keys, count);
+	for (; done < count; ++done)
+		bf[done].setKey(keys[done]);
+}
+
+void CBlowFish::initKey(const std::string& key) {
 	int keysize = key.size();
 	if (keysize < 1)
 		throw std::runtime_error("Incorrect key length");
 	if (keysize > 56)
 		keysize = 56;
 	unsigned char aucLocalKey[56];
-	unsigned int i, j;
+	unsigned int i;
 	memcpy(aucLocalKey, key.data(), keysize);
 	//Reflexive Initialization of the Blowfish.
 	//Generating the Subkeys from the Key flood P and S boxes with PI
@@ -332,14 +354,6 @@ void CBlowFish::setKey(const std::string& key) {
 		}
 		m_auiP[i] ^= x;
 	}
-	//Reflect P and S boxes through the evolving Blowfish
-	SBlock block(0UL, 0UL); //all-zero block
-	for (i = 0; i < 18; )
-		Encrypt(block), m_auiP[i++] = block.m_uil, m_auiP[i++] = block.m_uir;
-	for (j = 0; j < 4; j++)
-		for (int k = 0; k < 256; )
-			Encrypt(block), m_auiS[j][k++] = block.m_uil, m_auiS[j][k++] = block.m_uir;
-
 }
 
 //Sixteen Round Encipher of Block
@@ -380,120 +394,168 @@ void CBlowFish::Decrypt(SBlock& block) const
 	block.m_uir = uiLeft;
 }
 
-//Semi-Portable Byte Shuffling
-inline void BytesToBlock(unsigned char const* p, SBlock& b)
+// Since ECB blocks are independent, BF_LANES blocks are processed together round by round.
+// This keeps several S-box lookups in flight instead of one long dependency chain per block.
+#define BF_LANES 4
+
+#define BF_LOAD(i) \
+	unsigned int l##i = load_be32(in + 8 * i), r##i = load_be32(in + 8 * i + 4)
+#define BF_STORE(i) \
+	store_be32(out + 8 * i, r##i), store_be32(out + 8 * i + 4, l##i)
+#define BF_ROUND(a, b, k) \
+	a##0 ^= F(b##0) ^ k; a##1 ^= F(b##1) ^ k; a##2 ^= F(b##2) ^ k; a##3 ^= F(b##3) ^ k
+
+void CBlowFish::EncryptBlocks(const unsigned char* in, unsigned char* out, size_t nblocks) const
 {
-	unsigned int y;
-	//Left
-	b.m_uil = 0;
-	y = *p++;
-	y <<= 24;
-	b.m_uil |= y;
-	y = *p++;
-	y <<= 16;
-	b.m_uil |= y;
-	y = *p++;
-	y <<= 8;
-	b.m_uil |= y;
-	y = *p++;
-	b.m_uil |= y;
-	//Right
-	b.m_uir = 0;
-	y = *p++;
-	y <<= 24;
-	b.m_uir |= y;
-	y = *p++;
-	y <<= 16;
-	b.m_uir |= y;
-	y = *p++;
-	y <<= 8;
-	b.m_uir |= y;
-	y = *p++;
-	b.m_uir |= y;
+	// Vector engine takes whole groups of blocks when available, the rest goes through the interleaved code
+	size_t done = BlowFishSimd::encryptBlocks(*this, in, out, nblocks);
+	in += 8 * done;
+	out += 8 * done;
+	nblocks -= done;
+
+	for (; nblocks >= BF_LANES; nblocks -= BF_LANES, in += 8 * BF_LANES, out += 8 * BF_LANES)
+	{
+		BF_LOAD(0); BF_LOAD(1); BF_LOAD(2); BF_LOAD(3);
+		l0 ^= m_auiP[0]; l1 ^= m_auiP[0]; l2 ^= m_auiP[0]; l3 ^= m_auiP[0];
+		for (int i = 1; i < 17; i += 2)
+		{
+			BF_ROUND(r, l, m_auiP[i]);
+			BF_ROUND(l, r, m_auiP[i + 1]);
+		}
+		r0 ^= m_auiP[17]; r1 ^= m_auiP[17]; r2 ^= m_auiP[17]; r3 ^= m_auiP[17];
+		BF_STORE(0); BF_STORE(1); BF_STORE(2); BF_STORE(3);
+	}
+	for (; nblocks; --nblocks, in += 8, out += 8)
+	{
+		SBlock work(load_be32(in), load_be32(in + 4));
+		Encrypt(work);
+		store_be32(out, work.m_uil);
+		store_be32(out + 4, work.m_uir);
+	}
 }
 
-inline void BlockToBytes(SBlock const& b, unsigned char* p)
+void CBlowFish::DecryptBlocks(const unsigned char* in, unsigned char* out, size_t nblocks) const
 {
-	unsigned int y;
-	//Right
-	y = b.m_uir;
-	*--p = extract_byte(y);
-	y = b.m_uir >> 8;
-	*--p = extract_byte(y);
-	y = b.m_uir >> 16;
-	*--p = extract_byte(y);
-	y = b.m_uir >> 24;
-	*--p = extract_byte(y);
-	//Left
-	y = b.m_uil;
-	*--p = extract_byte(y);
-	y = b.m_uil >> 8;
-	*--p = extract_byte(y);
-	y = b.m_uil >> 16;
-	*--p = extract_byte(y);
-	y = b.m_uil >> 24;
-	*--p = extract_byte(y);
+	// Vector engine takes whole groups of blocks when available, the rest goes through the interleaved code
+	size_t done = BlowFishSimd::decryptBlocks(*this, in, out, nblocks);
+	in += 8 * done;
+	out += 8 * done;
+	nblocks -= done;
+
+	for (; nblocks >= BF_LANES; nblocks -= BF_LANES, in += 8 * BF_LANES, out += 8 * BF_LANES)
+	{
+		BF_LOAD(0); BF_LOAD(1); BF_LOAD(2); BF_LOAD(3);
+		l0 ^= m_auiP[17]; l1 ^= m_auiP[17]; l2 ^= m_auiP[17]; l3 ^= m_auiP[17];
+		for (int i = 16; i > 0; i -= 2)
+		{
+			BF_ROUND(r, l, m_auiP[i]);
+			BF_ROUND(l, r, m_auiP[i - 1]);
+		}
+		r0 ^= m_auiP[0]; r1 ^= m_auiP[0]; r2 ^= m_auiP[0]; r3 ^= m_auiP[0];
+		BF_STORE(0); BF_STORE(1); BF_STORE(2); BF_STORE(3);
+	}
+	for (; nblocks; --nblocks, in += 8, out += 8)
+	{
+		SBlock work(load_be32(in), load_be32(in + 4));
+		Decrypt(work);
+		store_be32(out, work.m_uil);
+		store_be32(out + 4, work.m_uir);
+	}
 }
 
 void CBlowFish::decrypt(unsigned char* buf, size_t n) const {
 
+	decrypt(buf, buf, n);
+}
+
+void CBlowFish::decrypt(const unsigned char* in, unsigned char* out, size_t n) const {
 
 	if ((n == 0) || (n % 8 != 0))
 		throw std::runtime_error("Incorrect buffer length");
 
-	SBlock work;
-	for (; n >= 8; n -= 8)
-	{
-		BytesToBlock(buf, work);
-		Decrypt(work);
-		BlockToBytes(work, buf += 8);
-	}
-	
+	DecryptBlocks(in, out, n / 8);
 }
-void CBlowFish::decrypt(std::string& buf, bool remove_padding) const {
 
-	size_t n = buf.size();
+void CBlowFish::encrypt(unsigned char* buf, size_t n) const {
 
-	if ((n == 0) || (n % 8 != 0))
+	encrypt(buf, buf, n);
+}
+
+void CBlowFish::encrypt(const unsigned char* in, unsigned char* out, size_t n) const {
+
+	if (n % 8 != 0)
 		throw std::runtime_error("Incorrect buffer length");
 
+	EncryptBlocks(in, out, n / 8);
+}
+
+size_t CBlowFish::pad(unsigned char* buf, size_t len) {
+
+	// Add padding as per PKCS5
+	// Ref: RFC 5652 http://tools.ietf.org/html/rfc5652#section-6.3
+	size_t padded = paddedSize(len);
+	memset(buf + len, static_cast<int>(padded - len), padded - len);
+	return padded;
+}
+
+size_t CBlowFish::paddingLength(const unsigned char* buf, size_t len) {
+
+	if (len == 0)
+		return 0;
+	uint8_t padding_size = buf[len - 1];
+	if (padding_size != 0 && padding_size < len)
+		return padding_size;
+	return 0;
+}
+
+void CBlowFish::decrypt(std::string& buf, bool remove_padding) const {
+
 	unsigned char* char_buf = reinterpret_cast<unsigned char*>(&buf[0]);
-	SBlock work;
-	for (; n >= 8; n -= 8)
-	{
-		BytesToBlock(char_buf, work);
-		Decrypt(work);
-		BlockToBytes(work, char_buf += 8);
+	decrypt(char_buf, buf.size());
+
+	if (remove_padding) {
+		buf.resize(buf.size() - paddingLength(char_buf, buf.size()));
 	}
+}
+
+std::string CBlowFish::decryptConst(const std::string& buf, bool remove_padding) const {
+
+	size_t n = buf.size();
+	if ((n == 0) || (n % 8 != 0))
+		throw std::runtime_error("Incorrect buffer length");
+
+	std::string ret(n, '\0');
+	unsigned char* out = reinterpret_cast<unsigned char*>(&ret[0]);
+	DecryptBlocks(reinterpret_cast<const unsigned char*>(buf.data()), out, n / 8);
 	if (remove_padding) {
-		uint8_t padding_size = buf.back();
-		if(padding_size != 0 && padding_size < buf.size())
-		buf.erase(buf.size() - padding_size);
+		ret.resize(n - paddingLength(out, n));
 	}
+	return ret;
 }
 
 void CBlowFish::encrypt(std::string& buf) const {
-	
-
-	if (buf.size() % 8 != 0) {
-		// Add padding as per PKCS5
-		// Ref: RFC 5652 http://tools.ietf.org/html/rfc5652#section-6.3
-		uint8_t paddingLength = 8 - (buf.size() % 8);
-		std::string padding(paddingLength, static_cast<char>(paddingLength));
-		buf = buf + padding;
-		
-	}
-	
+
 	size_t n = buf.size();
-	assert(n % 8 == 0);
-	SBlock work;
+	buf.resize(paddedSize(n));
 	unsigned char* in = reinterpret_cast<unsigned char*>(&buf[0]);
-	for (; n >= 8; n -= 8)
-	{
-		BytesToBlock(in, work);
-		Encrypt(work);
-		BlockToBytes(work, in += 8);
-	}
+	n = pad(in, n);
+	EncryptBlocks(in, in, n / 8);
 
 }
 
+std::string CBlowFish::encryptConst(const std::string& buf) const {
+
+	// Whole blocks are encrypted straight from the source, only the last partial one is padded on the stack
+	size_t n = buf.size();
+	size_t whole = n & ~size_t(7);
+	std::string ret(paddedSize(n), '\0');
+	unsigned char* out = reinterpret_cast<unsigned char*>(&ret[0]);
+	EncryptBlocks(reinterpret_cast<const unsigned char*>(buf.data()), out, whole / 8);
+	if (whole != n) {
+		unsigned char last[8];
+		memcpy(last, buf.data() + whole, n - whole);
+		pad(last, n - whole);
+		EncryptBlocks(last, out + whole, 1);
+	}
+	return ret;
+}
@@ -47,22 +47,46 @@ public:
 	CBlowFish(const std::string& key, const SBlock& roChain = SBlock(0UL, 0UL));
 
 	void setKey(const std::string& key);
+	// Same as setKey() on bf[i] with keys[i], several keys are expanded at once in vector lanes
+	static void setKeys(CBlowFish* bf, const std::string* keys, size_t count);
 
 	void decrypt(std::string& buf, bool remove_padding = true) const;
-	inline std::string decryptConst(const std::string& buf, bool remove_padding = true) const;
-	void decrypt(unsigned char* buf, size_t len) const;
+	std::string decryptConst(const std::string& buf, bool remove_padding = true) const;
 
 	void encrypt(std::string& buf) const;
-	inline std::string encryptConst(const std::string& buf) const;
+	std::string encryptConst(const std::string& buf) const;
+
+	// Pointer/length API, works on caller memory without allocations.
+	// len must be a multiple of 8, in and out may be the same buffer.
+	void decrypt(unsigned char* buf, size_t len) const;
+	void decrypt(const unsigned char* in, unsigned char* out, size_t len) const;
+	void encrypt(unsigned char* buf, size_t len) const;
+	void encrypt(const unsigned char* in, unsigned char* out, size_t len) const;
+
+	// Size of len bytes after PKCS5 padding. Data of a multiple of 8 bytes is left as is.
+	static size_t paddedSize(size_t len) { return (len + 7) & ~size_t(7); }
+	// Writes the padding after len bytes of buf, which must have room for paddedSize(len) bytes.
+	// Returns the padded length.
+	static size_t pad(unsigned char* buf, size_t len);
+	// Length of the padding at the end of decrypted data, 0 if there is none
+	static size_t paddingLength(const unsigned char* buf, size_t len);
 	
 	//Resetting the chaining block
 	void ResetChain() { m_oChain = m_oChain0; }
 
 	//Private Functions
 private:
+	friend class BlowFishSimd;
+	friend class BlowFishMultiBuffer;
+
+	// Resets P and S to the initial values and mixes the key into P, the first half of setKey()
+	void initKey(const std::string& key);
 	unsigned int F(unsigned int ui) const;
 	void Encrypt(SBlock&) const;
 	void Decrypt(SBlock&) const;
+	// Bulk ECB kernels, in and out may point to the same buffer
+	void EncryptBlocks(const unsigned char* in, unsigned char* out, size_t nblocks) const;
+	void DecryptBlocks(const unsigned char* in, unsigned char* out, size_t nblocks) const;
 
 private:
 	//The Initialization Vector, by default {0, 0}
@@ -87,16 +111,4 @@ inline unsigned int CBlowFish::F(unsigned int ui) const
 }
 
 
-inline std::string CBlowFish::encryptConst(const std::string& buf) const {
-	std::string ret(buf);
-	encrypt(ret);
-	return ret;
-}
-
-inline std::string CBlowFish::decryptConst(const std::string& buf, bool remove_padding) const {
-	std::string ret(buf);
-	decrypt(ret,remove_padding);
-	return ret;
-}
-
 #endif // __BLOWFISH_H__
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "blowfish_cache.h"
+
+std::shared_ptr<const CBlowFish> CBlowFishCache::get(const std::string& key) {
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_index.find(key);
+		if (it != m_index.end()) {
+			m_lru.splice(m_lru.begin(), m_lru, it->second);
+			++m_hits;
+			return it->second->second;
+		}
+		++m_misses;
+	}
+
+	// Expand outside of the lock, it is the expensive part
+	auto bf = std::make_shared<CBlowFish>(key);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_index.find(key);
+	if (it != m_index.end()) {
+		// Someone else expanded the same key meanwhile
+		m_lru.splice(m_lru.begin(), m_lru, it->second);
+		return it->second->second;
+	}
+	m_lru.emplace_front(key, bf);
+	m_index[key] = m_lru.begin();
+	m_size += entrySize(key);
+	trim();
+	return bf;
+}
+
+void CBlowFishCache::trim() {
+	// The newest entry always stays, even if it alone exceeds the budget
+	while (m_size > m_budget && m_lru.size() > 1) {
+		const Entry& last = m_lru.back();
+		m_size -= entrySize(last.first);
+		m_index.erase(last.first);
+		m_lru.pop_back();
+	}
+}
+
+void CBlowFishCache::setBudget(size_t bytes) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_budget = bytes;
+	trim();
+}
+
+size_t CBlowFishCache::budget() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_budget;
+}
+
+size_t CBlowFishCache::size() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_size;
+}
+
+size_t CBlowFishCache::hits() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_hits;
+}
+
+size_t CBlowFishCache::misses() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_misses;
+}
+
+void CBlowFishCache::clear() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_lru.clear();
+	m_index.clear();
+	m_size = 0;
+}
+
+CBlowFishCache& CBlowFishCache::global() {
+	static CBlowFishCache cache;
+	return cache;
+}
@@ -0,0 +1,73 @@
+#pragma once
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "blowfish.h"
+
+// Bounded LRU cache of expanded Blowfish key schedules, keyed by the raw key bytes.
+// Expanding a key costs 521 block encryptions, while S-63 keeps using the same few keys
+// (HW_ID6 for permits, CK1/CK2 for all the update files of a cell).
+// Schedules are shared and immutable, so they can be used from several threads at once.
+class CBlowFishCache
+{
+public:
+	static const size_t DEFAULT_BUDGET = 1024 * 1024;
+
+	explicit CBlowFishCache(size_t budget = DEFAULT_BUDGET) : m_budget(budget) {}
+
+	// Returns the expanded schedule for a key, expanding it on a miss
+	std::shared_ptr<const CBlowFish> get(const std::string& key);
+
+	// Memory budget in bytes, least recently used schedules are dropped to stay within it
+	void setBudget(size_t bytes);
+	size_t budget() const;
+	size_t size() const;
+
+	size_t hits() const;
+	size_t misses() const;
+	void clear();
+
+	// Process-wide cache used by S63 and S63Client
+	static CBlowFishCache& global();
+
+private:
+	using Entry = std::pair<std::string, std::shared_ptr<const CBlowFish>>;
+
+	static size_t entrySize(const std::string& key) { return sizeof(CBlowFish) + sizeof(Entry) + key.size(); }
+	void trim();
+
+	mutable std::mutex m_mutex;
+	std::list<Entry> m_lru; // most recently used first
+	std::unordered_map<std::string, std::list<Entry>::iterator> m_index;
+	size_t m_budget;
+	size_t m_size = 0;
+	size_t m_hits = 0;
+	size_t m_misses = 0;
+};
@@ -0,0 +1,53 @@
+#pragma once
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Helpers shared by the Blowfish kernels in blowfish.cpp and blowfish_simd.cpp, not part of the public API.
+
+#include <cstdint>
+#include <cstring>
+
+// Word-sized big-endian access for the bulk kernels.
+// They assume a little-endian host, as does the rest of the library.
+#if defined(_MSC_VER)
+#include <stdlib.h>
+#define BF_BSWAP32(x) _byteswap_ulong(x)
+#else
+#define BF_BSWAP32(x) __builtin_bswap32(x)
+#endif
+
+inline unsigned int load_be32(const unsigned char* p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return BF_BSWAP32(v);
+}
+
+inline void store_be32(unsigned char* p, unsigned int v)
+{
+	uint32_t w = BF_BSWAP32(v);
+	memcpy(p, &w, 4);
+}
+
+#undef BF_BSWAP32
@@ -0,0 +1,704 @@
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "blowfish_simd.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include "blowfish.h"
+#include "blowfish_internal.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define BF_SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define BF_TARGET(isa)
+#else
+#define BF_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+// State of one lane of the multi-buffer engine
+struct MbLane {
+	unsigned char* pos;
+	size_t left;	// blocks left in the current job
+	size_t stride;	// 8 for a busy lane, 0 for an idle one which keeps spinning on its scratch block
+};
+
+#ifdef BF_SIMD_X86
+
+//////////////////////////////////////////////////////////////////////////////
+// AVX2: 8 blocks per vector, two vectors per step
+
+BF_TARGET("avx2")
+static inline __m256i F8(__m256i x, const int* S)
+{
+	const __m256i mask = _mm256_set1_epi32(0xff);
+	__m256i a = _mm256_i32gather_epi32(S, _mm256_srli_epi32(x, 24), 4);
+	__m256i b = _mm256_i32gather_epi32(S + 256, _mm256_and_si256(_mm256_srli_epi32(x, 16), mask), 4);
+	__m256i c = _mm256_i32gather_epi32(S + 512, _mm256_and_si256(_mm256_srli_epi32(x, 8), mask), 4);
+	__m256i d = _mm256_i32gather_epi32(S + 768, _mm256_and_si256(x, mask), 4);
+	return _mm256_add_epi32(_mm256_xor_si256(_mm256_add_epi32(a, b), c), d);
+}
+
+// Loads 8 big-endian blocks and splits them into left and right halves
+BF_TARGET("avx2")
+static inline void load8(const unsigned char* in, __m256i& l, __m256i& r)
+{
+	const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	const __m256i deinterleave = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+	__m256i a = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in)), bswap);
+	__m256i b = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 32)), bswap);
+	a = _mm256_permutevar8x32_epi32(a, deinterleave);
+	b = _mm256_permutevar8x32_epi32(b, deinterleave);
+	l = _mm256_permute2x128_si256(a, b, 0x20);
+	r = _mm256_permute2x128_si256(a, b, 0x31);
+}
+
+// Stores 8 blocks, the halves are swapped after the last round as in CBlowFish::Encrypt
+BF_TARGET("avx2")
+static inline void store8(unsigned char* out, __m256i l, __m256i r)
+{
+	const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	const __m256i interleave = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	__m256i a = _mm256_permute2x128_si256(r, l, 0x20);
+	__m256i b = _mm256_permute2x128_si256(r, l, 0x31);
+	a = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(a, interleave), bswap);
+	b = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(b, interleave), bswap);
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(out), a);
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 32), b);
+}
+
+BF_TARGET("avx2")
+static size_t cryptAvx2(const unsigned int* P, const unsigned int* Sbox, const unsigned char* in, unsigned char* out,
+	size_t nblocks, bool decrypt)
+{
+	const int* S = reinterpret_cast<const int*>(Sbox);
+	size_t done = 0;
+	for (; nblocks - done >= 16; done += 16, in += 128, out += 128)
+	{
+		__m256i l0, r0, l1, r1;
+		load8(in, l0, r0);
+		load8(in + 64, l1, r1);
+		__m256i k = _mm256_set1_epi32(P[decrypt ? 17 : 0]);
+		l0 = _mm256_xor_si256(l0, k);
+		l1 = _mm256_xor_si256(l1, k);
+		for (int i = 1; i < 17; i += 2)
+		{
+			k = _mm256_set1_epi32(P[decrypt ? 17 - i : i]);
+			r0 = _mm256_xor_si256(r0, _mm256_xor_si256(F8(l0, S), k));
+			r1 = _mm256_xor_si256(r1, _mm256_xor_si256(F8(l1, S), k));
+			k = _mm256_set1_epi32(P[decrypt ? 16 - i : i + 1]);
+			l0 = _mm256_xor_si256(l0, _mm256_xor_si256(F8(r0, S), k));
+			l1 = _mm256_xor_si256(l1, _mm256_xor_si256(F8(r1, S), k));
+		}
+		k = _mm256_set1_epi32(P[decrypt ? 0 : 17]);
+		r0 = _mm256_xor_si256(r0, k);
+		r1 = _mm256_xor_si256(r1, k);
+		store8(out, l0, r0);
+		store8(out + 64, l1, r1);
+	}
+	return done;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// AVX-512: 16 blocks per vector, two vectors per step
+
+BF_TARGET("avx512f")
+static inline __m512i F16(__m512i x, const int* S)
+{
+	const __m512i mask = _mm512_set1_epi32(0xff);
+	__m512i a = _mm512_i32gather_epi32(_mm512_srli_epi32(x, 24), S, 4);
+	__m512i b = _mm512_i32gather_epi32(_mm512_and_si512(_mm512_srli_epi32(x, 16), mask), S + 256, 4);
+	__m512i c = _mm512_i32gather_epi32(_mm512_and_si512(_mm512_srli_epi32(x, 8), mask), S + 512, 4);
+	__m512i d = _mm512_i32gather_epi32(_mm512_and_si512(x, mask), S + 768, 4);
+	return _mm512_add_epi32(_mm512_xor_si512(_mm512_add_epi32(a, b), c), d);
+}
+
+// AVX512F has no byte shuffle, so the byte swap is done with rotates
+BF_TARGET("avx512f")
+static inline __m512i bswap16(__m512i x)
+{
+	const __m512i even = _mm512_set1_epi32(0x00ff00ff);
+	return _mm512_or_si512(_mm512_andnot_si512(even, _mm512_ror_epi32(x, 8)),
+		_mm512_and_si512(even, _mm512_rol_epi32(x, 8)));
+}
+
+BF_TARGET("avx512f")
+static inline void load16(const unsigned char* in, __m512i& l, __m512i& r)
+{
+	const __m512i even = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+	const __m512i odd = _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31);
+	__m512i a = bswap16(_mm512_loadu_si512(in));
+	__m512i b = bswap16(_mm512_loadu_si512(in + 64));
+	l = _mm512_permutex2var_epi32(a, even, b);
+	r = _mm512_permutex2var_epi32(a, odd, b);
+}
+
+BF_TARGET("avx512f")
+static inline void store16(unsigned char* out, __m512i l, __m512i r)
+{
+	const __m512i lo = _mm512_setr_epi32(0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23);
+	const __m512i hi = _mm512_setr_epi32(8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31);
+	_mm512_storeu_si512(out, bswap16(_mm512_permutex2var_epi32(r, lo, l)));
+	_mm512_storeu_si512(out + 64, bswap16(_mm512_permutex2var_epi32(r, hi, l)));
+}
+
+BF_TARGET("avx512f")
+static size_t cryptAvx512(const unsigned int* P, const unsigned int* Sbox, const unsigned char* in, unsigned char* out,
+	size_t nblocks, bool decrypt)
+{
+	const int* S = reinterpret_cast<const int*>(Sbox);
+	size_t done = 0;
+	for (; nblocks - done >= 32; done += 32, in += 256, out += 256)
+	{
+		__m512i l0, r0, l1, r1;
+		load16(in, l0, r0);
+		load16(in + 128, l1, r1);
+		__m512i k = _mm512_set1_epi32(P[decrypt ? 17 : 0]);
+		l0 = _mm512_xor_si512(l0, k);
+		l1 = _mm512_xor_si512(l1, k);
+		for (int i = 1; i < 17; i += 2)
+		{
+			k = _mm512_set1_epi32(P[decrypt ? 17 - i : i]);
+			r0 = _mm512_xor_si512(r0, _mm512_xor_si512(F16(l0, S), k));
+			r1 = _mm512_xor_si512(r1, _mm512_xor_si512(F16(l1, S), k));
+			k = _mm512_set1_epi32(P[decrypt ? 16 - i : i + 1]);
+			l0 = _mm512_xor_si512(l0, _mm512_xor_si512(F16(r0, S), k));
+			l1 = _mm512_xor_si512(l1, _mm512_xor_si512(F16(r1, S), k));
+		}
+		k = _mm512_set1_epi32(P[decrypt ? 0 : 17]);
+		r0 = _mm512_xor_si512(r0, k);
+		r1 = _mm512_xor_si512(r1, k);
+		store16(out, l0, r0);
+		store16(out + 128, l1, r1);
+	}
+	return done;
+}
+
+static bool cpuSupports(BlowFishSimd::Isa isa)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+	int regs[4];
+	__cpuid(regs, 0);
+	if (regs[0] < 7)
+		return false;
+	__cpuid(regs, 1);
+	// OSXSAVE and AVX
+	if ((regs[2] & (1 << 27)) == 0 || (regs[2] & (1 << 28)) == 0)
+		return false;
+	unsigned long long xcr0 = _xgetbv(0);
+	__cpuidex(regs, 7, 0);
+	if (isa == BlowFishSimd::ISA_AVX2)
+		return (xcr0 & 0x6) == 0x6 && (regs[1] & (1 << 5)) != 0;
+	if (isa == BlowFishSimd::ISA_AVX512)
+		return (xcr0 & 0xe6) == 0xe6 && (regs[1] & (1 << 16)) != 0;
+	return true;
+#else
+	__builtin_cpu_init();
+	if (isa == BlowFishSimd::ISA_AVX2)
+		return __builtin_cpu_supports("avx2");
+	if (isa == BlowFishSimd::ISA_AVX512)
+		return __builtin_cpu_supports("avx512f");
+	return true;
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Multi-buffer kernels. Every lane has its own copy of the S-boxes in the arena (1024 words per lane)
+// and its own P-array in a transposed table, P[i][lane].
+
+BF_TARGET("avx2")
+static inline __m256i F8mb(__m256i x, const int* arena, __m256i base)
+{
+	const __m256i mask = _mm256_set1_epi32(0xff);
+	__m256i a = _mm256_i32gather_epi32(arena, _mm256_add_epi32(base, _mm256_srli_epi32(x, 24)), 4);
+	__m256i b = _mm256_i32gather_epi32(arena + 256, _mm256_add_epi32(base, _mm256_and_si256(_mm256_srli_epi32(x, 16), mask)), 4);
+	__m256i c = _mm256_i32gather_epi32(arena + 512, _mm256_add_epi32(base, _mm256_and_si256(_mm256_srli_epi32(x, 8), mask)), 4);
+	__m256i d = _mm256_i32gather_epi32(arena + 768, _mm256_add_epi32(base, _mm256_and_si256(x, mask)), 4);
+	return _mm256_add_epi32(_mm256_xor_si256(_mm256_add_epi32(a, b), c), d);
+}
+
+// Two blocks of every lane go through the rounds together to hide the gather latency.
+// An odd last step runs the same block twice.
+BF_TARGET("avx2")
+static void mbStepsAvx2(const unsigned int* P, const int* arena, MbLane* lanes, size_t steps, bool decrypt)
+{
+	const __m256i base = _mm256_setr_epi32(0, 1024, 2048, 3072, 4096, 5120, 6144, 7168);
+	alignas(32) unsigned int l[2][8], r[2][8];
+	while (steps)
+	{
+		const size_t n = steps >= 2 ? 2 : 1;
+		for (int j = 0; j < 8; ++j) {
+			const unsigned char* second = lanes[j].pos + (n - 1) * lanes[j].stride;
+			l[0][j] = load_be32(lanes[j].pos);
+			r[0][j] = load_be32(lanes[j].pos + 4);
+			l[1][j] = load_be32(second);
+			r[1][j] = load_be32(second + 4);
+		}
+		__m256i p = _mm256_load_si256(reinterpret_cast<const __m256i*>(P + 8 * (decrypt ? 17 : 0)));
+		__m256i L0 = _mm256_xor_si256(_mm256_load_si256(reinterpret_cast<const __m256i*>(l[0])), p);
+		__m256i L1 = _mm256_xor_si256(_mm256_load_si256(reinterpret_cast<const __m256i*>(l[1])), p);
+		__m256i R0 = _mm256_load_si256(reinterpret_cast<const __m256i*>(r[0]));
+		__m256i R1 = _mm256_load_si256(reinterpret_cast<const __m256i*>(r[1]));
+		for (int i = 1; i < 17; i += 2)
+		{
+			p = _mm256_load_si256(reinterpret_cast<const __m256i*>(P + 8 * (decrypt ? 17 - i : i)));
+			R0 = _mm256_xor_si256(R0, _mm256_xor_si256(F8mb(L0, arena, base), p));
+			R1 = _mm256_xor_si256(R1, _mm256_xor_si256(F8mb(L1, arena, base), p));
+			p = _mm256_load_si256(reinterpret_cast<const __m256i*>(P + 8 * (decrypt ? 16 - i : i + 1)));
+			L0 = _mm256_xor_si256(L0, _mm256_xor_si256(F8mb(R0, arena, base), p));
+			L1 = _mm256_xor_si256(L1, _mm256_xor_si256(F8mb(R1, arena, base), p));
+		}
+		p = _mm256_load_si256(reinterpret_cast<const __m256i*>(P + 8 * (decrypt ? 0 : 17)));
+		_mm256_store_si256(reinterpret_cast<__m256i*>(l[0]), L0);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(l[1]), L1);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(r[0]), _mm256_xor_si256(R0, p));
+		_mm256_store_si256(reinterpret_cast<__m256i*>(r[1]), _mm256_xor_si256(R1, p));
+		for (int j = 0; j < 8; ++j) {
+			unsigned char* second = lanes[j].pos + (n - 1) * lanes[j].stride;
+			store_be32(lanes[j].pos, r[0][j]);
+			store_be32(lanes[j].pos + 4, l[0][j]);
+			store_be32(second, r[1][j]);
+			store_be32(second + 4, l[1][j]);
+			lanes[j].pos += n * lanes[j].stride;
+		}
+		steps -= n;
+	}
+}
+
+BF_TARGET("avx512f")
+static inline __m512i F16mb(__m512i x, const int* arena, __m512i base)
+{
+	const __m512i mask = _mm512_set1_epi32(0xff);
+	__m512i a = _mm512_i32gather_epi32(_mm512_add_epi32(base, _mm512_srli_epi32(x, 24)), arena, 4);
+	__m512i b = _mm512_i32gather_epi32(_mm512_add_epi32(base, _mm512_and_si512(_mm512_srli_epi32(x, 16), mask)), arena + 256, 4);
+	__m512i c = _mm512_i32gather_epi32(_mm512_add_epi32(base, _mm512_and_si512(_mm512_srli_epi32(x, 8), mask)), arena + 512, 4);
+	__m512i d = _mm512_i32gather_epi32(_mm512_add_epi32(base, _mm512_and_si512(x, mask)), arena + 768, 4);
+	return _mm512_add_epi32(_mm512_xor_si512(_mm512_add_epi32(a, b), c), d);
+}
+
+BF_TARGET("avx512f")
+static void mbStepsAvx512(const unsigned int* P, const int* arena, MbLane* lanes, size_t steps, bool decrypt)
+{
+	const __m512i base = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+		_mm512_set1_epi32(1024));
+	alignas(64) unsigned int l[2][16], r[2][16];
+	while (steps)
+	{
+		const size_t n = steps >= 2 ? 2 : 1;
+		for (int j = 0; j < 16; ++j) {
+			const unsigned char* second = lanes[j].pos + (n - 1) * lanes[j].stride;
+			l[0][j] = load_be32(lanes[j].pos);
+			r[0][j] = load_be32(lanes[j].pos + 4);
+			l[1][j] = load_be32(second);
+			r[1][j] = load_be32(second + 4);
+		}
+		__m512i p = _mm512_load_si512(P + 16 * (decrypt ? 17 : 0));
+		__m512i L0 = _mm512_xor_si512(_mm512_load_si512(l[0]), p);
+		__m512i L1 = _mm512_xor_si512(_mm512_load_si512(l[1]), p);
+		__m512i R0 = _mm512_load_si512(r[0]);
+		__m512i R1 = _mm512_load_si512(r[1]);
+		for (int i = 1; i < 17; i += 2)
+		{
+			p = _mm512_load_si512(P + 16 * (decrypt ? 17 - i : i));
+			R0 = _mm512_xor_si512(R0, _mm512_xor_si512(F16mb(L0, arena, base), p));
+			R1 = _mm512_xor_si512(R1, _mm512_xor_si512(F16mb(L1, arena, base), p));
+			p = _mm512_load_si512(P + 16 * (decrypt ? 16 - i : i + 1));
+			L0 = _mm512_xor_si512(L0, _mm512_xor_si512(F16mb(R0, arena, base), p));
+			L1 = _mm512_xor_si512(L1, _mm512_xor_si512(F16mb(R1, arena, base), p));
+		}
+		p = _mm512_load_si512(P + 16 * (decrypt ? 0 : 17));
+		_mm512_store_si512(l[0], L0);
+		_mm512_store_si512(l[1], L1);
+		_mm512_store_si512(r[0], _mm512_xor_si512(R0, p));
+		_mm512_store_si512(r[1], _mm512_xor_si512(R1, p));
+		for (int j = 0; j < 16; ++j) {
+			unsigned char* second = lanes[j].pos + (n - 1) * lanes[j].stride;
+			store_be32(lanes[j].pos, r[0][j]);
+			store_be32(lanes[j].pos + 4, l[0][j]);
+			store_be32(second, r[1][j]);
+			store_be32(second + 4, l[1][j]);
+			lanes[j].pos += n * lanes[j].stride;
+		}
+		steps -= n;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Batched key expansion. Every lane runs the setKey() chain of its own key on its own P and S
+// (same arena layout as the multi-buffer engine), the outputs are written back after every encryption.
+
+BF_TARGET("avx2")
+static void expandAvx2(unsigned int* P, int* arena)
+{
+	const __m256i base = _mm256_setr_epi32(0, 1024, 2048, 3072, 4096, 5120, 6144, 7168);
+	alignas(32) unsigned int l[8], r[8];
+	__m256i L = _mm256_setzero_si256(), R = _mm256_setzero_si256();
+	for (int n = 0; n < 9 + 512; ++n)
+	{
+		L = _mm256_xor_si256(L, _mm256_load_si256(reinterpret_cast<const __m256i*>(P)));
+		for (int i = 1; i < 17; i += 2)
+		{
+			R = _mm256_xor_si256(R, _mm256_xor_si256(F8mb(L, arena, base), _mm256_load_si256(reinterpret_cast<const __m256i*>(P + 8 * i))));
+			L = _mm256_xor_si256(L, _mm256_xor_si256(F8mb(R, arena, base), _mm256_load_si256(reinterpret_cast<const __m256i*>(P + 8 * (i + 1)))));
+		}
+		__m256i t = _mm256_xor_si256(R, _mm256_load_si256(reinterpret_cast<const __m256i*>(P + 8 * 17)));
+		R = L;
+		L = t;
+		if (n < 9) {
+			_mm256_store_si256(reinterpret_cast<__m256i*>(P + 16 * n), L);
+			_mm256_store_si256(reinterpret_cast<__m256i*>(P + 16 * n + 8), R);
+		}
+		else {
+			const int k = 2 * (n - 9);
+			_mm256_store_si256(reinterpret_cast<__m256i*>(l), L);
+			_mm256_store_si256(reinterpret_cast<__m256i*>(r), R);
+			for (int j = 0; j < 8; ++j) {
+				arena[1024 * j + k] = l[j];
+				arena[1024 * j + k + 1] = r[j];
+			}
+		}
+	}
+}
+
+BF_TARGET("avx512f")
+static void expandAvx512(unsigned int* P, int* arena)
+{
+	const __m512i base = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+		_mm512_set1_epi32(1024));
+	__m512i L = _mm512_setzero_si512(), R = _mm512_setzero_si512();
+	for (int n = 0; n < 9 + 512; ++n)
+	{
+		L = _mm512_xor_si512(L, _mm512_load_si512(P));
+		for (int i = 1; i < 17; i += 2)
+		{
+			R = _mm512_xor_si512(R, _mm512_xor_si512(F16mb(L, arena, base), _mm512_load_si512(P + 16 * i)));
+			L = _mm512_xor_si512(L, _mm512_xor_si512(F16mb(R, arena, base), _mm512_load_si512(P + 16 * (i + 1))));
+		}
+		__m512i t = _mm512_xor_si512(R, _mm512_load_si512(P + 16 * 17));
+		R = L;
+		L = t;
+		if (n < 9) {
+			_mm512_store_si512(P + 32 * n, L);
+			_mm512_store_si512(P + 32 * n + 16, R);
+		}
+		else {
+			const int k = 2 * (n - 9);
+			_mm512_i32scatter_epi32(arena + k, base, L, 4);
+			_mm512_i32scatter_epi32(arena + k + 1, base, R, 4);
+		}
+	}
+}
+
+#endif // BF_SIMD_X86
+
+static size_t crypt(BlowFishSimd::Isa isa, const unsigned int* P, const unsigned int* S,
+	const unsigned char* in, unsigned char* out, size_t nblocks, bool decrypt)
+{
+#ifdef BF_SIMD_X86
+	switch (isa) {
+	case BlowFishSimd::ISA_AVX2:
+		return cryptAvx2(P, S, in, out, nblocks, decrypt);
+	case BlowFishSimd::ISA_AVX512:
+		return cryptAvx512(P, S, in, out, nblocks, decrypt);
+	default:
+		break;
+	}
+#endif
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+std::atomic<BlowFishSimd::Isa>& BlowFishSimd::current() {
+	static std::atomic<Isa> isa(detect());
+	return isa;
+}
+
+BlowFishSimd::Isa BlowFishSimd::detect() {
+#ifdef BF_SIMD_X86
+	for (Isa isa : { ISA_AVX512, ISA_AVX2 }) {
+		if (cpuSupports(isa) && selfTest(isa))
+			return isa;
+	}
+#endif
+	return ISA_SCALAR;
+}
+
+BlowFishSimd::Isa BlowFishSimd::isa() {
+	return current().load(std::memory_order_relaxed);
+}
+
+BlowFishSimd::Isa BlowFishSimd::setIsa(Isa isa) {
+#ifdef BF_SIMD_X86
+	while (isa != ISA_SCALAR && !(cpuSupports(isa) && selfTest(isa)))
+		isa = static_cast<Isa>(isa - 1);
+#else
+	isa = ISA_SCALAR;
+#endif
+	current().store(isa, std::memory_order_relaxed);
+	return isa;
+}
+
+const char* BlowFishSimd::isaName(Isa isa) {
+	switch (isa) {
+	case ISA_AVX2: return "AVX2";
+	case ISA_AVX512: return "AVX-512";
+	default: return "scalar";
+	}
+}
+
+size_t BlowFishSimd::lanes() {
+	switch (isa()) {
+	case ISA_AVX2: return 16;
+	case ISA_AVX512: return 32;
+	default: return 0;
+	}
+}
+
+size_t BlowFishSimd::encryptBlocks(const CBlowFish& bf, const unsigned char* in, unsigned char* out, size_t nblocks) {
+	return crypt(isa(), bf.m_auiP, &bf.m_auiS[0][0], in, out, nblocks, false);
+}
+
+size_t BlowFishSimd::decryptBlocks(const CBlowFish& bf, const unsigned char* in, unsigned char* out, size_t nblocks) {
+	return crypt(isa(), bf.m_auiP, &bf.m_auiS[0][0], in, out, nblocks, true);
+}
+
+size_t BlowFishSimd::keyLanes() {
+	switch (isa()) {
+	case ISA_AVX2: return 8;
+	case ISA_AVX512: return 16;
+	default: return 0;
+	}
+}
+
+size_t BlowFishSimd::expandKeys(CBlowFish* bf, const std::string* keys, size_t count) {
+
+	const Isa isa = BlowFishSimd::isa();
+	const size_t n = keyLanes();
+	if (n == 0 || count < n)
+		return 0;
+
+	std::vector<unsigned int> arena(1024 * n + 16);
+	std::vector<unsigned int> ptable(18 * n + 16);
+	unsigned int* S = reinterpret_cast<unsigned int*>((reinterpret_cast<uintptr_t>(arena.data()) + 63) & ~uintptr_t(63));
+	unsigned int* P = reinterpret_cast<unsigned int*>((reinterpret_cast<uintptr_t>(ptable.data()) + 63) & ~uintptr_t(63));
+
+	size_t done = 0;
+	for (; count - done >= n; done += n) {
+		for (size_t j = 0; j < n; ++j) {
+			CBlowFish& b = bf[done + j];
+			b.initKey(keys[done + j]);
+			memcpy(S + 1024 * j, b.m_auiS, sizeof(b.m_auiS));
+			for (int i = 0; i < 18; ++i)
+				P[i * n + j] = b.m_auiP[i];
+		}
+		switch (isa) {
+#ifdef BF_SIMD_X86
+		case ISA_AVX2:
+			expandAvx2(P, reinterpret_cast<int*>(S));
+			break;
+		case ISA_AVX512:
+			expandAvx512(P, reinterpret_cast<int*>(S));
+			break;
+#endif
+		default:
+			return 0;
+		}
+		for (size_t j = 0; j < n; ++j) {
+			CBlowFish& b = bf[done + j];
+			memcpy(b.m_auiS, S + 1024 * j, sizeof(b.m_auiS));
+			for (int i = 0; i < 18; ++i)
+				b.m_auiP[i] = P[i * n + j];
+		}
+	}
+	return done;
+}
+
+// Compares the vector path with the single block scalar code on a pseudo-random buffer
+bool BlowFishSimd::selfTest(Isa isa) {
+
+	const size_t nblocks = 64 + 7;
+	unsigned char plain[nblocks * 8], vec[nblocks * 8], ref[nblocks * 8];
+	unsigned int seed = 0x12345678;
+	for (size_t i = 0; i < sizeof(plain); ++i) {
+		seed = seed * 1103515245 + 12345;
+		plain[i] = static_cast<unsigned char>(seed >> 16);
+	}
+
+	CBlowFish bf(std::string("S63 self-test key"));
+
+	for (bool decrypt : { false, true }) {
+		size_t done = crypt(isa, bf.m_auiP, &bf.m_auiS[0][0], plain, vec, nblocks, decrypt);
+		if (done == 0 || done > nblocks) {
+			return false;
+		}
+		for (size_t i = 0; i < done; ++i) {
+			const unsigned char* p = plain + i * 8;
+			SBlock block((p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3], (p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7]);
+			decrypt ? bf.Decrypt(block) : bf.Encrypt(block);
+			for (int j = 0; j < 4; ++j) {
+				ref[i * 8 + j] = static_cast<unsigned char>(block.m_uil >> (24 - 8 * j));
+				ref[i * 8 + 4 + j] = static_cast<unsigned char>(block.m_uir >> (24 - 8 * j));
+			}
+		}
+		if (memcmp(vec, ref, done * 8) != 0) {
+			printf("Blowfish %s self-test failed, falling back\n", isaName(isa));
+			return false;
+		}
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Multi-buffer engine
+
+size_t BlowFishMultiBuffer::lanes() {
+	switch (BlowFishSimd::isa()) {
+	case BlowFishSimd::ISA_AVX2: return 8;
+	case BlowFishSimd::ISA_AVX512: return 16;
+	default: return 1;
+	}
+}
+
+void BlowFishMultiBuffer::add(const CBlowFish& bf, unsigned char* buf, size_t len) {
+
+	if (len % 8 != 0)
+		throw std::runtime_error("Incorrect buffer length");
+	if (len != 0)
+		m_jobs.push_back({ &bf, buf, len / 8 });
+}
+
+void BlowFishMultiBuffer::decrypt() {
+	run(true);
+}
+
+void BlowFishMultiBuffer::encrypt() {
+	run(false);
+}
+
+void BlowFishMultiBuffer::run(bool decrypt) {
+
+	if (m_jobs.empty())
+		return;
+
+	const BlowFishSimd::Isa isa = BlowFishSimd::isa();
+	if (isa == BlowFishSimd::ISA_SCALAR) {
+		// Without gathers a lane per key does not pay off, the single key path
+		// interleaves the blocks of a buffer instead
+		for (const Job& job : m_jobs) {
+			if (decrypt)
+				job.bf->DecryptBlocks(job.buf, job.buf, job.nblocks);
+			else
+				job.bf->EncryptBlocks(job.buf, job.buf, job.nblocks);
+		}
+		m_jobs.clear();
+		return;
+	}
+	const size_t n = lanes();
+
+	std::vector<MbLane> lane(n);
+	std::vector<const CBlowFish*> lane_bf(n);
+	std::vector<unsigned char> scratch(8 * n);
+	// Every lane reads its S-boxes from the arena and its P-array from the transposed table
+	std::vector<unsigned int> arena(1024 * n + 16);
+	std::vector<unsigned int> ptable(18 * n + 16);
+	unsigned int* S = reinterpret_cast<unsigned int*>((reinterpret_cast<uintptr_t>(arena.data()) + 63) & ~uintptr_t(63));
+	unsigned int* P = reinterpret_cast<unsigned int*>((reinterpret_cast<uintptr_t>(ptable.data()) + 63) & ~uintptr_t(63));
+
+	for (size_t j = 0; j < n; ++j)
+		lane[j] = { &scratch[8 * j], 0, 0 };
+
+	size_t next = 0;
+	for (;;) {
+		// Give every free lane the next job
+		size_t busy = 0;
+		size_t steps = SIZE_MAX;
+		for (size_t j = 0; j < n; ++j) {
+			MbLane& l = lane[j];
+			if (l.left == 0) {
+				if (next < m_jobs.size()) {
+					const Job& job = m_jobs[next++];
+					l = { job.buf, job.nblocks, 8 };
+					lane_bf[j] = job.bf;
+					memcpy(S + 1024 * j, job.bf->m_auiS, sizeof(job.bf->m_auiS));
+					for (int i = 0; i < 18; ++i)
+						P[i * n + j] = job.bf->m_auiP[i];
+				}
+				else {
+					l = { &scratch[8 * j], 0, 0 };
+				}
+			}
+			if (l.left) {
+				++busy;
+				if (l.left < steps)
+					steps = l.left;
+			}
+		}
+		if (busy == 0)
+			break;
+
+		// The queue is drained and most lanes idle, the single key path is faster for what is left
+		if (next == m_jobs.size() && busy * 2 <= n) {
+			for (size_t j = 0; j < n; ++j) {
+				if (lane[j].left == 0)
+					continue;
+				const CBlowFish& bf = *lane_bf[j];
+				if (decrypt)
+					bf.DecryptBlocks(lane[j].pos, lane[j].pos, lane[j].left);
+				else
+					bf.EncryptBlocks(lane[j].pos, lane[j].pos, lane[j].left);
+			}
+			break;
+		}
+
+		// All busy lanes can run until the shortest job ends without any bookkeeping
+		switch (isa) {
+#ifdef BF_SIMD_X86
+		case BlowFishSimd::ISA_AVX2:
+			mbStepsAvx2(P, reinterpret_cast<const int*>(S), lane.data(), steps, decrypt);
+			break;
+		case BlowFishSimd::ISA_AVX512:
+			mbStepsAvx512(P, reinterpret_cast<const int*>(S), lane.data(), steps, decrypt);
+			break;
+#endif
+		default:
+			break;
+		}
+
+		for (size_t j = 0; j < n; ++j) {
+			if (lane[j].left)
+				lane[j].left -= steps;
+		}
+	}
+
+	m_jobs.clear();
+}
@@ -0,0 +1,102 @@
+#pragma once
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+class CBlowFish;
+
+// Vectorized Blowfish ECB engine.
+// F() is evaluated for 8 (AVX2) or 16 (AVX-512) blocks at once with gather instructions.
+// The instruction set is picked at runtime via CPUID, and on first use its output is checked
+// against the scalar CBlowFish code. If the check fails, the scalar path is used.
+class BlowFishSimd
+{
+public:
+	enum Isa {
+		ISA_SCALAR,
+		ISA_AVX2,
+		ISA_AVX512
+	};
+
+	// Instruction set currently in use
+	static Isa isa();
+	// Forces a given instruction set (for testing), returns the one actually selected.
+	// An unsupported request falls back to the best available one below it.
+	static Isa setIsa(Isa isa);
+	static const char* isaName(Isa isa);
+
+	// Blocks processed per step, 0 for the scalar path
+	static size_t lanes();
+
+	// Process as many whole steps of lanes() blocks as possible.
+	// Returns the number of 8-byte blocks done, the rest is left to the caller.
+	static size_t encryptBlocks(const CBlowFish& bf, const unsigned char* in, unsigned char* out, size_t nblocks);
+	static size_t decryptBlocks(const CBlowFish& bf, const unsigned char* in, unsigned char* out, size_t nblocks);
+
+	// Keys expanded side by side by expandKeys(), 0 for the scalar path
+	static size_t keyLanes();
+	// Runs setKey() for as many whole groups of keyLanes() keys as possible, every key in its own lane.
+	// Returns the number of keys done, the rest is left to the caller.
+	static size_t expandKeys(CBlowFish* bf, const std::string* keys, size_t count);
+
+private:
+	static Isa detect();
+	static bool selfTest(Isa isa);
+	static std::atomic<Isa>& current();
+};
+
+// Multi-buffer engine: processes many independent buffers, each with its own key schedule, together.
+// Every lane works on a different buffer and takes the next job as soon as its own one is done,
+// so a stream of small cells with different keys still keeps all the lanes busy.
+class BlowFishMultiBuffer
+{
+public:
+	// Queues a job. bf and buf must stay alive until decrypt() or encrypt() returns,
+	// len must be a multiple of 8.
+	void add(const CBlowFish& bf, unsigned char* buf, size_t len);
+	// Process all the queued jobs in place and clear the queue
+	void decrypt();
+	void encrypt();
+
+	size_t size() const { return m_jobs.size(); }
+	void clear() { m_jobs.clear(); }
+
+	// Number of buffers processed side by side with the current instruction set,
+	// 1 when there are no vector gathers and the buffers are simply done one by one
+	static size_t lanes();
+
+private:
+	struct Job {
+		const CBlowFish* bf;
+		unsigned char* buf;
+		size_t nblocks;
+	};
+	void run(bool decrypt);
+
+	std::vector<Job> m_jobs;
+};
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "buffer_pool.h"
+
+#include <atomic>
+
+// Rounds a size up to its class: 4 KB, then four steps per power of two
+size_t BufferPool::classSize(size_t size, size_t& index) {
+
+	if (size <= MIN_SIZE) {
+		index = 0;
+		return MIN_SIZE;
+	}
+	unsigned k = 12;	// 2^k < size <= 2^(k+1)
+	while ((size_t(1) << (k + 1)) < size)
+		++k;
+	size_t step = (size_t(1) << k) / 4;
+	size_t q = (size - (size_t(1) << k) + step - 1) / step;
+	index = 1 + (k - 12) * 4 + (q - 1);
+	return (size_t(1) << k) + q * step;
+}
+
+std::shared_ptr<char> BufferPool::allocate(size_t size) {
+
+	if (size <= MAX_SIZE) {
+		size_t index;
+		size_t class_size = classSize(size, index);
+		auto& blocks = m_blocks[index];
+		for (auto& block : blocks) {
+			// Only the pool holds it, whoever used it last has let it go
+			if (block.use_count() == 1) {
+				std::atomic_thread_fence(std::memory_order_acquire);
+				return std::shared_ptr<char>(block, block->data.get());
+			}
+		}
+		if (blocks.size() < MAX_BLOCKS && m_bytes + class_size <= m_budget) {
+			auto block = std::make_shared<Block>();
+			block->data.reset(new char[class_size]);
+			block->size = class_size;
+			blocks.push_back(block);
+			m_bytes += class_size;
+			++m_heap_allocations;
+			return std::shared_ptr<char>(block, block->data.get());
+		}
+	}
+	++m_heap_allocations;
+	return std::shared_ptr<char>(new char[size ? size : 1], std::default_delete<char[]>());
+}
+
+void BufferPool::trim() {
+
+	for (auto& blocks : m_blocks) {
+		for (size_t i = 0; i < blocks.size();) {
+			if (blocks[i].use_count() == 1) {
+				m_bytes -= blocks[i]->size;
+				blocks[i] = std::move(blocks.back());
+				blocks.pop_back();
+			}
+			else {
+				++i;
+			}
+		}
+	}
+}
+
+BufferPool& BufferPool::local() {
+	static thread_local BufferPool pool;
+	return pool;
+}
@@ -0,0 +1,73 @@
+#pragma once
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Per-thread pool of reusable buffers in size classes, four per power of two from 4 KB up to 64 MB.
+// A handed out buffer is free again once its last reference is dropped, on any thread,
+// so a thread decoding cell after cell keeps getting the same few blocks back without touching the heap.
+// Bigger buffers, and buffers which do not fit the pool budget any more, are plain allocations.
+// The budget holds for each thread, the worker threads of ThreadPool and CellLoader trim their pool when idle.
+class BufferPool
+{
+public:
+	static const size_t MIN_SIZE = 4 * 1024;
+	static const size_t MAX_SIZE = 64 * 1024 * 1024;
+	static const size_t DEFAULT_BUDGET = 8 * 1024 * 1024;	// a decrypted cell and its input
+
+	explicit BufferPool(size_t budget = DEFAULT_BUDGET) : m_budget(budget) {}
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator=(const BufferPool&) = delete;
+
+	// Uninitialized buffer of at least size bytes
+	std::shared_ptr<char> allocate(size_t size);
+
+	// Bytes of the blocks owned by the pool, handed out or free
+	size_t pooledBytes() const { return m_bytes; }
+	// Buffers which had to come from the heap
+	size_t heapAllocations() const { return m_heap_allocations; }
+	// Drops the free blocks
+	void trim();
+
+	// Pool of the calling thread
+	static BufferPool& local();
+
+private:
+	struct Block {
+		std::unique_ptr<char[]> data;
+		size_t size;
+	};
+	static const size_t CLASSES = 1 + 4 * 14;
+	static const size_t MAX_BLOCKS = 8;	// per class
+
+	static size_t classSize(size_t size, size_t& index);
+
+	std::vector<std::shared_ptr<Block>> m_blocks[CLASSES];
+	size_t m_budget;
+	size_t m_bytes = 0;
+	size_t m_heap_allocations = 0;
+};
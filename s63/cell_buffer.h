@@ -0,0 +1,99 @@
+#pragma once
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "buffer_pool.h"
+
+// Immutable, reference counted cell bytes. Copies share the memory, and a buffer can be a view
+// into a part of another one (a stored zip entry inside the decrypted cell), so the bytes
+// of a cell are written once and then only passed around.
+class CellBuffer
+{
+public:
+	CellBuffer() = default;
+	// Takes over the string
+	CellBuffer(std::string s) {
+		auto owner = std::make_shared<std::string>(std::move(s));
+		m_data = owner->data();
+		m_size = owner->size();
+		m_owner = std::move(owner);
+	}
+
+	// Uninitialized buffer from the pool of the calling thread, data is to be filled before the buffer is shared
+	static CellBuffer allocate(size_t size, char*& data) {
+		CellBuffer buf;
+		std::shared_ptr<char> owner = BufferPool::local().allocate(size);
+		data = owner.get();
+		buf.m_data = data;
+		buf.m_size = size;
+		buf.m_owner = std::move(owner);
+		return buf;
+	}
+
+	// Bytes which belong to something else (a mapped file), kept alive by owner
+	static CellBuffer wrap(std::shared_ptr<const void> owner, const char* data, size_t size) {
+		CellBuffer buf;
+		buf.m_owner = std::move(owner);
+		buf.m_data = data;
+		buf.m_size = size;
+		return buf;
+	}
+
+	// Bytes [offset, offset + size) sharing the memory of this buffer
+	CellBuffer view(size_t offset, size_t size) const {
+		CellBuffer buf;
+		if (offset > m_size || size > m_size - offset)
+			return buf;
+		buf.m_owner = m_owner;
+		buf.m_data = m_data + offset;
+		buf.m_size = size;
+		return buf;
+	}
+
+	const char* data() const { return m_data; }
+	size_t size() const { return m_size; }
+	bool empty() const { return m_size == 0; }
+	const char* begin() const { return m_data; }
+	const char* end() const { return m_data + m_size; }
+
+	std::string_view bytes() const { return std::string_view(m_data ? m_data : "", m_size); }
+	// A copy, for the code which needs a std::string
+	std::string str() const { return std::string(bytes()); }
+
+	// Both are views of the same memory
+	bool sharesWith(const CellBuffer& other) const { return m_owner && m_owner == other.m_owner; }
+
+	bool operator==(const CellBuffer& other) const { return bytes() == other.bytes(); }
+	bool operator==(const std::string& other) const { return bytes() == other; }
+
+private:
+	std::shared_ptr<const void> m_owner;
+	const char* m_data = nullptr;
+	size_t m_size = 0;
+};
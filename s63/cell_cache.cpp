@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "cell_cache.h"
+
+#include <filesystem>
+
+#include "simple_zip.h"
+
+CellBuffer S63CellCache::get(const std::string& key, const std::string& stamp) {
+
+	CellBuffer zipped;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_index.find(key);
+		if (it == m_index.end() || it->second->stamp != stamp) {
+			++m_misses;
+			return CellBuffer();
+		}
+		Iterator e = it->second;
+		++e->uses;
+		++m_hits;
+		if (e->hot) {
+			m_hot.splice(m_hot.begin(), m_hot, e);
+			return e->data;
+		}
+		++m_warm_hits;
+		m_warm.splice(m_warm.begin(), m_warm, e);
+		zipped = e->zipped;
+	}
+
+	// Inflate outside of the lock, it is the expensive part
+	CellBuffer data;
+	if (!SimpleZip::unzip(zipped, data)) {
+		return CellBuffer();
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_index.find(key);
+	if (it != m_index.end() && it->second->zipped.sharesWith(zipped) && !it->second->hot && it->second->uses >= PROMOTE_USES) {
+		// Hit often enough, keep it inflated
+		Iterator e = it->second;
+		m_size -= entrySize(*e);
+		e->data = data;
+		e->hot = true;
+		m_size += entrySize(*e);
+		m_hot_size += data.size();
+		m_hot.splice(m_hot.begin(), m_warm, e);
+		trim();
+	}
+	return data;
+}
+
+void S63CellCache::put(const std::string& key, const std::string& stamp, const CellBuffer& data,
+	const CellBuffer& zipped) {
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_budget || data.empty()) {
+		return;
+	}
+	auto it = m_index.find(key);
+	if (it != m_index.end()) {
+		erase(it->second);
+	}
+	m_hot.push_front({ key, stamp, data, zipped });
+	m_index[key] = m_hot.begin();
+	m_size += entrySize(m_hot.front());
+	m_hot_size += m_hot.front().data.size();
+	trim();
+}
+
+void S63CellCache::erase(Iterator it) {
+	m_size -= entrySize(*it);
+	if (it->hot) {
+		m_hot_size -= it->data.size();
+	}
+	m_index.erase(it->key);
+	(it->hot ? m_hot : m_warm).erase(it);
+}
+
+// Hot cell becomes warm, a cell without the zip payload is dropped
+void S63CellCache::demote(Iterator it) {
+	if (it->zipped.empty()) {
+		erase(it);
+		return;
+	}
+	m_size -= entrySize(*it);
+	m_hot_size -= it->data.size();
+	it->data = CellBuffer();
+	it->hot = false;
+	// It has to earn its promotion again
+	it->uses = 0;
+	m_size += entrySize(*it);
+	m_warm.splice(m_warm.begin(), m_hot, it);
+}
+
+void S63CellCache::trim() {
+	// Unlike the key cache, a cell bigger than the whole budget is not kept either
+	size_t hot_budget = m_budget / 100 * m_hot_share + m_budget % 100 * m_hot_share / 100;
+	while (m_hot_size > hot_budget && !m_hot.empty()) {
+		demote(std::prev(m_hot.end()));
+	}
+	while (m_size > m_budget && !(m_hot.empty() && m_warm.empty())) {
+		if (!m_warm.empty())
+			erase(std::prev(m_warm.end()));
+		else
+			demote(std::prev(m_hot.end()));
+	}
+}
+
+void S63CellCache::setBudget(size_t bytes) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_budget = bytes;
+	trim();
+}
+
+size_t S63CellCache::budget() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_budget;
+}
+
+void S63CellCache::setHotShare(unsigned percent) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_hot_share = percent > 100 ? 100 : percent;
+	trim();
+}
+
+size_t S63CellCache::size() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_size;
+}
+
+size_t S63CellCache::hotSize() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_hot_size;
+}
+
+size_t S63CellCache::hits() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_hits;
+}
+
+size_t S63CellCache::warmHits() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_warm_hits;
+}
+
+size_t S63CellCache::misses() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_misses;
+}
+
+void S63CellCache::clear() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_hot.clear();
+	m_warm.clear();
+	m_index.clear();
+	m_size = 0;
+	m_hot_size = 0;
+}
+
+bool S63CellCache::stamp(const std::string& path, std::string& out) {
+	std::error_code ec;
+	auto size = std::filesystem::file_size(path, ec);
+	if (ec) {
+		return false;
+	}
+	auto mtime = std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+	if (ec) {
+		return false;
+	}
+	out = std::to_string(size) + ":" + std::to_string(mtime);
+	return true;
+}
@@ -0,0 +1,105 @@
+#pragma once
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "cell_buffer.h"
+
+// Bounded cache of decoded cells, keyed by path, in two tiers within one memory budget.
+// Hot cells are kept inflated. Warm cells keep only the decrypted zip payload, which is several
+// times smaller, and are inflated again on every hit; a warm cell hit often enough becomes hot.
+// When the hot tier outgrows its share of the budget, its least recently used cells become warm,
+// and when the whole cache is over budget, the least recently used warm cells are dropped.
+// Every entry carries a stamp of the files it was decoded from (sizes and modification times),
+// an entry whose files have changed since is a miss and gets replaced.
+class S63CellCache
+{
+public:
+	static const unsigned DEFAULT_HOT_SHARE = 50;
+	// Hits of a warm cell which make it hot
+	static const unsigned PROMOTE_USES = 2;
+
+	explicit S63CellCache(size_t budget = 0) : m_budget(budget) {}
+
+	// Cell decoded from files with the given stamp, empty on a miss
+	CellBuffer get(const std::string& key, const std::string& stamp);
+	// Adds a hot cell. zipped is its decrypted zip payload, without it the cell is dropped instead
+	// of becoming warm.
+	void put(const std::string& key, const std::string& stamp, const CellBuffer& data,
+		const CellBuffer& zipped = CellBuffer());
+
+	// Memory budget in bytes, 0 turns the cache off
+	void setBudget(size_t bytes);
+	size_t budget() const;
+	// Percentage of the budget the inflated cells may take, 100 keeps every cell inflated
+	void setHotShare(unsigned percent);
+	size_t size() const;
+	size_t hotSize() const;
+
+	// Hits of both tiers, warmHits() of them needed an inflate
+	size_t hits() const;
+	size_t warmHits() const;
+	size_t misses() const;
+	void clear();
+
+	// Size and modification time of a file, false if it is not there
+	static bool stamp(const std::string& path, std::string& out);
+
+private:
+	struct Entry {
+		std::string key;
+		std::string stamp;
+		CellBuffer data;	// empty for a warm cell
+		CellBuffer zipped;
+		unsigned uses = 1;
+		bool hot = true;
+	};
+	using Iterator = std::list<Entry>::iterator;
+
+	static size_t entrySize(const Entry& e) {
+		// A stored cell is a view into its zip, the memory is counted once
+		size_t zipped = e.hot && e.data.sharesWith(e.zipped) ? 0 : e.zipped.size();
+		return sizeof(Entry) + e.key.size() + e.stamp.size() + e.data.size() + zipped;
+	}
+	void erase(Iterator it);
+	void demote(Iterator it);
+	void trim();
+
+	mutable std::mutex m_mutex;
+	std::list<Entry> m_hot;		// most recently used first
+	std::list<Entry> m_warm;	// most recently used first
+	std::unordered_map<std::string, Iterator> m_index;
+	size_t m_budget;
+	unsigned m_hot_share = DEFAULT_HOT_SHARE;
+	size_t m_size = 0;
+	size_t m_hot_size = 0;	// inflated data of the hot cells
+	size_t m_hits = 0;
+	size_t m_warm_hits = 0;
+	size_t m_misses = 0;
+};
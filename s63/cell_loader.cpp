@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "cell_loader.h"
+
+#include <chrono>
+#include <cstdio>
+#include <exception>
+
+#include "buffer_pool.h"
+#include "s63.h"
+
+// Queue order: higher priority first, then by arrival
+using QueueKey = std::pair<int, uint64_t>;
+
+struct CellLoader::Shared {
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::map<QueueKey, std::shared_ptr<Job>> queue;
+	std::unordered_map<std::string, std::shared_ptr<Job>> jobs;	// queued or being opened, by path
+	uint64_t next_seq = 0;
+	bool stop = false;
+};
+
+struct CellLoader::Job {
+	struct Waiter {
+		uint64_t id;
+		Callback callback;
+		int priority;
+		bool cancelled;
+	};
+
+	std::shared_ptr<Shared> shared;
+	std::string path;
+	QueueKey key;
+	bool queued = false;
+	std::promise<CellBuffer> promise;
+	std::shared_future<CellBuffer> future;
+	std::vector<Waiter> waiters;
+	size_t active = 0;
+	uint64_t next_id = 0;
+
+	int priority() const {
+		int p = 0;
+		bool any = false;
+		for (const auto& w : waiters) {
+			if (!w.cancelled && (!any || w.priority > p)) {
+				p = w.priority;
+				any = true;
+			}
+		}
+		return p;
+	}
+
+	// Puts a queued job at its place for the current priority, the mutex must be held
+	void requeue() {
+		int p = priority();
+		if (!queued || -key.first == p)
+			return;
+		auto self = shared->queue[key];
+		shared->queue.erase(key);
+		key.first = -p;
+		shared->queue[key] = self;
+	}
+
+	// Drops a queued job nobody waits for, the mutex must be held
+	void drop() {
+		shared->queue.erase(key);
+		queued = false;
+		auto it = shared->jobs.find(path);
+		if (it != shared->jobs.end() && it->second.get() == this)
+			shared->jobs.erase(it);
+		promise.set_value(CellBuffer());
+	}
+};
+
+bool CellLoader::Ticket::ready() const {
+	return m_future.valid() && m_future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+void CellLoader::Ticket::cancel() {
+	if (!m_job)
+		return;
+	std::lock_guard<std::mutex> lock(m_job->shared->mutex);
+	for (auto& w : m_job->waiters) {
+		if (w.id == m_id && !w.cancelled) {
+			w.cancelled = true;
+			w.callback = nullptr;
+			if (--m_job->active == 0 && m_job->queued)
+				m_job->drop();
+			else
+				m_job->requeue();
+			break;
+		}
+	}
+}
+
+void CellLoader::Ticket::setPriority(int priority) {
+	if (!m_job)
+		return;
+	std::lock_guard<std::mutex> lock(m_job->shared->mutex);
+	for (auto& w : m_job->waiters) {
+		if (w.id == m_id && !w.cancelled) {
+			w.priority = priority;
+			m_job->requeue();
+			break;
+		}
+	}
+}
+
+CellLoader::CellLoader(OpenFunction open, size_t threads) : m_shared(std::make_shared<Shared>()), m_open(std::move(open)) {
+
+	if (threads == 0)
+		threads = 1;
+	for (size_t i = 0; i < threads; ++i)
+		m_threads.emplace_back(&CellLoader::run, this);
+}
+
+CellLoader::~CellLoader() {
+
+	{
+		std::lock_guard<std::mutex> lock(m_shared->mutex);
+		m_shared->stop = true;
+		while (!m_shared->queue.empty()) {
+			auto job = m_shared->queue.begin()->second;
+			job->drop();
+		}
+	}
+	m_shared->cv.notify_all();
+	for (auto& t : m_threads)
+		t.join();
+}
+
+CellLoader::Ticket CellLoader::request(const std::string& path, int priority, Callback callback) {
+
+	Ticket ticket;
+	std::unique_lock<std::mutex> lock(m_shared->mutex);
+
+	std::shared_ptr<Job>& job = m_shared->jobs[path];
+	bool fresh = !job;
+	if (fresh) {
+		job = std::make_shared<Job>();
+		job->shared = m_shared;
+		job->path = path;
+		job->future = job->promise.get_future().share();
+	}
+	ticket.m_id = job->next_id++;
+	job->waiters.push_back({ ticket.m_id, std::move(callback), priority, false });
+	++job->active;
+	ticket.m_job = job;
+	ticket.m_future = job->future;
+
+	if (m_shared->stop && fresh) {
+		// Too late, nothing new is opened any more
+		m_shared->jobs.erase(path);
+		ticket.m_job->promise.set_value(CellBuffer());
+		return ticket;
+	}
+	if (fresh) {
+		job->key = QueueKey(-priority, m_shared->next_seq++);
+		job->queued = true;
+		m_shared->queue[job->key] = job;
+		lock.unlock();
+		m_shared->cv.notify_one();
+	}
+	else {
+		job->requeue();
+	}
+	return ticket;
+}
+
+size_t CellLoader::pending() const {
+	std::lock_guard<std::mutex> lock(m_shared->mutex);
+	return m_shared->queue.size();
+}
+
+void CellLoader::run() {
+
+	S63Context& ctx = S63Context::local();
+	for (;;) {
+		std::shared_ptr<Job> job;
+		{
+			std::unique_lock<std::mutex> lock(m_shared->mutex);
+			if (!m_shared->stop && m_shared->queue.empty()) {
+				lock.unlock();
+				BufferPool::local().trim();
+				lock.lock();
+			}
+			m_shared->cv.wait(lock, [&] { return m_shared->stop || !m_shared->queue.empty(); });
+			if (m_shared->queue.empty())
+				return;
+			job = m_shared->queue.begin()->second;
+			m_shared->queue.erase(m_shared->queue.begin());
+			job->queued = false;
+		}
+
+		// A throwing open must not end the worker and leave the waiters hanging
+		CellBuffer cell;
+		try {
+			cell = m_open(job->path, ctx);
+		}
+		catch (const std::exception& e) {
+			printf("Could not open %s: %s\n", job->path.c_str(), e.what());
+		}
+		catch (...) {
+			printf("Could not open %s\n", job->path.c_str());
+		}
+
+		std::vector<Callback> callbacks;
+		{
+			std::lock_guard<std::mutex> lock(m_shared->mutex);
+			auto it = m_shared->jobs.find(job->path);
+			if (it != m_shared->jobs.end() && it->second == job)
+				m_shared->jobs.erase(it);
+			for (auto& w : job->waiters) {
+				if (!w.cancelled && w.callback)
+					callbacks.push_back(std::move(w.callback));
+			}
+		}
+		job->promise.set_value(cell);
+		for (const auto& callback : callbacks)
+			callback(job->path, cell);
+	}
+}
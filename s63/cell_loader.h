@@ -0,0 +1,95 @@
+#pragma once
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "cell_buffer.h"
+
+class S63Context;
+
+// Opens cells in the background on a fixed number of worker threads, the highest priority first
+// (first come, first served within a priority). A request for a cell which is already queued or being
+// opened joins that one instead of opening the cell again. A request can be cancelled, a queued cell
+// which nobody waits for any more is dropped.
+class CellLoader
+{
+	struct Shared;
+	struct Job;
+
+public:
+	using OpenFunction = std::function<CellBuffer(const std::string& path, S63Context& ctx)>;
+	// Called on a worker thread with the cell, which is empty if it could not be opened
+	using Callback = std::function<void(const std::string& path, const CellBuffer& cell)>;
+
+	// One request for a cell
+	class Ticket
+	{
+	public:
+		Ticket() = default;
+		// The cell, empty if it could not be opened or the request was cancelled before it was opened
+		const std::shared_future<CellBuffer>& future() const { return m_future; }
+		CellBuffer get() const { return m_future.get(); }
+		bool ready() const;
+		// The callback of this request is not called any more (unless it is being called right now),
+		// a queued cell nobody else waits for is dropped
+		void cancel();
+		// Moves a queued cell up or down, the job keeps the highest priority any of its requests asked for
+		void setPriority(int priority);
+
+	private:
+		friend class CellLoader;
+		std::shared_ptr<Job> m_job;
+		std::shared_future<CellBuffer> m_future;
+		uint64_t m_id = 0;
+	};
+
+	CellLoader(OpenFunction open, size_t threads);
+	// Requests still in the queue are cancelled, the ones being opened are waited for
+	~CellLoader();
+	CellLoader(const CellLoader&) = delete;
+	CellLoader& operator=(const CellLoader&) = delete;
+
+	Ticket request(const std::string& path, int priority = 0, Callback callback = nullptr);
+
+	// Cells in the queue, not counting the ones being opened
+	size_t pending() const;
+
+private:
+	void run();
+
+	std::shared_ptr<Shared> m_shared;
+	OpenFunction m_open;
+	std::vector<std::thread> m_threads;
+};
@@ -0,0 +1,390 @@
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "cell_pack.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#include "cell_cache.h"
+#include "iso8211.h"
+#include "mapped_file.h"
+#include "s63.h"
+
+// Layout of a pack file, numbers are little endian:
+//   header  "S63PACK1", uint32 number of cells, uint32 reserved, uint64 index size
+//   index   per cell: uint64 offset, uint64 size, uint16 edition, uint16 update number,
+//           uint16 path length, uint16 stamp length, the path, the stamp
+//   cells   each at an 8 byte aligned offset
+static const char PACK_MAGIC[8] = { 'S', '6', '3', 'P', 'A', 'C', 'K', '1' };
+static const size_t PACK_HEADER_SIZE = 24;
+static const size_t PACK_ENTRY_SIZE = 24;
+
+const char* const S63CellPack::DEFAULT_NAME = "s63cells.pack";
+
+// Length from the leader of the ISO 8211 record at pos, 0 if there is no complete record
+static size_t recordLength(const CellBuffer& cell, size_t pos) {
+
+	if (pos > cell.size() || cell.size() - pos < 24)
+		return 0;
+	size_t len = 0;
+	for (size_t i = 0; i < 5; ++i) {
+		char c = cell.data()[pos + i];
+		if (c < '0' || c > '9')
+			return 0;
+		len = len * 10 + (c - '0');
+	}
+	return len <= cell.size() - pos ? len : 0;
+}
+
+// Edition and update number from the DSID of a cell, the first record after the DDR.
+// Only those two records are parsed.
+static void readEdition(const CellBuffer& cell, int& edition, int& update) {
+
+	size_t ddr = recordLength(cell, 0);
+	size_t dsid = ddr ? recordLength(cell, ddr) : 0;
+	Iso8211File file;
+	if (!dsid || !file.parse(cell.data(), ddr + dsid) || file.records.empty())
+		return;
+
+	const Iso8211Field* field = file.records[0].find("DSID");
+	const Iso8211FieldDesc* desc = file.desc("DSID");
+	Iso8211Rows rows;
+	if (!field || !desc || !file.split(*field, rows) || rows.empty())
+		return;
+	int edtn = desc->find("EDTN");
+	int updn = desc->find("UPDN");
+	if (edtn >= 0)
+		edition = atoi(rows[0][edtn].c_str());
+	if (updn >= 0)
+		update = atoi(rows[0][updn].c_str());
+}
+
+S63CellPack::S63CellPack() = default;
+
+S63CellPack::~S63CellPack() = default;
+
+bool S63CellPack::open(const std::string& enc_root, const std::string& pack_path) {
+
+	std::error_code ec;
+	std::filesystem::path root = std::filesystem::absolute(enc_root, ec).lexically_normal();
+	if (!root.has_filename())
+		root = root.parent_path();
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_root = root.string();
+	m_path = pack_path.empty() ? (root / DEFAULT_NAME).string() : pack_path;
+	m_pack = load();
+	return m_pack != nullptr;
+}
+
+void S63CellPack::close() {
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_pack.reset();
+}
+
+bool S63CellPack::isOpen() const {
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_pack != nullptr;
+}
+
+size_t S63CellPack::cells() const {
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_pack ? m_pack->entries.size() : 0;
+}
+
+std::shared_ptr<const S63CellPack::Pack> S63CellPack::load() const {
+
+	auto file = std::make_shared<MappedFile>();
+	if (!file->open(m_path, false))
+		return nullptr;
+
+	const char* data = file->data();
+	const size_t size = file->size();
+	uint32_t count = 0;
+	uint64_t index_size = 0;
+	if (size < PACK_HEADER_SIZE || memcmp(data, PACK_MAGIC, sizeof(PACK_MAGIC)) != 0) {
+		printf("%s is not a cell pack\n", m_path.c_str());
+		return nullptr;
+	}
+	memcpy(&count, data + 8, sizeof(count));
+	memcpy(&index_size, data + 16, sizeof(index_size));
+	if (index_size > size - PACK_HEADER_SIZE) {
+		printf("Broken cell pack %s\n", m_path.c_str());
+		return nullptr;
+	}
+
+	auto pack = std::make_shared<Pack>();
+	pack->file = file;
+	pack->entries.reserve(count);
+	const char* pos = data + PACK_HEADER_SIZE;
+	const char* const index_end = pos + index_size;
+	for (uint32_t i = 0; i < count; ++i) {
+
+		Entry entry;
+		uint16_t edition, update, path_len, stamp_len;
+		if (size_t(index_end - pos) < PACK_ENTRY_SIZE) {
+			printf("Broken cell pack %s\n", m_path.c_str());
+			return nullptr;
+		}
+		memcpy(&entry.offset, pos, 8);
+		memcpy(&entry.size, pos + 8, 8);
+		memcpy(&edition, pos + 16, 2);
+		memcpy(&update, pos + 18, 2);
+		memcpy(&path_len, pos + 20, 2);
+		memcpy(&stamp_len, pos + 22, 2);
+		pos += PACK_ENTRY_SIZE;
+		if (size_t(index_end - pos) < size_t(path_len) + stamp_len || entry.offset > size || entry.size > size - entry.offset) {
+			printf("Broken cell pack %s\n", m_path.c_str());
+			return nullptr;
+		}
+		entry.path.assign(pos, path_len);
+		pos += path_len;
+		entry.stamp.assign(pos, stamp_len);
+		pos += stamp_len;
+		entry.cellname = std::filesystem::path(entry.path).stem().string();
+		entry.edition = edition;
+		entry.update = update;
+
+		pack->by_path[entry.path] = pack->entries.size();
+		pack->by_name[nameKey(entry.cellname, entry.edition, entry.update)] = pack->entries.size();
+		pack->entries.push_back(std::move(entry));
+	}
+	return pack;
+}
+
+std::string S63CellPack::nameKey(const std::string& cellname, int edition, int update) {
+	return cellname + "/" + std::to_string(edition) + "/" + std::to_string(update);
+}
+
+// Path relative to the root as it is in the index, empty for a path outside of the root
+std::string S63CellPack::relative(const std::string& path) const {
+
+	std::error_code ec;
+	std::filesystem::path rel = std::filesystem::absolute(path, ec).lexically_normal().lexically_relative(m_root);
+	if (ec || rel.empty() || *rel.begin() == "..")
+		return std::string();
+	return rel.generic_string();
+}
+
+CellBuffer S63CellPack::view(const std::shared_ptr<const Pack>& pack, const Entry& entry) const {
+	return CellBuffer::wrap(pack->file, pack->file->data() + entry.offset, static_cast<size_t>(entry.size));
+}
+
+CellBuffer S63CellPack::get(const std::string& path) const {
+
+	std::shared_ptr<const Pack> pack;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		pack = m_pack;
+	}
+	if (!pack) {
+		return {};
+	}
+
+	auto it = pack->by_path.find(relative(path));
+	if (it == pack->by_path.end()) {
+		return {};
+	}
+	const Entry& entry = pack->entries[it->second];
+	std::string stamp;
+	if (!S63CellCache::stamp(path, stamp) || stamp != entry.stamp) {
+		return {};
+	}
+	return view(pack, entry);
+}
+
+CellBuffer S63CellPack::find(const std::string& cellname, int edition, int update) const {
+
+	std::shared_ptr<const Pack> pack;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		pack = m_pack;
+	}
+	if (!pack) {
+		return {};
+	}
+
+	auto it = pack->by_name.find(nameKey(cellname, edition, update));
+	return it == pack->by_name.end() ? CellBuffer() : view(pack, pack->entries[it->second]);
+}
+
+bool S63CellPack::update(const DecodeFunction& decode) {
+
+	std::lock_guard<std::mutex> update_lock(m_update_mutex);
+	std::shared_ptr<const Pack> old;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		old = m_pack;
+	}
+	m_decoded = 0;
+	m_copied = 0;
+	if (m_root.empty()) {
+		puts("Cell pack is not opened\n");
+		return false;
+	}
+
+	// Cell files are the ones with a cell name and a number for the extension, as in the exchange set.
+	// CATALOG.031 has a number too but is not a cell.
+	struct Source {
+		std::string path;
+		Entry entry;
+	};
+	std::vector<Source> sources;
+	std::error_code ec;
+	for (auto it = std::filesystem::recursive_directory_iterator(m_root, ec); !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+		if (it->is_directory(ec)) {
+			continue;
+		}
+		std::string ext = it->path().extension().string();
+		if (ext.size() <= 1 || !std::all_of(ext.begin() + 1, ext.end(), ::isdigit) ||
+			it->path().stem().string().size() != VALID_CELLNAME_SIZE) {
+			continue;
+		}
+		Source source;
+		source.path = it->path().string();
+		if (!S63CellCache::stamp(source.path, source.entry.stamp)) {
+			continue;
+		}
+		source.entry.path = it->path().lexically_relative(m_root).generic_string();
+		source.entry.cellname = it->path().stem().string();
+		source.entry.update = atoi(ext.c_str() + 1);
+		sources.push_back(std::move(source));
+	}
+	if (ec) {
+		printf("Could not read %s\n", m_root.c_str());
+		return false;
+	}
+	std::sort(sources.begin(), sources.end(), [](const Source& a, const Source& b) { return a.entry.path < b.entry.path; });
+
+	// The index goes first but is written last: the space for it is known from the paths,
+	// the offsets and sizes only once the cells are written
+	uint64_t index_size = 0;
+	for (const Source& source : sources) {
+		index_size += PACK_ENTRY_SIZE + source.entry.path.size() + source.entry.stamp.size();
+	}
+	const std::string tmp_path = m_path + ".tmp";
+	std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+	if (!out.is_open()) {
+		printf("Could not write %s\n", tmp_path.c_str());
+		return false;
+	}
+	static const char zeros[8] = {};
+	uint64_t pos = (PACK_HEADER_SIZE + index_size + 7) & ~uint64_t(7);
+	out.write(std::string(static_cast<size_t>(pos), '\0').data(), pos);
+
+	std::vector<Entry> written;
+	for (Source& source : sources) {
+
+		Entry& entry = source.entry;
+		const Entry* packed = nullptr;
+		if (old) {
+			auto found = old->by_path.find(entry.path);
+			if (found != old->by_path.end() && old->entries[found->second].stamp == entry.stamp)
+				packed = &old->entries[found->second];
+		}
+
+		CellBuffer cell;
+		if (packed) {
+			cell = view(old, *packed);
+			entry.edition = packed->edition;
+			entry.update = packed->update;
+			++m_copied;
+		}
+		else {
+			cell = decode(source.path);
+			if (cell.empty()) {
+				continue;
+			}
+			readEdition(cell, entry.edition, entry.update);
+			++m_decoded;
+		}
+
+		entry.offset = pos;
+		entry.size = cell.size();
+		size_t padding = (8 - cell.size() % 8) % 8;
+		out.write(cell.data(), cell.size());
+		out.write(zeros, padding);
+		pos += cell.size() + padding;
+		written.push_back(entry);
+	}
+
+	std::string head(PACK_HEADER_SIZE, '\0');
+	for (const Entry& entry : written) {
+		char fixed[PACK_ENTRY_SIZE];
+		uint16_t edition = static_cast<uint16_t>(entry.edition), update = static_cast<uint16_t>(entry.update);
+		uint16_t path_len = static_cast<uint16_t>(entry.path.size()), stamp_len = static_cast<uint16_t>(entry.stamp.size());
+		memcpy(fixed, &entry.offset, 8);
+		memcpy(fixed + 8, &entry.size, 8);
+		memcpy(fixed + 16, &edition, 2);
+		memcpy(fixed + 18, &update, 2);
+		memcpy(fixed + 20, &path_len, 2);
+		memcpy(fixed + 22, &stamp_len, 2);
+		head.append(fixed, sizeof(fixed));
+		head += entry.path;
+		head += entry.stamp;
+	}
+	uint32_t count = static_cast<uint32_t>(written.size());
+	uint64_t written_index = head.size() - PACK_HEADER_SIZE;
+	memcpy(&head[0], PACK_MAGIC, sizeof(PACK_MAGIC));
+	memcpy(&head[8], &count, sizeof(count));
+	memcpy(&head[16], &written_index, sizeof(written_index));
+	out.seekp(0);
+	out.write(head.data(), head.size());
+	out.close();
+	if (!out) {
+		printf("Could not write %s\n", tmp_path.c_str());
+		std::filesystem::remove(tmp_path, ec);
+		return false;
+	}
+
+	// Buffers of the old pack keep its mapping, the file under it can be replaced. Except on Windows:
+	// there the old pack is let go and the rename is tried again, which works once nobody holds
+	// a buffer of it any more.
+	std::filesystem::rename(tmp_path, m_path, ec);
+	if (ec) {
+		old.reset();
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_pack.reset();
+		}
+		ec.clear();
+		std::filesystem::rename(tmp_path, m_path, ec);
+	}
+	const bool replaced = !ec;
+	if (!replaced) {
+		printf("Could not replace %s\n", m_path.c_str());
+		std::filesystem::remove(tmp_path, ec);
+	}
+	std::shared_ptr<const Pack> pack = load();
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_pack = pack;
+	return replaced && pack != nullptr;
+}
@@ -0,0 +1,108 @@
+#pragma once
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cell_buffer.h"
+
+class MappedFile;
+
+// Decoded cells of an ENC_ROOT packed into one file, which is memory mapped, so a cell is
+// a lookup and a view into the mapping instead of a decrypt and an inflate on every start.
+// The index at the head of the file has the path of every cell relative to the root, its cell
+// name, edition and update number (from the DSID of the cell) and the stamp (size and modification
+// time) of the file it was decoded from. A cell whose file has changed since is not returned.
+// update() rebuilds the pack next to the old one: only new and changed cells are decoded,
+// the others are copied from the old mapping, and the new file replaces the old one at once.
+class S63CellPack
+{
+public:
+	// Decoded cell of a file, empty if it can not be decoded
+	using DecodeFunction = std::function<CellBuffer(const std::string& path)>;
+
+	S63CellPack();
+	~S63CellPack();
+	S63CellPack(const S63CellPack&) = delete;
+	S63CellPack& operator=(const S63CellPack&) = delete;
+
+	// Pack of the cells under enc_root, by default in a file in enc_root itself.
+	// Returns false if there is no valid pack yet, update() makes one.
+	bool open(const std::string& enc_root, const std::string& pack_path = std::string());
+	void close();
+	bool isOpen() const;
+
+	// Brings the pack in line with the cell files (.000, .001 ...) under the root.
+	// False if the new pack could not be written, the old one is kept then.
+	bool update(const DecodeFunction& decode);
+
+	// Cell decoded from the file at path, empty if it is not in the pack or the file has changed
+	CellBuffer get(const std::string& path) const;
+	// Cell by name, edition and update number, without looking at its file
+	CellBuffer find(const std::string& cellname, int edition, int update) const;
+
+	size_t cells() const;
+	// What the last update() did: cells decoded, and cells copied from the old pack
+	size_t decoded() const { return m_decoded; }
+	size_t copied() const { return m_copied; }
+
+	static const char* const DEFAULT_NAME;
+
+private:
+	struct Entry {
+		std::string path;	// relative to the root, with '/' separators
+		std::string stamp;
+		std::string cellname;
+		int edition = 0;
+		int update = 0;
+		uint64_t offset = 0;
+		uint64_t size = 0;
+	};
+	// One mapped pack, shared with the buffers handed out from it
+	struct Pack {
+		std::shared_ptr<MappedFile> file;
+		std::vector<Entry> entries;
+		std::unordered_map<std::string, size_t> by_path;
+		std::unordered_map<std::string, size_t> by_name;
+	};
+
+	std::shared_ptr<const Pack> load() const;
+	std::string relative(const std::string& path) const;
+	CellBuffer view(const std::shared_ptr<const Pack>& pack, const Entry& entry) const;
+	static std::string nameKey(const std::string& cellname, int edition, int update);
+
+	std::string m_root;
+	std::string m_path;
+	mutable std::mutex m_mutex;
+	std::shared_ptr<const Pack> m_pack;
+	std::mutex m_update_mutex;
+	size_t m_decoded = 0;
+	size_t m_copied = 0;
+};
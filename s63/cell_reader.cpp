@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "cell_reader.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "crc32_simd.h"
+#include "simple_zip.h"
+#include "zlib/zlib.h"
+
+S63CellReader::S63CellReader() = default;
+
+S63CellReader::~S63CellReader() {
+	if (m_zs) {
+		inflateEnd(static_cast<z_stream*>(m_zs));
+		delete static_cast<z_stream*>(m_zs);
+	}
+}
+
+S63Error S63CellReader::open(const std::string& path, const std::pair<std::string, std::string>& keys, S63Context& ctx) {
+
+	close();
+	if (!m_file.open(path)) {
+		puts("Could not open encrypted file for reading\n");
+		return S63_ERR_FILE;
+	}
+
+	const size_t size = m_file.size();
+	if (size < 8 || size % 8 != 0) {
+		close();
+		puts("Wrong file size\n");
+		return S63_ERR_DATA;
+	}
+
+	m_bf = S63::cellCipher(m_file.data(), keys, ctx);
+	if (!m_bf) {
+		close();
+		return S63_ERR_KEY;
+	}
+
+	m_in.resize(CHUNK);
+	m_out.resize(OUT_SIZE);
+
+	// The local header is in the first chunk. The last one has the padding, and the central
+	// directory for an entry written with unknown sizes.
+	const size_t tail_len = std::min(size, OUT_SIZE);
+	decrypt(size - tail_len, tail_len, &m_out[0]);
+	const size_t padding = CBlowFish::paddingLength(reinterpret_cast<const unsigned char*>(m_out.data()), tail_len);
+	const size_t zip_len = size - padding;
+	const size_t head_len = std::min(size, CHUNK);
+	decrypt(0, head_len, &m_in[0]);
+
+	SimpleZip::EntryInfo entry;
+	if (!SimpleZip::entryInfo(m_in.data(), std::min(head_len, zip_len), m_out.data(), tail_len - padding, zip_len, entry)) {
+		close();
+		puts("Cant unzip cell\n");
+		return S63_ERR_ZIP;
+	}
+	m_data_offset = entry.data_offset;
+	m_compressed = entry.compressed_size;
+	m_size = entry.uncompressed_size;
+	m_crc = entry.crc;
+	m_deflated = entry.deflated;
+	m_out_start = 0;
+	m_out_len = 0;
+
+	if (m_deflated) {
+		if (!m_zs) {
+			z_stream* zs = new z_stream();
+			if (inflateInit2(zs, -MAX_WBITS) != Z_OK) {
+				delete zs;
+				close();
+				return S63_ERR_ZIP;
+			}
+			m_zs = zs;
+		}
+		// Inflate starts from the first checkpoint, which needs no window
+		m_checkpoints.push_back({ 0, 0, 0, 0, std::string() });
+		restore(m_checkpoints.front());
+	}
+	return S63_ERR_OK;
+}
+
+void S63CellReader::close() {
+
+	m_file.close();
+	m_bf.reset();
+	m_checkpoints.clear();
+	m_size = 0;
+	m_pos = 0;
+	m_failed = false;
+	m_end = false;
+	m_out_start = 0;
+	m_out_len = 0;
+}
+
+bool S63CellReader::seek(uint64_t pos) {
+
+	if (pos > m_size)
+		return false;
+	m_pos = pos;
+	return true;
+}
+
+size_t S63CellReader::read(char* buf, size_t len) {
+
+	if (!isOpen())
+		return 0;
+
+	size_t done = 0;
+	while (done < len && m_pos < m_size) {
+
+		const uint64_t out_end = m_out_start + m_out_len;
+		if (m_pos >= m_out_start && m_pos < out_end) {
+			size_t n = static_cast<size_t>(std::min<uint64_t>(std::min<uint64_t>(len - done, out_end - m_pos), m_size - m_pos));
+			memcpy(buf + done, &m_out[static_cast<size_t>(m_pos - m_out_start)], n);
+			done += n;
+			m_pos += n;
+			continue;
+		}
+		if (m_failed)
+			break;
+
+		if (!m_deflated) {
+			if (!readStored())
+				break;
+			continue;
+		}
+
+		// Behind the output, or ahead of a checkpoint which is past it: inflate from that checkpoint
+		auto cp = std::upper_bound(m_checkpoints.begin(), m_checkpoints.end(), m_pos,
+			[](uint64_t pos, const Checkpoint& c) { return pos < c.out; }) - 1;
+		if (m_pos < m_out_start || cp->out > out_end) {
+			if (!restore(*cp))
+				break;
+			continue;
+		}
+		if (!inflateMore())
+			break;
+	}
+	return done;
+}
+
+bool S63CellReader::fail(const char* msg) {
+	puts(msg);
+	m_failed = true;
+	return false;
+}
+
+void S63CellReader::decrypt(uint64_t offset, size_t len, char* out) const {
+
+	m_bf->decrypt(reinterpret_cast<const unsigned char*>(m_file.data()) + offset, reinterpret_cast<unsigned char*>(out), len);
+}
+
+// Decrypts the next chunk of compressed data for inflate, from the block the first byte is in
+bool S63CellReader::fillInput() {
+
+	if (m_in_next >= m_compressed)
+		return false;
+
+	z_stream* zs = static_cast<z_stream*>(m_zs);
+	const uint64_t begin = m_data_offset + m_in_next;
+	const uint64_t end = m_data_offset + m_compressed;
+	const uint64_t block = begin & ~uint64_t(7);
+	// The file size is a multiple of 8, so is the end of the last block
+	const size_t len = static_cast<size_t>(std::min<uint64_t>(CHUNK, (end - block + 7) & ~uint64_t(7)));
+	decrypt(block, len, &m_in[0]);
+
+	const size_t skip = static_cast<size_t>(begin - block);
+	const size_t avail = static_cast<size_t>(std::min<uint64_t>(len - skip, end - begin));
+	zs->next_in = reinterpret_cast<Bytef*>(&m_in[skip]);
+	zs->avail_in = static_cast<uInt>(avail);
+	m_in_next += avail;
+	return true;
+}
+
+bool S63CellReader::inflateMore() {
+
+	if (m_end || m_failed)
+		return false;
+
+	z_stream* zs = static_cast<z_stream*>(m_zs);
+	if (m_out_len == m_out.size()) {
+		// Only the window has to stay behind the next byte
+		memmove(&m_out[0], &m_out[m_out_len - WINDOW], WINDOW);
+		m_out_start += m_out_len - WINDOW;
+		m_out_len = WINDOW;
+	}
+
+	const size_t before = m_out_len;
+	zs->next_out = reinterpret_cast<Bytef*>(&m_out[m_out_len]);
+	zs->avail_out = static_cast<uInt>(m_out.size() - m_out_len);
+	while (zs->avail_out != 0) {
+
+		// After the last block inflate stops once more before the end, which takes no input
+		if (zs->avail_in == 0)
+			fillInput();
+
+		// Z_BLOCK stops at the end of every deflate block, where a checkpoint can be taken
+		Bytef* out = zs->next_out;
+		int ret = inflate(zs, Z_BLOCK);
+		size_t produced = zs->next_out - out;
+		m_out_crc = Crc32::update(m_out_crc, out, produced);
+		m_out_len += produced;
+
+		if (ret == Z_STREAM_END) {
+			m_end = true;
+			if (m_out_start + m_out_len != m_size || m_out_crc != m_crc)
+				return fail("wrong crc\n");
+			break;
+		}
+		if (ret == Z_BUF_ERROR && zs->avail_in == 0)
+			return fail("Cell data is truncated\n");
+		if (ret != Z_OK)
+			return fail("Cell data is corrupt\n");
+
+		// A block boundary, but not the end of the last block. Only the frontier gets new checkpoints,
+		// inflating again from an earlier one passes by the ones which are there already.
+		const uint64_t out_pos = m_out_start + m_out_len;
+		const uint64_t last = m_checkpoints.back().out;
+		if ((zs->data_type & 128) && !(zs->data_type & 64) && out_pos > last && out_pos - last >= m_span)
+			addCheckpoint();
+	}
+	return m_out_len > before;
+}
+
+void S63CellReader::addCheckpoint() {
+
+	z_stream* zs = static_cast<z_stream*>(m_zs);
+	Checkpoint cp;
+	cp.out = m_out_start + m_out_len;
+	cp.in = m_in_next - zs->avail_in;
+	cp.bits = zs->data_type & 7;
+	cp.crc = m_out_crc;
+	// There is at least the window (or all the output, if it is shorter) behind the frontier
+	const size_t window = std::min(m_out_len, WINDOW);
+	cp.window.assign(&m_out[m_out_len - window], window);
+	m_checkpoints.push_back(std::move(cp));
+}
+
+bool S63CellReader::restore(const Checkpoint& cp) {
+
+	z_stream* zs = static_cast<z_stream*>(m_zs);
+	if (inflateReset(zs) != Z_OK)
+		return fail("Cant restart inflate\n");
+	zs->avail_in = 0;
+
+	// The checkpoint may be in the middle of a byte, its first bits belong to the previous block
+	m_in_next = cp.in - (cp.bits ? 1 : 0);
+	if (cp.bits) {
+		if (!fillInput())
+			return fail("Cell data is truncated\n");
+		int byte = *zs->next_in;
+		++zs->next_in;
+		--zs->avail_in;
+		inflatePrime(zs, cp.bits, byte >> (8 - cp.bits));
+	}
+	if (!cp.window.empty())
+		inflateSetDictionary(zs, reinterpret_cast<const Bytef*>(cp.window.data()), static_cast<uInt>(cp.window.size()));
+
+	memcpy(&m_out[0], cp.window.data(), cp.window.size());
+	m_out_len = cp.window.size();
+	m_out_start = cp.out - m_out_len;
+	m_out_crc = cp.crc;
+	m_end = false;
+	return true;
+}
+
+// Stored entries are only decrypted, there is no CRC32 check for them as the data is never read as a whole
+bool S63CellReader::readStored() {
+
+	const uint64_t begin = m_data_offset + m_pos;
+	const uint64_t end = m_data_offset + m_size;
+	const uint64_t block = begin & ~uint64_t(7);
+	const size_t len = static_cast<size_t>(std::min<uint64_t>(CHUNK, (end - block + 7) & ~uint64_t(7)));
+	decrypt(block, len, &m_in[0]);
+
+	const size_t skip = static_cast<size_t>(begin - block);
+	m_out_len = static_cast<size_t>(std::min<uint64_t>(len - skip, end - begin));
+	memcpy(&m_out[0], &m_in[skip], m_out_len);
+	m_out_start = m_pos;
+	return m_out_len != 0;
+}
+
+
+S63CellStreambuf::S63CellStreambuf(S63CellReader& reader, size_t buffer_size)
+	: m_reader(reader), m_buffer(std::max<size_t>(buffer_size, 1)) {
+
+	setg(m_buffer.data(), m_buffer.data(), m_buffer.data());
+}
+
+S63CellStreambuf::int_type S63CellStreambuf::underflow() {
+
+	if (gptr() < egptr())
+		return traits_type::to_int_type(*gptr());
+
+	size_t n = m_reader.read(m_buffer.data(), m_buffer.size());
+	setg(m_buffer.data(), m_buffer.data(), m_buffer.data() + n);
+	return n ? traits_type::to_int_type(*gptr()) : traits_type::eof();
+}
+
+std::streamsize S63CellStreambuf::xsgetn(char* s, std::streamsize n) {
+
+	std::streamsize done = std::min<std::streamsize>(n, egptr() - gptr());
+	memcpy(s, gptr(), static_cast<size_t>(done));
+	gbump(static_cast<int>(done));
+	if (n - done >= static_cast<std::streamsize>(m_buffer.size())) {
+		// The buffer is empty now, the reader is where the stream is. The old get area is dropped,
+		// seekoff would take it for the bytes right before the reader.
+		setg(m_buffer.data(), m_buffer.data(), m_buffer.data());
+		return done + static_cast<std::streamsize>(m_reader.read(s + done, static_cast<size_t>(n - done)));
+	}
+	return done + std::streambuf::xsgetn(s + done, n - done);
+}
+
+std::streamsize S63CellStreambuf::showmanyc() {
+
+	uint64_t left = m_reader.size() - m_reader.tell();
+	return left ? static_cast<std::streamsize>(left) : -1;
+}
+
+S63CellStreambuf::pos_type S63CellStreambuf::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+
+	if (!(which & std::ios_base::in))
+		return pos_type(off_type(-1));
+
+	const uint64_t reader_pos = m_reader.tell();
+	const uint64_t buffer_start = reader_pos - (egptr() - eback());
+	const uint64_t current = reader_pos - (egptr() - gptr());
+	int64_t base = dir == std::ios_base::beg ? 0 : dir == std::ios_base::cur ? current : m_reader.size();
+	int64_t target = base + off;
+	if (target < 0 || static_cast<uint64_t>(target) > m_reader.size())
+		return pos_type(off_type(-1));
+
+	// Inside the buffer the reader stays where it is
+	if (static_cast<uint64_t>(target) >= buffer_start && static_cast<uint64_t>(target) <= reader_pos) {
+		setg(eback(), eback() + (target - buffer_start), egptr());
+		return pos_type(target);
+	}
+	if (!m_reader.seek(static_cast<uint64_t>(target)))
+		return pos_type(off_type(-1));
+	setg(m_buffer.data(), m_buffer.data(), m_buffer.data());
+	return pos_type(target);
+}
+
+S63CellStreambuf::pos_type S63CellStreambuf::seekpos(pos_type pos, std::ios_base::openmode which) {
+	return seekoff(off_type(pos), std::ios_base::beg, which);
+}
@@ -0,0 +1,137 @@
+#pragma once
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstdint>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+#include "s63.h"
+
+// Random access to the plain data of an encrypted cell without decoding all of it.
+// Blowfish blocks are independent, so only the blocks under the compressed data being inflated
+// are decrypted. Inflate runs forward from the start of the cell, and every checkpoint span it
+// keeps a checkpoint: the position in both streams and the last 32KB of output (the deflate window).
+// A seek backward starts over from the nearest checkpoint instead of from the first byte.
+// Reading the DDR and a few records of a big cell costs a few blocks, not the whole cell.
+// A reader is used by one thread at a time, it keeps its own file and cipher.
+class S63CellReader
+{
+public:
+	static const size_t DEFAULT_CHECKPOINT_SPAN = 1024 * 1024;
+
+	S63CellReader();
+	~S63CellReader();
+	S63CellReader(const S63CellReader&) = delete;
+	S63CellReader& operator=(const S63CellReader&) = delete;
+
+	// Checks the keys on the first block and reads the zip header, nothing else is decrypted yet.
+	// The context is only used here, ctx.lastKey() tells which key fits.
+	S63Error open(const std::string& path, const std::pair<std::string, std::string>& keys, S63Context& ctx = S63Context::local());
+	void close();
+	bool isOpen() const { return m_bf != nullptr; }
+
+	// Size of the plain cell
+	uint64_t size() const { return m_size; }
+	uint64_t tell() const { return m_pos; }
+	// Anywhere from 0 to size(), false beyond it
+	bool seek(uint64_t pos);
+	// Reads up to len bytes at the current position and moves past them. Returns less than len
+	// at the end of the cell, or if the data turned out to be corrupt (see failed()).
+	size_t read(char* buf, size_t len);
+	// The compressed data is broken, or its CRC32 did not match once inflate reached the end
+	bool failed() const { return m_failed; }
+
+	// Output bytes between two checkpoints, each of them costs 32KB. Applies to the checkpoints made from now on.
+	void setCheckpointSpan(size_t bytes) { m_span = bytes; }
+	size_t checkpoints() const { return m_checkpoints.size(); }
+
+private:
+	struct Checkpoint {
+		uint64_t out;	// plain offset
+		uint64_t in;	// offset in the compressed data of the first byte not fully consumed
+		int bits;		// bits of the byte before it which are not consumed yet
+		uint32_t crc;	// of the plain data before out
+		std::string window;
+	};
+
+	bool fail(const char* msg);
+	void decrypt(uint64_t offset, size_t len, char* out) const;
+	bool fillInput();
+	bool inflateMore();
+	bool restore(const Checkpoint& cp);
+	void addCheckpoint();
+	bool readStored();
+
+	static constexpr size_t WINDOW = 32 * 1024;
+	static constexpr size_t CHUNK = 64 * 1024;
+	static constexpr size_t OUT_SIZE = 4 * WINDOW;
+
+	MappedFile m_file;
+	std::shared_ptr<const CBlowFish> m_bf;
+	uint64_t m_data_offset = 0;	// of the compressed data in the zip
+	uint64_t m_compressed = 0;
+	uint64_t m_size = 0;
+	uint32_t m_crc = 0;
+	bool m_deflated = false;
+	bool m_failed = false;
+	uint64_t m_pos = 0;
+
+	void* m_zs = nullptr;	// z_stream, zlib.h is not exposed from here
+	bool m_end = false;		// inflate reached the end of the data
+	uint64_t m_in_next = 0;	// compressed offset of the first byte not yet given to inflate
+	uint32_t m_out_crc = 0;	// of the plain data up to m_out_start + m_out_len
+	std::string m_in;		// decrypted chunk
+	std::string m_out;		// plain data from m_out_start, with at least the deflate window behind the last byte
+	uint64_t m_out_start = 0;
+	size_t m_out_len = 0;
+
+	size_t m_span = DEFAULT_CHECKPOINT_SPAN;
+	std::vector<Checkpoint> m_checkpoints;
+};
+
+
+// std::istream over a cell reader, seekg() and tellg() work as with a file:
+//   S63CellStreambuf buf(reader);
+//   std::istream in(&buf);
+// Large reads go straight to the reader, past the buffer of the stream.
+class S63CellStreambuf : public std::streambuf
+{
+public:
+	explicit S63CellStreambuf(S63CellReader& reader, size_t buffer_size = 16 * 1024);
+
+protected:
+	int_type underflow() override;
+	std::streamsize xsgetn(char* s, std::streamsize n) override;
+	std::streamsize showmanyc() override;
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+	pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+private:
+	S63CellReader& m_reader;
+	std::vector<char> m_buffer;
+};
@@ -0,0 +1,312 @@
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "crc32_simd.h"
+
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CRC_SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define CRC_TARGET(isa)
+#else
+#define CRC_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+// Slice-by-16 tables: t[k][b] is the CRC of the byte b followed by k zero bytes
+struct CrcTables {
+	uint32_t t[16][256];
+
+	CrcTables() {
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (int j = 0; j < 8; ++j)
+				c = (c >> 1) ^ (0xedb88320u & (0u - (c & 1)));
+			t[0][i] = c;
+		}
+		for (int k = 1; k < 16; ++k) {
+			for (int i = 0; i < 256; ++i)
+				t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+		}
+	}
+};
+
+static const CrcTables& tables()
+{
+	static const CrcTables tables;
+	return tables;
+}
+
+static inline uint32_t load32(const unsigned char* p)
+{
+	return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+}
+
+// c is the inverted CRC here and in the kernels below
+static uint32_t crcScalar(uint32_t c, const unsigned char* p, size_t len)
+{
+	const auto& t = tables().t;
+	for (; len >= 16; p += 16, len -= 16) {
+		const uint32_t a = load32(p) ^ c;
+		const uint32_t b = load32(p + 4);
+		const uint32_t d = load32(p + 8);
+		const uint32_t e = load32(p + 12);
+		c = t[15][a & 0xff] ^ t[14][(a >> 8) & 0xff] ^ t[13][(a >> 16) & 0xff] ^ t[12][a >> 24] ^
+			t[11][b & 0xff] ^ t[10][(b >> 8) & 0xff] ^ t[9][(b >> 16) & 0xff] ^ t[8][b >> 24] ^
+			t[7][d & 0xff] ^ t[6][(d >> 8) & 0xff] ^ t[5][(d >> 16) & 0xff] ^ t[4][d >> 24] ^
+			t[3][e & 0xff] ^ t[2][(e >> 8) & 0xff] ^ t[1][(e >> 16) & 0xff] ^ t[0][e >> 24];
+	}
+	for (; len; --len)
+		c = (c >> 8) ^ t[0][(c ^ *p++) & 0xff];
+	return c;
+}
+
+#ifdef CRC_SIMD_X86
+
+//////////////////////////////////////////////////////////////////////////////
+// Folding with carry-less multiplication, as in Intel's "Fast CRC Computation for Generic Polynomials
+// Using PCLMULQDQ Instruction". A 128 bit lane is moved D bits ahead by multiplying its halves with
+// x^(D+32) and x^(D-32) mod P (bit reflected), and xored into the data found there.
+
+// Fold distances of 128, 256 and 1024 bits
+static const uint64_t K128[2] = { 0x1751997d0, 0x0ccaa009e };
+static const uint64_t K256[2] = { 0x0f1da05aa, 0x15a546366 };
+static const uint64_t K1024[2] = { 0x1e88ef372, 0x14a7fe880 };
+static const uint64_t K512[2] = { 0x154442bd4, 0x1c6e41596 };
+// 64 to 32 bits, then the Barrett reduction: P and x^64 / P
+static const uint64_t K64 = 0x163cd6124;
+static const uint64_t POLY[2] = { 0x1db710641, 0x1f7011641 };
+
+CRC_TARGET("pclmul,sse4.1")
+static inline __m128i fold128(__m128i x, __m128i k, __m128i next)
+{
+	const __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+	const __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+	return _mm_xor_si128(_mm_xor_si128(lo, hi), next);
+}
+
+// Folds the 16 byte blocks of p into x and reduces it to the CRC. len is a multiple of 16.
+CRC_TARGET("pclmul,sse4.1")
+static uint32_t reduce128(__m128i x, const unsigned char* p, size_t len)
+{
+	const __m128i k128 = _mm_setr_epi32(int(K128[0]), int(K128[0] >> 32), int(K128[1]), int(K128[1] >> 32));
+	for (; len >= 16; p += 16, len -= 16)
+		x = fold128(x, k128, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+
+	// 128 to 64 bits
+	const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+	x = _mm_xor_si128(_mm_srli_si128(x, 8), _mm_clmulepi64_si128(x, k128, 0x10));
+	// 64 to 32 bits
+	const __m128i k64 = _mm_set_epi64x(0, static_cast<long long>(K64));
+	x = _mm_xor_si128(_mm_srli_si128(x, 4), _mm_clmulepi64_si128(_mm_and_si128(x, mask), k64, 0x00));
+	// Barrett
+	const __m128i poly = _mm_setr_epi32(int(POLY[0]), int(POLY[0] >> 32), int(POLY[1]), int(POLY[1] >> 32));
+	__m128i t = _mm_clmulepi64_si128(_mm_and_si128(x, mask), poly, 0x10);
+	t = _mm_clmulepi64_si128(_mm_and_si128(t, mask), poly, 0x00);
+	return static_cast<uint32_t>(_mm_extract_epi32(_mm_xor_si128(x, t), 1));
+}
+
+// len >= 64 and a multiple of 16
+CRC_TARGET("pclmul,sse4.1")
+static uint32_t crcPclmul(uint32_t c, const unsigned char* p, size_t len)
+{
+	const __m128i* in = reinterpret_cast<const __m128i*>(p);
+	__m128i x0 = _mm_xor_si128(_mm_loadu_si128(in), _mm_cvtsi32_si128(static_cast<int>(c)));
+	__m128i x1 = _mm_loadu_si128(in + 1);
+	__m128i x2 = _mm_loadu_si128(in + 2);
+	__m128i x3 = _mm_loadu_si128(in + 3);
+	p += 64;
+	len -= 64;
+
+	const __m128i k512 = _mm_setr_epi32(int(K512[0]), int(K512[0] >> 32), int(K512[1]), int(K512[1] >> 32));
+	for (; len >= 64; p += 64, len -= 64) {
+		in = reinterpret_cast<const __m128i*>(p);
+		x0 = fold128(x0, k512, _mm_loadu_si128(in));
+		x1 = fold128(x1, k512, _mm_loadu_si128(in + 1));
+		x2 = fold128(x2, k512, _mm_loadu_si128(in + 2));
+		x3 = fold128(x3, k512, _mm_loadu_si128(in + 3));
+	}
+
+	const __m128i k128 = _mm_setr_epi32(int(K128[0]), int(K128[0] >> 32), int(K128[1]), int(K128[1] >> 32));
+	x1 = fold128(x0, k128, x1);
+	x2 = fold128(x1, k128, x2);
+	x3 = fold128(x2, k128, x3);
+	return reduce128(x3, p, len);
+}
+
+CRC_TARGET("vpclmulqdq,avx2")
+static inline __m256i fold256(__m256i x, __m256i k, __m256i next)
+{
+	const __m256i lo = _mm256_clmulepi64_epi128(x, k, 0x00);
+	const __m256i hi = _mm256_clmulepi64_epi128(x, k, 0x11);
+	return _mm256_xor_si256(_mm256_xor_si256(lo, hi), next);
+}
+
+// len >= 128 and a multiple of 16
+CRC_TARGET("vpclmulqdq,avx2,pclmul,sse4.1")
+static uint32_t crcVpclmul(uint32_t c, const unsigned char* p, size_t len)
+{
+	const __m256i* in = reinterpret_cast<const __m256i*>(p);
+	__m256i x0 = _mm256_xor_si256(_mm256_loadu_si256(in), _mm256_setr_epi32(static_cast<int>(c), 0, 0, 0, 0, 0, 0, 0));
+	__m256i x1 = _mm256_loadu_si256(in + 1);
+	__m256i x2 = _mm256_loadu_si256(in + 2);
+	__m256i x3 = _mm256_loadu_si256(in + 3);
+	p += 128;
+	len -= 128;
+
+	const __m256i k1024 = _mm256_setr_epi64x(K1024[0], K1024[1], K1024[0], K1024[1]);
+	for (; len >= 128; p += 128, len -= 128) {
+		in = reinterpret_cast<const __m256i*>(p);
+		x0 = fold256(x0, k1024, _mm256_loadu_si256(in));
+		x1 = fold256(x1, k1024, _mm256_loadu_si256(in + 1));
+		x2 = fold256(x2, k1024, _mm256_loadu_si256(in + 2));
+		x3 = fold256(x3, k1024, _mm256_loadu_si256(in + 3));
+	}
+
+	const __m256i k256 = _mm256_setr_epi64x(K256[0], K256[1], K256[0], K256[1]);
+	x1 = fold256(x0, k256, x1);
+	x2 = fold256(x1, k256, x2);
+	x3 = fold256(x2, k256, x3);
+
+	// The low lane is 128 bits ahead of the high one
+	const __m128i k128 = _mm_setr_epi32(int(K128[0]), int(K128[0] >> 32), int(K128[1]), int(K128[1] >> 32));
+	const __m128i x = fold128(_mm256_castsi256_si128(x3), k128, _mm256_extracti128_si256(x3, 1));
+	return reduce128(x, p, len);
+}
+
+static bool cpuSupports(Crc32::Isa isa)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+	int regs[4];
+	__cpuid(regs, 0);
+	const int max_leaf = regs[0];
+	__cpuid(regs, 1);
+	// PCLMULQDQ and SSE4.1
+	if ((regs[2] & (1 << 1)) == 0 || (regs[2] & (1 << 19)) == 0)
+		return false;
+	if (isa != Crc32::ISA_VPCLMUL)
+		return true;
+	// OSXSAVE and AVX
+	if (max_leaf < 7 || (regs[2] & (1 << 27)) == 0 || (regs[2] & (1 << 28)) == 0)
+		return false;
+	unsigned long long xcr0 = _xgetbv(0);
+	__cpuidex(regs, 7, 0);
+	// AVX2 and VPCLMULQDQ
+	return (xcr0 & 0x6) == 0x6 && (regs[1] & (1 << 5)) != 0 && (regs[2] & (1 << 10)) != 0;
+#else
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("pclmul") || !__builtin_cpu_supports("sse4.1"))
+		return false;
+	if (isa == Crc32::ISA_VPCLMUL)
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("vpclmulqdq");
+	return true;
+#endif
+}
+
+#endif
+
+static uint32_t crc(Crc32::Isa isa, uint32_t c, const unsigned char* p, size_t len)
+{
+#ifdef CRC_SIMD_X86
+	// The kernels take whole 16 byte blocks, the tail is left to the tables
+	if (isa == Crc32::ISA_VPCLMUL && len >= 128) {
+		const size_t n = len & ~size_t(15);
+		c = crcVpclmul(c, p, n);
+		p += n;
+		len -= n;
+	}
+	else if (isa != Crc32::ISA_SCALAR && len >= 64) {
+		const size_t n = len & ~size_t(15);
+		c = crcPclmul(c, p, n);
+		p += n;
+		len -= n;
+	}
+#endif
+	return crcScalar(c, p, len);
+}
+
+uint32_t Crc32::update(uint32_t value, const void* data, size_t len) {
+	return ~crc(current().load(std::memory_order_relaxed), ~value, static_cast<const unsigned char*>(data), len);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+std::atomic<Crc32::Isa>& Crc32::current() {
+	static std::atomic<Isa> isa(detect());
+	return isa;
+}
+
+Crc32::Isa Crc32::detect() {
+#ifdef CRC_SIMD_X86
+	for (Isa isa : { ISA_VPCLMUL, ISA_PCLMUL }) {
+		if (cpuSupports(isa) && selfTest(isa))
+			return isa;
+	}
+#endif
+	return ISA_SCALAR;
+}
+
+Crc32::Isa Crc32::isa() {
+	return current().load(std::memory_order_relaxed);
+}
+
+Crc32::Isa Crc32::setIsa(Isa isa) {
+#ifdef CRC_SIMD_X86
+	while (isa != ISA_SCALAR && !(cpuSupports(isa) && selfTest(isa)))
+		isa = static_cast<Isa>(isa - 1);
+#else
+	isa = ISA_SCALAR;
+#endif
+	current().store(isa, std::memory_order_relaxed);
+	return isa;
+}
+
+const char* Crc32::isaName(Isa isa) {
+	switch (isa) {
+	case ISA_PCLMUL: return "PCLMULQDQ";
+	case ISA_VPCLMUL: return "VPCLMULQDQ";
+	default: return "slice-by-16";
+	}
+}
+
+// Every length up to a few folding loops, at every alignment of the start, against the tables
+bool Crc32::selfTest(Isa isa) {
+	std::vector<unsigned char> data(1024 + 16);
+	uint32_t seed = 0x12345678;
+	for (auto& b : data) {
+		seed = seed * 1103515245 + 12345;
+		b = static_cast<unsigned char>(seed >> 16);
+	}
+	for (size_t offset = 0; offset < 16; offset += 5) {
+		for (size_t len = 0; len <= 1024; len += len < 300 ? 1 : 61) {
+			const uint32_t start = static_cast<uint32_t>(len * 0x9e3779b9u);
+			if (crc(isa, start, &data[offset], len) != crcScalar(start, &data[offset], len))
+				return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,57 @@
+#pragma once
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// CRC-32 of zip and of the permits, the same as crc32() of zlib but faster.
+// Long buffers are folded 64 bytes at a time with carry-less multiplication (PCLMULQDQ), or 128 bytes
+// at a time with its 256 bit form (VPCLMULQDQ); short ones and the tails go through slice-by-16 tables.
+// The instruction set is picked at runtime via CPUID and checked against the tables on first use.
+class Crc32
+{
+public:
+	enum Isa {
+		ISA_SCALAR,
+		ISA_PCLMUL,
+		ISA_VPCLMUL
+	};
+
+	// Instruction set currently in use
+	static Isa isa();
+	// Forces a given instruction set (for testing), returns the one actually selected.
+	// An unsupported request falls back to the best available one below it.
+	static Isa setIsa(Isa isa);
+	static const char* isaName(Isa isa);
+
+	// Continues crc over len more bytes, start with 0. Same result as zlib crc32(crc, data, len).
+	static uint32_t update(uint32_t crc, const void* data, size_t len);
+
+private:
+	static Isa detect();
+	static bool selfTest(Isa isa);
+	static std::atomic<Isa>& current();
+};
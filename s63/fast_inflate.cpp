@@ -0,0 +1,417 @@
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "fast_inflate.h"
+
+#include <cstdint>
+#include <cstring>
+
+// Decode table entry: bits 0-4 the length of the code, then the flags, bits 8-12 the number of extra
+// bits of a length or a distance (or the index bits of a subtable), bits 16-31 the literal, the base
+// length or distance, or the offset of the subtable. 0 is a code which is not in the table.
+static const uint32_t ENTRY_LENGTH_MASK = 0x1f;
+static const uint32_t ENTRY_LITERAL = 0x20;
+static const uint32_t ENTRY_END = 0x40;
+static const uint32_t ENTRY_SUBTABLE = 0x80;
+
+static const unsigned LITLEN_BITS = 11;
+static const unsigned DIST_BITS = 8;
+static const unsigned PRECODE_BITS = 7;
+static const unsigned MAX_CODE_LENGTH = 15;
+
+// First level table plus one subtable per symbol, more than any set of lengths can use
+static const size_t LITLEN_TABLE_SIZE = (1 << LITLEN_BITS) + 288 * (1 << (MAX_CODE_LENGTH - LITLEN_BITS));
+static const size_t DIST_TABLE_SIZE = (1 << DIST_BITS) + 32 * (1 << (MAX_CODE_LENGTH - DIST_BITS));
+
+static const uint16_t LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t DIST_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t DIST_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t PRECODE_ORDER[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// Canonical Huffman decode table for the code lengths lens[0..count), symbol s decodes to symbols[s].
+// Codes longer than table_bits continue in a subtable, which the first level entry points to.
+// False for an over-subscribed set of lengths, or an incomplete one other than a single code,
+// which deflate allows for literals/lengths and distances but not for the code length code.
+static bool buildTable(uint32_t* table, unsigned table_bits, const uint8_t* lens, unsigned count,
+	const uint32_t* symbols, bool single_code_ok) {
+
+	unsigned len_count[MAX_CODE_LENGTH + 1] = {};
+	for (unsigned s = 0; s < count; ++s)
+		++len_count[lens[s]];
+	len_count[0] = 0;
+
+	unsigned max_len = 0;
+	int left = 1;
+	for (unsigned len = 1; len <= MAX_CODE_LENGTH; ++len) {
+		left = (left << 1) - static_cast<int>(len_count[len]);
+		if (left < 0)
+			return false;
+		if (len_count[len])
+			max_len = len;
+	}
+
+	const size_t first = size_t(1) << table_bits;
+	if (max_len == 0 || left > 0) {
+		if (max_len != 0 && !(single_code_ok && max_len == 1))
+			return false;
+		// Only some of the slots get a code, the rest must read as invalid
+		memset(table, 0, first * sizeof(uint32_t));
+		if (max_len == 0)
+			return true;
+	}
+
+	// Symbols sorted by code length, the canonical codes are assigned in this order
+	uint16_t offsets[MAX_CODE_LENGTH + 2] = {};
+	for (unsigned len = 1; len <= MAX_CODE_LENGTH; ++len)
+		offsets[len + 1] = static_cast<uint16_t>(offsets[len] + len_count[len]);
+	uint16_t sorted[288];
+	for (unsigned s = 0; s < count; ++s) {
+		if (lens[s])
+			sorted[offsets[lens[s]]++] = static_cast<uint16_t>(s);
+	}
+	const unsigned total = offsets[MAX_CODE_LENGTH];
+
+	const unsigned sub_bits = max_len > table_bits ? max_len - table_bits : 0;
+	size_t next_sub = first;
+	size_t sub_start = 0;
+	unsigned current_prefix = ~0u;
+	unsigned code = 0;
+	unsigned code_len = lens[sorted[0]];
+	for (unsigned n = 0; n < total; ++n, ++code) {
+
+		const unsigned s = sorted[n];
+		const unsigned len = lens[s];
+		code <<= len - code_len;
+		code_len = len;
+
+		// Codes are read from the lowest bit, so the table index is the code reversed
+		unsigned rev = 0;
+		for (unsigned i = 0; i < len; ++i)
+			rev |= ((code >> i) & 1) << (len - 1 - i);
+
+		if (len <= table_bits) {
+			for (size_t i = rev; i < first; i += size_t(1) << len)
+				table[i] = symbols[s] | len;
+			continue;
+		}
+
+		// Canonical codes grow, so the long codes with the same first table_bits bits come one after another
+		const unsigned prefix = code >> (len - table_bits);
+		if (prefix != current_prefix) {
+			current_prefix = prefix;
+			sub_start = next_sub;
+			next_sub += size_t(1) << sub_bits;
+			table[rev & (first - 1)] = ENTRY_SUBTABLE | (static_cast<uint32_t>(sub_start) << 16) | (sub_bits << 8) | table_bits;
+		}
+		const unsigned rest = len - table_bits;
+		for (size_t i = rev >> table_bits; i < (size_t(1) << sub_bits); i += size_t(1) << rest)
+			table[sub_start + i] = symbols[s] | rest;
+	}
+	return true;
+}
+
+// Table entries of every symbol, and the tables of the fixed codes
+struct StaticTables {
+	uint32_t litlen_symbols[288];
+	uint32_t dist_symbols[32];
+	uint32_t precode_symbols[19];
+	uint32_t fixed_litlen[LITLEN_TABLE_SIZE];
+	uint32_t fixed_dist[DIST_TABLE_SIZE];
+
+	StaticTables() {
+		for (uint32_t s = 0; s < 288; ++s) {
+			if (s < 256)
+				litlen_symbols[s] = (s << 16) | ENTRY_LITERAL;
+			else if (s == 256)
+				litlen_symbols[s] = ENTRY_END;
+			else if (s < 286)
+				litlen_symbols[s] = (uint32_t(LENGTH_BASE[s - 257]) << 16) | (uint32_t(LENGTH_EXTRA[s - 257]) << 8);
+			else
+				litlen_symbols[s] = 0;	// base 0, the decoder refuses it
+		}
+		for (uint32_t s = 0; s < 32; ++s)
+			dist_symbols[s] = s < 30 ? (uint32_t(DIST_BASE[s]) << 16) | (uint32_t(DIST_EXTRA[s]) << 8) : 0;
+		for (uint32_t s = 0; s < 19; ++s)
+			precode_symbols[s] = s << 16;
+
+		uint8_t lens[288];
+		memset(lens, 8, 144);
+		memset(lens + 144, 9, 112);
+		memset(lens + 256, 7, 24);
+		memset(lens + 280, 8, 8);
+		buildTable(fixed_litlen, LITLEN_BITS, lens, 288, litlen_symbols, true);
+		memset(lens, 5, 32);
+		buildTable(fixed_dist, DIST_BITS, lens, 32, dist_symbols, true);
+	}
+};
+
+static const StaticTables& staticTables() {
+	static const StaticTables tables;
+	return tables;
+}
+
+// Tables of the dynamic blocks, rebuilt for every block
+struct DynamicTables {
+	uint32_t litlen[LITLEN_TABLE_SIZE];
+	uint32_t dist[DIST_TABLE_SIZE];
+	uint32_t precode[1 << PRECODE_BITS];
+};
+
+// Bits are taken from the lowest end of a 64 bit buffer. While there are 8 bytes of input left,
+// a refill is a single unaligned load, which leaves at least 56 bits: enough for the longest
+// length and distance with their extra bits (48). Past the end of the input zeros are shifted in
+// and counted, a stream which needs them is broken.
+struct BitReader {
+	const uint8_t* in;
+	const uint8_t* end;
+	uint64_t buf = 0;
+	unsigned left = 0;
+	size_t overrun = 0;
+
+	void refill() {
+		if (end - in >= 8) {
+			uint64_t word;
+			memcpy(&word, in, sizeof(word));
+			buf |= word << left;
+			in += (63 - left) >> 3;
+			left |= 56;
+		}
+		else {
+			while (left <= 56) {
+				uint64_t byte = 0;
+				if (in < end)
+					byte = *in++;
+				else
+					++overrun;
+				buf |= byte << left;
+				left += 8;
+			}
+		}
+	}
+	uint32_t peek(unsigned n) const { return static_cast<uint32_t>(buf & ((uint64_t(1) << n) - 1)); }
+	void consume(unsigned n) { buf >>= n; left -= n; }
+	uint32_t bits(unsigned n) {
+		uint32_t v = peek(n);
+		consume(n);
+		return v;
+	}
+	// Nothing was taken from the zeros past the end of the input
+	bool valid() const { return overrun * 8 <= left; }
+};
+
+static bool readDynamicTables(BitReader& r, DynamicTables& t) {
+
+	const StaticTables& st = staticTables();
+	r.refill();
+	const unsigned nlit = r.bits(5) + 257;
+	const unsigned ndist = r.bits(5) + 1;
+	const unsigned nclen = r.bits(4) + 4;
+	if (nlit > 286 || ndist > 30)
+		return false;
+
+	uint8_t clens[19] = {};
+	for (unsigned i = 0; i < nclen; ++i) {
+		r.refill();
+		clens[PRECODE_ORDER[i]] = static_cast<uint8_t>(r.bits(3));
+	}
+	if (!buildTable(t.precode, PRECODE_BITS, clens, 19, st.precode_symbols, false))
+		return false;
+
+	uint8_t lens[288 + 32];
+	for (unsigned i = 0; i < nlit + ndist; ) {
+		r.refill();
+		uint32_t entry = t.precode[r.peek(PRECODE_BITS)];
+		unsigned len = entry & ENTRY_LENGTH_MASK;
+		if (!len)
+			return false;
+		r.consume(len);
+		unsigned sym = entry >> 16;
+		if (sym < 16) {
+			lens[i++] = static_cast<uint8_t>(sym);
+			continue;
+		}
+		unsigned repeat;
+		uint8_t value = 0;
+		if (sym == 16) {
+			if (i == 0)
+				return false;
+			value = lens[i - 1];
+			repeat = 3 + r.bits(2);
+		}
+		else if (sym == 17) {
+			repeat = 3 + r.bits(3);
+		}
+		else {
+			repeat = 11 + r.bits(7);
+		}
+		if (repeat > nlit + ndist - i)
+			return false;
+		memset(lens + i, value, repeat);
+		i += repeat;
+	}
+	// A block without an end of block code can not end
+	if (!lens[256])
+		return false;
+
+	return buildTable(t.litlen, LITLEN_BITS, lens, nlit, st.litlen_symbols, true) &&
+		buildTable(t.dist, DIST_BITS, lens + nlit, ndist, st.dist_symbols, true);
+}
+
+bool FastInflate::decode(const char* in, size_t in_len, char* out, size_t out_len) {
+
+	static thread_local DynamicTables dynamic;
+	const StaticTables& st = staticTables();
+
+	BitReader r;
+	r.in = reinterpret_cast<const uint8_t*>(in);
+	r.end = r.in + in_len;
+	uint8_t* const out_begin = reinterpret_cast<uint8_t*>(out);
+	uint8_t* const out_end = out_begin + out_len;
+	uint8_t* dst = out_begin;
+
+	bool last;
+	do {
+		r.refill();
+		last = r.bits(1) != 0;
+		const unsigned type = r.bits(2);
+
+		if (type == 0) {
+			// Stored: the bytes still in the bit buffer go back to the input
+			r.consume(r.left & 7);
+			const size_t unread = r.left >> 3;
+			if (unread < r.overrun)
+				return false;
+			r.in -= unread - r.overrun;
+			r.buf = 0;
+			r.left = 0;
+			r.overrun = 0;
+			if (r.end - r.in < 4)
+				return false;
+			const size_t len = r.in[0] | (r.in[1] << 8);
+			const size_t nlen = r.in[2] | (r.in[3] << 8);
+			r.in += 4;
+			if (len != (~nlen & 0xffff) || size_t(r.end - r.in) < len || size_t(out_end - dst) < len)
+				return false;
+			memcpy(dst, r.in, len);
+			r.in += len;
+			dst += len;
+			continue;
+		}
+
+		const uint32_t* litlen;
+		const uint32_t* dist;
+		if (type == 1) {
+			litlen = st.fixed_litlen;
+			dist = st.fixed_dist;
+		}
+		else if (type == 2) {
+			if (!readDynamicTables(r, dynamic))
+				return false;
+			litlen = dynamic.litlen;
+			dist = dynamic.dist;
+		}
+		else {
+			return false;
+		}
+
+		for (;;) {
+			r.refill();
+			uint32_t entry = litlen[r.peek(LITLEN_BITS)];
+			if (entry & ENTRY_SUBTABLE) {
+				r.consume(LITLEN_BITS);
+				entry = litlen[(entry >> 16) + r.peek((entry >> 8) & 0x1f)];
+			}
+			if (!(entry & ENTRY_LENGTH_MASK))
+				return false;
+			r.consume(entry & ENTRY_LENGTH_MASK);
+
+			if (entry & ENTRY_LITERAL) {
+				if (dst == out_end)
+					return false;
+				*dst++ = static_cast<uint8_t>(entry >> 16);
+				// Literals come in runs, a second one fits in the bits left over from the refill
+				entry = litlen[r.peek(LITLEN_BITS)];
+				if ((entry & (ENTRY_LITERAL | ENTRY_SUBTABLE)) == ENTRY_LITERAL) {
+					if (dst == out_end)
+						return false;
+					r.consume(entry & ENTRY_LENGTH_MASK);
+					*dst++ = static_cast<uint8_t>(entry >> 16);
+				}
+				continue;
+			}
+			if (entry & ENTRY_END)
+				break;
+
+			if (!(entry >> 16))
+				return false;
+			const size_t length = (entry >> 16) + r.bits((entry >> 8) & 0x1f);
+
+			entry = dist[r.peek(DIST_BITS)];
+			if (entry & ENTRY_SUBTABLE) {
+				r.consume(DIST_BITS);
+				entry = dist[(entry >> 16) + r.peek((entry >> 8) & 0x1f)];
+			}
+			if (!(entry & ENTRY_LENGTH_MASK) || !(entry >> 16))
+				return false;
+			r.consume(entry & ENTRY_LENGTH_MASK);
+			const size_t distance = (entry >> 16) + r.bits((entry >> 8) & 0x1f);
+
+			if (distance > size_t(dst - out_begin) || length > size_t(out_end - dst))
+				return false;
+
+			// The whole output is the window, a match is copied from it directly
+			const uint8_t* src = dst - distance;
+			uint8_t* const match_end = dst + length;
+			if (distance >= 8 && size_t(out_end - dst) >= length + 7) {
+				// Whole words, the last one may run past the match but not past the output.
+				// With the source at least 8 bytes back, every word is complete before it is read.
+				do {
+					uint64_t word;
+					memcpy(&word, src, sizeof(word));
+					memcpy(dst, &word, sizeof(word));
+					src += 8;
+					dst += 8;
+				} while (dst < match_end);
+				dst = match_end;
+			}
+			else if (distance == 1) {
+				memset(dst, *src, length);
+				dst = match_end;
+			}
+			else {
+				while (dst < match_end)
+					*dst++ = *src++;
+			}
+		}
+		if (!r.valid())
+			return false;
+	} while (!last);
+
+	return dst == out_end && r.valid();
+}
@@ -0,0 +1,39 @@
+#pragma once
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstddef>
+
+// Deflate decoder for a whole buffer whose uncompressed size is known up front, as it is for a zip entry.
+// Unlike zlib inflate there is no window to manage and no state to save between calls: matches are
+// copied straight from the output, 8 bytes at a time where the output has room for it, and symbols are
+// decoded with a 64 bit bit buffer and wide first level tables (11 bits for literals and lengths,
+// 8 for distances), so most codes take a single lookup.
+class FastInflate
+{
+public:
+	// Decodes a raw deflate stream into exactly out_len bytes. False if the data is broken,
+	// does not end where out_len says, or needs more input than in_len.
+	static bool decode(const char* in, size_t in_len, char* out, size_t out_len);
+};
@@ -0,0 +1,477 @@
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "iso8211.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define ISO8211_LEADER_SIZE 24
+
+static size_t readNumber(const char* p, size_t len)
+{
+	size_t value = 0;
+	for (size_t i = 0; i < len; ++i) {
+		if (p[i] == ' ')
+			continue;
+		if (p[i] < '0' || p[i] > '9')
+			return SIZE_MAX;
+		value = value * 10 + (p[i] - '0');
+	}
+	return value;
+}
+
+static std::string writeNumber(size_t value, size_t width)
+{
+	std::string out(width, '0');
+	for (size_t i = width; i-- > 0 && value;) {
+		out[i] = static_cast<char>('0' + value % 10);
+		value /= 10;
+	}
+	return out;
+}
+
+static size_t digits(size_t value)
+{
+	size_t n = 1;
+	while (value >= 10) {
+		value /= 10;
+		++n;
+	}
+	return n;
+}
+
+int Iso8211FieldDesc::find(const std::string& subfield) const
+{
+	for (size_t i = 0; i < subfields.size(); ++i) {
+		if (subfields[i].name == subfield)
+			return static_cast<int>(i);
+	}
+	return -1;
+}
+
+Iso8211Field* Iso8211Record::find(const std::string& tag)
+{
+	for (auto& f : fields) {
+		if (f.tag == tag)
+			return &f;
+	}
+	return nullptr;
+}
+
+const Iso8211Field* Iso8211Record::find(const std::string& tag) const
+{
+	return const_cast<Iso8211Record*>(this)->find(tag);
+}
+
+// Format controls like "(b11,b14,2b11,3A,A(8),B(40))", repeat counts and nested groups are expanded
+static bool parseFormatItems(const std::string& s, size_t& pos, std::vector<std::pair<char, size_t>>& out)
+{
+	while (pos < s.size()) {
+		char c = s[pos];
+		if (c == ',' || c == ' ') {
+			++pos;
+			continue;
+		}
+		if (c == ')') {
+			++pos;
+			return true;
+		}
+		size_t repeat = 0;
+		while (pos < s.size() && s[pos] >= '0' && s[pos] <= '9')
+			repeat = repeat * 10 + (s[pos++] - '0');
+		if (repeat == 0)
+			repeat = 1;
+		if (pos >= s.size())
+			return false;
+
+		std::vector<std::pair<char, size_t>> item;
+		c = s[pos++];
+		if (c == '(') {
+			if (!parseFormatItems(s, pos, item))
+				return false;
+		}
+		else if (c == 'b') {
+			// bXY: X is 1 for unsigned and 2 for signed, Y is the width in bytes
+			if (pos + 2 > s.size() || s[pos + 1] < '1' || s[pos + 1] > '8')
+				return false;
+			item.push_back({ 'b', static_cast<size_t>(s[pos + 1] - '0') });
+			pos += 2;
+		}
+		else if (c == 'A' || c == 'I' || c == 'R' || c == 'S' || c == 'C' || c == 'B' || c == 'X') {
+			size_t width = 0;
+			if (pos < s.size() && s[pos] == '(') {
+				size_t end = s.find(')', pos);
+				if (end == std::string::npos)
+					return false;
+				width = readNumber(s.data() + pos + 1, end - pos - 1);
+				if (width == SIZE_MAX)
+					return false;
+				pos = end + 1;
+			}
+			if (c == 'B') {
+				// bit string, the width is in bits
+				if (width % 8)
+					return false;
+				width /= 8;
+			}
+			item.push_back({ c, width });
+		}
+		else {
+			return false;
+		}
+		for (size_t i = 0; i < repeat; ++i)
+			out.insert(out.end(), item.begin(), item.end());
+	}
+	return true;
+}
+
+bool Iso8211File::parseFormat(const std::string& format, std::vector<std::pair<char, size_t>>& out)
+{
+	size_t pos = 0;
+	return parseFormatItems(format, pos, out);
+}
+
+bool Iso8211File::addFieldDesc(const std::string& tag, const std::string& controls, const std::string& name,
+	const std::string& array_descriptor, const std::string& format)
+{
+	Iso8211FieldDesc desc;
+	desc.tag = tag;
+	desc.controls = controls;
+	desc.name = name;
+	desc.array_descriptor = array_descriptor;
+	desc.format = format;
+	desc.wide = controls.size() >= 9 && controls.compare(6, 3, "%/@") == 0;
+
+	std::vector<std::pair<char, size_t>> formats;
+	if (!parseFormat(format, formats)) {
+		printf("Bad format controls of field %s\n", tag.c_str());
+		return false;
+	}
+	std::vector<std::string> names;
+	size_t start = 0;
+	if (!array_descriptor.empty() && array_descriptor[0] == '*') {
+		desc.repeating = true;
+		start = 1;
+	}
+	while (start < array_descriptor.size()) {
+		size_t end = array_descriptor.find('!', start);
+		if (end == std::string::npos)
+			end = array_descriptor.size();
+		names.push_back(array_descriptor.substr(start, end - start));
+		start = end + 1;
+	}
+	if (names.empty())
+		names.resize(formats.size());
+	if (names.size() != formats.size()) {
+		printf("Field %s has %zu subfields but %zu formats\n", tag.c_str(), names.size(), formats.size());
+		return false;
+	}
+	for (size_t i = 0; i < names.size(); ++i)
+		desc.subfields.push_back({ names[i], formats[i].first, formats[i].second });
+
+	// A parsed DDR no longer describes the file, it is built again
+	m_ddr.clear();
+	for (auto& d : m_descs) {
+		if (d.tag == tag) {
+			d = std::move(desc);
+			return true;
+		}
+	}
+	m_descs.push_back(std::move(desc));
+	return true;
+}
+
+const Iso8211FieldDesc* Iso8211File::desc(const std::string& tag) const
+{
+	for (const auto& d : m_descs) {
+		if (d.tag == tag)
+			return &d;
+	}
+	return nullptr;
+}
+
+// Walks the directory of a record: calls f(tag, data, len) for every field.
+// Returns the size of the record, 0 on error.
+template <class F>
+static size_t readRecord(const char* buf, size_t len, F f)
+{
+	if (len < ISO8211_LEADER_SIZE)
+		return 0;
+	size_t base = readNumber(buf + 12, 5);
+	size_t size_len = readNumber(buf + 20, 1);
+	size_t size_pos = readNumber(buf + 21, 1);
+	size_t size_tag = readNumber(buf + 23, 1);
+	if (base == SIZE_MAX || base > len || !size_len || !size_pos || !size_tag || size_len == SIZE_MAX ||
+		size_pos == SIZE_MAX || size_tag == SIZE_MAX)
+		return 0;
+
+	size_t entry = size_tag + size_len + size_pos;
+	size_t end = base;
+	for (const char* p = buf + ISO8211_LEADER_SIZE; p + entry < buf + base && *p != ISO8211_FT; p += entry) {
+		size_t field_len = readNumber(p + size_tag, size_len);
+		size_t field_pos = readNumber(p + size_tag + size_len, size_pos);
+		if (field_len == SIZE_MAX || field_pos == SIZE_MAX || base + field_pos + field_len > len)
+			return 0;
+		if (!f(std::string(p, size_tag), buf + base + field_pos, field_len))
+			return 0;
+		if (base + field_pos + field_len > end)
+			end = base + field_pos + field_len;
+	}
+	// The record length may be missing for records longer than 99999 bytes
+	size_t record_len = readNumber(buf, 5);
+	return record_len && record_len != SIZE_MAX && record_len <= len ? record_len : end;
+}
+
+bool Iso8211File::parseDDR(const char* buf, size_t len)
+{
+	if (len < ISO8211_LEADER_SIZE || buf[6] != 'L') {
+		puts("Not an ISO 8211 file\n");
+		return false;
+	}
+	size_t control_len = readNumber(buf + 10, 2);
+	if (control_len == SIZE_MAX)
+		return false;
+
+	size_t ddr_len = readRecord(buf, len, [&](const std::string& tag, const char* p, size_t n) {
+		if (n && p[n - 1] == ISO8211_FT)
+			--n;
+		if (n < control_len)
+			return false;
+		std::string controls(p, control_len);
+		std::string parts[3];
+		size_t part = 0;
+		for (size_t i = control_len; i < n; ++i) {
+			if (p[i] == ISO8211_UT && part < 2)
+				++part;
+			else
+				parts[part] += p[i];
+		}
+		if (tag == "0000") {
+			Iso8211FieldDesc desc;
+			desc.tag = tag;
+			desc.controls = controls;
+			desc.name = parts[0];
+			m_descs.push_back(std::move(desc));
+			return true;
+		}
+		return addFieldDesc(tag, controls, parts[0], parts[1], parts[2]);
+	});
+	if (!ddr_len)
+		return false;
+	m_ddr.assign(buf, ddr_len);
+	return true;
+}
+
+bool Iso8211File::parse(const char* buf, size_t len)
+{
+	m_ddr.clear();
+	m_descs.clear();
+	records.clear();
+	if (!parseDDR(buf, len))
+		return false;
+
+	size_t pos = m_ddr.size();
+	while (pos < len) {
+		Iso8211Record record;
+		size_t record_len = readRecord(buf + pos, len - pos, [&](const std::string& tag, const char* p, size_t n) {
+			const Iso8211FieldDesc* d = desc(tag);
+			if (d && d->wide && n >= 2 && p[n - 2] == ISO8211_FT && p[n - 1] == 0)
+				n -= 2;
+			else if (n && p[n - 1] == ISO8211_FT)
+				--n;
+			record.fields.push_back({ tag, std::string(p, n) });
+			return true;
+		});
+		if (!record_len) {
+			printf("Bad ISO 8211 record at offset %zu\n", pos);
+			return false;
+		}
+		records.push_back(std::move(record));
+		pos += record_len;
+	}
+	return true;
+}
+
+bool Iso8211File::split(const Iso8211Field& field, Iso8211Rows& rows) const
+{
+	rows.clear();
+	const Iso8211FieldDesc* d = desc(field.tag);
+	if (!d || d->subfields.empty())
+		return false;
+
+	const std::string& data = field.data;
+	size_t pos = 0;
+	while (pos < data.size()) {
+		std::vector<std::string> row;
+		for (const auto& sf : d->subfields) {
+			if (sf.width) {
+				if (pos + sf.width > data.size())
+					return false;
+				row.push_back(data.substr(pos, sf.width));
+				pos += sf.width;
+				continue;
+			}
+			size_t end = pos;
+			if (d->wide) {
+				while (end + 1 < data.size() && !(data[end] == ISO8211_UT && data[end + 1] == 0))
+					end += 2;
+				if (end + 1 >= data.size())
+					end = data.size();
+				row.push_back(data.substr(pos, end - pos));
+				pos = end + 2 > data.size() ? data.size() : end + 2;
+			}
+			else {
+				end = data.find(static_cast<char>(ISO8211_UT), pos);
+				if (end == std::string::npos)
+					end = data.size();
+				row.push_back(data.substr(pos, end - pos));
+				pos = end + 1 > data.size() ? data.size() : end + 1;
+			}
+		}
+		rows.push_back(std::move(row));
+		if (!d->repeating)
+			break;
+	}
+	return true;
+}
+
+bool Iso8211File::join(const std::string& tag, const Iso8211Rows& rows, std::string& data) const
+{
+	data.clear();
+	const Iso8211FieldDesc* d = desc(tag);
+	if (!d || (!d->repeating && rows.size() > 1))
+		return false;
+
+	for (const auto& row : rows) {
+		if (row.size() != d->subfields.size())
+			return false;
+		for (size_t i = 0; i < row.size(); ++i) {
+			const auto& sf = d->subfields[i];
+			if (sf.width) {
+				if (row[i].size() != sf.width)
+					return false;
+				data += row[i];
+			}
+			else {
+				data += row[i];
+				data += static_cast<char>(ISO8211_UT);
+				if (d->wide)
+					data += '\0';
+			}
+		}
+	}
+	return true;
+}
+
+uint32_t Iso8211File::toUInt(const std::string& value)
+{
+	uint32_t v = 0;
+	for (size_t i = value.size() < 4 ? value.size() : 4; i-- > 0;)
+		v = (v << 8) | static_cast<unsigned char>(value[i]);
+	return v;
+}
+
+std::string Iso8211File::fromUInt(uint32_t value, size_t width)
+{
+	std::string out(width, '\0');
+	for (size_t i = 0; i < width && i < 4; ++i)
+		out[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+	return out;
+}
+
+std::string Iso8211File::serializeRecord(const std::string& leader_start, const std::string& leader_mid,
+	const std::vector<std::pair<std::string, std::string>>& fields)
+{
+	size_t area = 0;
+	size_t max_len = 0;
+	for (const auto& f : fields) {
+		area += f.second.size();
+		if (f.second.size() > max_len)
+			max_len = f.second.size();
+	}
+	size_t size_len = digits(max_len);
+	size_t size_pos = digits(area);
+	size_t base = ISO8211_LEADER_SIZE + fields.size() * (4 + size_len + size_pos) + 1;
+	size_t record_len = base + area;
+
+	std::string out;
+	out.reserve(record_len);
+	out += record_len > 99999 ? std::string(5, '0') : writeNumber(record_len, 5);
+	out += leader_start;
+	out += writeNumber(base, 5);
+	out += leader_mid;
+	out += writeNumber(size_len, 1);
+	out += writeNumber(size_pos, 1);
+	out += "04";
+	size_t pos = 0;
+	for (const auto& f : fields) {
+		out += f.first;
+		out += writeNumber(f.second.size(), size_len);
+		out += writeNumber(pos, size_pos);
+		pos += f.second.size();
+	}
+	out += static_cast<char>(ISO8211_FT);
+	for (const auto& f : fields)
+		out += f.second;
+	return out;
+}
+
+std::string Iso8211File::buildDDR() const
+{
+	std::vector<std::pair<std::string, std::string>> fields;
+	for (const auto& d : m_descs) {
+		std::string data = d.controls + d.name;
+		if (d.tag != "0000") {
+			data += static_cast<char>(ISO8211_UT);
+			data += d.array_descriptor;
+			data += static_cast<char>(ISO8211_UT);
+			data += d.format;
+		}
+		data += static_cast<char>(ISO8211_FT);
+		fields.push_back({ d.tag, std::move(data) });
+	}
+	// interchange level 3, leader id L, field control length 9, extended character set " ! "
+	return serializeRecord("3LE1 09", " ! ", fields);
+}
+
+std::string Iso8211File::serialize() const
+{
+	std::string out = m_ddr.empty() ? buildDDR() : m_ddr;
+	std::vector<std::pair<std::string, std::string>> fields;
+	for (const auto& record : records) {
+		fields.clear();
+		for (const auto& f : record.fields) {
+			const Iso8211FieldDesc* d = desc(f.tag);
+			std::string data = f.data;
+			data += static_cast<char>(ISO8211_FT);
+			if (d && d->wide)
+				data += '\0';
+			fields.push_back({ f.tag, std::move(data) });
+		}
+		out += serializeRecord(" D     ", "   ", fields);
+	}
+	return out;
+}
@@ -0,0 +1,104 @@
+#pragma once
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Minimal ISO/IEC 8211 reader and writer, enough to edit S-57 cells.
+// Records are kept as raw field bytes; a field can be split into rows of raw subfield values
+// with the formats from the data descriptive record (DDR) and joined back.
+
+#define ISO8211_UT 0x1f	// unit terminator
+#define ISO8211_FT 0x1e	// field terminator
+
+// One subfield of a field format
+struct Iso8211Subfield {
+	std::string name;
+	char type;		// A, I, R, B (bit string), b (binary number)
+	size_t width;	// in bytes, 0 for a variable one which ends with the unit terminator
+};
+
+struct Iso8211FieldDesc {
+	std::string tag;
+	std::string controls;	// field controls, "1600;&   " and the like
+	std::string name;
+	bool repeating = false;	// subfields repeat as a group up to the end of the field
+	bool wide = false;		// lexical level 2, terminators are two bytes
+	std::string array_descriptor;
+	std::string format;
+	std::vector<Iso8211Subfield> subfields;
+
+	// Index of a subfield, -1 if there is none
+	int find(const std::string& subfield) const;
+};
+
+struct Iso8211Field {
+	std::string tag;
+	std::string data;	// field contents without the field terminator
+};
+
+struct Iso8211Record {
+	std::vector<Iso8211Field> fields;
+
+	Iso8211Field* find(const std::string& tag);
+	const Iso8211Field* find(const std::string& tag) const;
+};
+
+// Subfield values of a field, one row per repetition of the subfield group
+using Iso8211Rows = std::vector<std::vector<std::string>>;
+
+class Iso8211File
+{
+public:
+	bool parse(const std::string& buf) { return parse(buf.data(), buf.size()); }
+	bool parse(const char* buf, size_t len);
+	std::string serialize() const;
+
+	// Adds a field format, for files built from scratch
+	bool addFieldDesc(const std::string& tag, const std::string& controls, const std::string& name,
+		const std::string& array_descriptor, const std::string& format);
+	const Iso8211FieldDesc* desc(const std::string& tag) const;
+
+	bool split(const Iso8211Field& field, Iso8211Rows& rows) const;
+	bool join(const std::string& tag, const Iso8211Rows& rows, std::string& data) const;
+
+	// Little endian binary subfield values
+	static uint32_t toUInt(const std::string& value);
+	static std::string fromUInt(uint32_t value, size_t width);
+
+	std::vector<Iso8211Record> records;
+
+private:
+	bool parseDDR(const char* buf, size_t len);
+	static bool parseFormat(const std::string& format, std::vector<std::pair<char, size_t>>& out);
+	std::string buildDDR() const;
+	static std::string serializeRecord(const std::string& leader_start, const std::string& leader_mid,
+		const std::vector<std::pair<std::string, std::string>>& fields);
+
+	std::string m_ddr;	// raw DDR of a parsed file, written back as is
+	std::vector<Iso8211FieldDesc> m_descs;
+};
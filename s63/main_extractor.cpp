@@ -1,14 +1,23 @@
 #include <iostream>
 #include <fstream>
 #include <cassert>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
 #include <filesystem>
-#include <regex>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
 
 #include "INIReader.h"
 #include "blowfish.h"
+#include "crc32_simd.h"
 #include "s63Client.h"
 #include "simple_zip.h"
 #include "s63utils.hpp"
+#include "thread_pool.h"
+#include "mapped_file.h"
 
 using namespace std;
 using namespace hexutils;
@@ -25,6 +34,20 @@ static void WriteFileWithENCnames(std::filesystem::path P, std::vector<std::stri
 	ofs.close();
 }
 
+// Directory of a cell: in an exchange set a file is in CELL/<edition>/<update>/, the numbered
+// directories are skipped. A flat copy has its files right in the cell directory.
+static std::filesystem::path CellDirectory(const std::filesystem::path& file)
+{
+	std::filesystem::path dir = file.parent_path();
+	for (;;)
+	{
+		std::string name = dir.filename().string();
+		if (name.empty() || !std::all_of(name.begin(), name.end(), ::isdigit))
+			return dir;
+		dir = dir.parent_path();
+	}
+}
+
 //returns true if emptry directory otherwise false
 static bool WipeEmptyDirs(std::filesystem::path P)
 {
@@ -48,6 +71,123 @@ static bool WipeEmptyDirs(std::filesystem::path P)
 	return std::filesystem::is_empty(P);
 }
 
+// State of one extracted cell file, kept between runs
+struct ManifestEntry
+{
+	uint64_t size = 0;
+	int64_t mtime = 0;
+	uint32_t fingerprint = 0;	// CRC32 of the encrypted file
+	uint64_t out_size = 0;
+};
+
+// Manifest of the cell files extracted by the previous runs, so unchanged ones are skipped.
+// Every finished file is appended to a journal right away; a run that dies half way is resumed
+// from the manifest plus the journal, and a complete run folds the journal into the manifest.
+class Manifest
+{
+public:
+	explicit Manifest(const std::filesystem::path& dir)
+		: m_path(dir / "s63manifest.txt"), m_journal_path(dir / "s63manifest.journal") {}
+
+	// Without resume the previous runs are ignored and the journal starts over
+	void load(bool resume)
+	{
+		if (resume)
+		{
+			read(m_path);
+			read(m_journal_path);
+		}
+		m_journal.open(m_journal_path, resume ? std::ios::app : std::ios::trunc);
+	}
+
+	// Entry of the previous runs, only read while the workers run
+	const ManifestEntry* find(const std::string& path) const
+	{
+		auto it = m_entries.find(path);
+		return it == m_entries.end() ? nullptr : &it->second;
+	}
+
+	// Output is complete, journal it
+	void record(const std::string& path, const ManifestEntry& entry)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_done[path] = entry;
+		if (m_journal.is_open())
+		{
+			write(m_journal, path, entry);
+			m_journal.flush();
+		}
+	}
+
+	// Unchanged file, carried over to the new manifest
+	void keep(const std::string& path, const ManifestEntry& entry)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_done[path] = entry;
+	}
+
+	// Writes the manifest of this run and drops the journal. Files which are gone are left out.
+	void commit()
+	{
+		m_journal.close();
+		std::filesystem::path tmp = m_path;
+		tmp += ".tmp";
+		{
+			std::ofstream out(tmp);
+			for (const auto& e : m_done)
+				write(out, e.first, e.second);
+			if (!out)
+				return;
+		}
+		std::error_code ec;
+		std::filesystem::rename(tmp, m_path, ec);
+		if (!ec)
+			std::filesystem::remove(m_journal_path, ec);
+	}
+
+	static int64_t mtime(const std::filesystem::path& p, std::error_code& ec)
+	{
+		return static_cast<int64_t>(std::filesystem::last_write_time(p, ec).time_since_epoch().count());
+	}
+
+	static bool fingerprint(const std::filesystem::path& p, uint32_t& crc)
+	{
+		MappedFile file;
+		if (!file.open(p.string()))
+			return false;
+		crc = Crc32::update(0, file.data(), file.size());
+		return true;
+	}
+
+private:
+	void read(const std::filesystem::path& p)
+	{
+		std::ifstream in(p);
+		std::string line;
+		while (std::getline(in, line))
+		{
+			// path, size, mtime, fingerprint, output size; a torn last line of the journal is dropped
+			std::istringstream fields(line);
+			std::string path;
+			ManifestEntry e;
+			if (std::getline(fields, path, '\t') && fields >> e.size >> e.mtime >> std::hex >> e.fingerprint >> std::dec >> e.out_size)
+				m_entries[path] = e;
+		}
+	}
+
+	static void write(std::ostream& out, const std::string& path, const ManifestEntry& e)
+	{
+		out << path << '\t' << e.size << ' ' << e.mtime << ' ' << std::hex << e.fingerprint << std::dec << ' ' << e.out_size << '\n';
+	}
+
+	std::filesystem::path m_path;
+	std::filesystem::path m_journal_path;
+	std::unordered_map<std::string, ManifestEntry> m_entries;
+	std::map<std::string, ManifestEntry> m_done;
+	std::ofstream m_journal;
+	std::mutex m_mutex;
+};
+
 int main(int argc, char* argv[])
 {
 	std::string projectIniFile = "./configs/example.ini"; //Assuming execution path in root source dir
@@ -79,9 +219,16 @@ int main(int argc, char* argv[])
 		return -2;
 	}
 
-	std::vector<std::string> encFileNames;
-	int cntToBeDecrypted = 0;
-	int cntDecrypted = 0;
+	// Cells are grouped by base cell: a base cell (.000) and its updates (.001, .002 ...) are
+	// decrypted with the same cell key, so a group is one task. Groups are spread over a work-stealing pool.
+	struct CellFile {
+		size_t order;	// position in the directory walk, s57filenames.txt keeps it
+		int edition;	// from the <edition>/<update> directories, 0 if there are none
+		int update;
+		std::filesystem::path path;
+	};
+	std::map<std::string, std::vector<CellFile>> groups;
+	size_t cntToBeDecrypted = 0;
 
 	for (const auto& entry : std::filesystem::recursive_directory_iterator(dir_in))
 	{
@@ -95,63 +242,136 @@ int main(int argc, char* argv[])
 
 			ext = ext.substr(1, ext.size() - 1);
 
-			static std::regex rx("^[0-9]");             // Getting the regex object 
-			std::smatch match;
-			
 			bool is_s57_ext = std::all_of(ext.begin(), ext.end(), ::isdigit);
 			if (is_s57_ext)
 			{
 				//should be decrypted
-				cntToBeDecrypted++;
+				std::filesystem::path base = CellDirectory(entry.path()) / entry.path().stem();
+				std::string edition = entry.path().parent_path().parent_path().filename().string();
+				groups[base.string()].push_back({ cntToBeDecrypted++, static_cast<int>(std::strtol(edition.c_str(), nullptr, 10)),
+					static_cast<int>(std::strtol(ext.c_str(), nullptr, 10)), entry.path() });
+			}
+			else
+			{
+				int j = 0; //debug / log here for looking into other files (not .000 .001 .002 etc)
+			}
+		}
+	}
+
+	std::vector<std::vector<CellFile>*> tasks;
+	for (auto& group : groups)
+	{
+		// By edition, then by update
+		std::sort(group.second.begin(), group.second.end(),
+			[](const CellFile& a, const CellFile& b) {
+				return a.edition != b.edition ? a.edition < b.edition : a.update < b.update;
+			});
+		tasks.push_back(&group.second);
+	}
+	// Long update chains first, so they do not end up as the tail of the run
+	std::stable_sort(tasks.begin(), tasks.end(),
+		[](const std::vector<CellFile>* a, const std::vector<CellFile>* b) { return a->size() > b->size(); });
+
+	// --full extracts everything again, ignoring what the previous runs did
+	bool full = argc > 1 && std::string(argv[1]) == "--full";
+	std::filesystem::create_directories(dir_out);
+	Manifest manifest(dir_out);
+	manifest.load(!full);
+	std::atomic<int> cntUnchanged(0);
 
-				std::string p = entry.path().relative_path().string();
+	std::vector<char> decrypted(cntToBeDecrypted, 0);
+	// Workers plus the main thread in wait() make one thread per core
+	ThreadPool pool;
+	for (auto* group : tasks)
+	{
+		pool.submit([&, group]() {
+			// Each worker has its own cipher context
+			S63Context& ctx = S63Context::local();
+			for (const CellFile& cell : *group)
+			{
+				std::string p = cell.path.relative_path().string();
 				std::string p_out = dir_out + "\\" + p;
+				std::error_code ec;
 
-				//check that the outpout dir exists
-				std::filesystem::path p_check(p_out);
-				std::filesystem::path dir = p_check.parent_path();
-				if (std::filesystem::exists(dir) == false)
+				// Skip files which are the same as in the previous run and whose output is still there.
+				// Size and mtime are enough to tell, a file with a new mtime is compared by content.
+				ManifestEntry entry;
+				entry.size = std::filesystem::file_size(cell.path, ec);
+				entry.mtime = Manifest::mtime(cell.path, ec);
+				bool have_fingerprint = false;
+				const ManifestEntry* old = manifest.find(p);
+				if (old && old->size == entry.size && std::filesystem::file_size(p_out, ec) == old->out_size && !ec)
 				{
-					std::filesystem::create_directories(dir);
+					bool same = old->mtime == entry.mtime;
+					if (!same && Manifest::fingerprint(cell.path, entry.fingerprint))
+					{
+						have_fingerprint = true;
+						same = entry.fingerprint == old->fingerprint;
+					}
+					if (same)
+					{
+						entry.fingerprint = old->fingerprint;
+						entry.out_size = old->out_size;
+						if (have_fingerprint)
+							manifest.record(p, entry);	// new mtime, no need to read it next time
+						else
+							manifest.keep(p, entry);
+						decrypted[cell.order] = 1;
+						++cntUnchanged;
+						continue;
+					}
 				}
+				if (!have_fingerprint)
+					Manifest::fingerprint(cell.path, entry.fingerprint);
+
+				//check that the outpout dir exists
+				std::filesystem::path p_check(p_out);
+				std::filesystem::create_directories(p_check.parent_path(), ec);
 
 				//delete existing file just in case
-				if (std::filesystem::exists(p_out))
-				{
-					std::filesystem::remove(p_out);
-				}
+				std::filesystem::remove(p_out, ec);
 
 				//decrypt and create
-				S63Error err = s63.decryptAndUnzipCell(entry.path().string(), p_out);
+				S63Error err = s63.decryptAndUnzipCell(cell.path.string(), p_out, ctx);
 
 				if (err == S63Error::S63_ERR_OK)
 				{
-					++cntDecrypted;
-					encFileNames.push_back(p);
+					decrypted[cell.order] = 1;
+					entry.out_size = std::filesystem::file_size(p_out, ec);
+					manifest.record(p, entry);
 				}
 				else
 				{
 					int j = 0; //debug / log here for investigating decryption errors
 				}
 			}
-			else
-			{
-				int j = 0; //debug / log here for looking into other files (not .000 .001 .002 etc)
-			}
-		}
-		else
-		{
-			std::string p = entry.path().relative_path().string();
-		}
+		});
+	}
+	pool.wait();
+
+	std::vector<std::string> names(cntToBeDecrypted);
+	for (const auto* group : tasks)
+	{
+		for (const CellFile& cell : *group)
+			names[cell.order] = cell.path.relative_path().string();
+	}
+	std::vector<std::string> encFileNames;
+	for (size_t i = 0; i < names.size(); ++i)
+	{
+		if (decrypted[i])
+			encFileNames.push_back(std::move(names[i]));
 	}
+	int cntDecrypted = static_cast<int>(encFileNames.size());
 
 	//wipe empty generated dirs where decryption failed
 	WipeEmptyDirs(dir_out);
 	WriteFileWithENCnames(dir_out, encFileNames);
+	manifest.commit();
 
 	//report
 	std::cout << "-----------------------------" << std::endl;
 	std::cout << "Decrypted:" << cntDecrypted << std::endl;
+	std::cout << "Unchanged since the last run:" << cntUnchanged << std::endl;
 	std::cout << "-----------------------------" << std::endl;
 	return 0;
 }
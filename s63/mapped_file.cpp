@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile() {
+	close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string& path, bool sequential) {
+
+	close();
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_RANDOM_ACCESS, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	bool ok = false;
+	LARGE_INTEGER size;
+	if (GetFileSizeEx(file, &size)) {
+		m_size = static_cast<size_t>(size.QuadPart);
+		if (m_size >= MAP_THRESHOLD) {
+			HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (mapping) {
+				m_mapping = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+				// The view keeps the mapping alive
+				CloseHandle(mapping);
+			}
+			m_data = static_cast<const char*>(m_mapping);
+			ok = m_mapping != nullptr;
+		}
+		else {
+			m_buffer.resize(m_size);
+			DWORD read = 0;
+			ok = m_size == 0 || (ReadFile(file, &m_buffer[0], static_cast<DWORD>(m_size), &read, nullptr) && read == m_size);
+			m_data = m_buffer.data();
+		}
+	}
+	CloseHandle(file);
+	if (!ok)
+		close();
+	return ok;
+}
+
+void MappedFile::close() {
+
+	if (m_mapping)
+		UnmapViewOfFile(m_mapping);
+	m_mapping = nullptr;
+	m_data = nullptr;
+	m_size = 0;
+}
+
+#else
+
+bool MappedFile::open(const std::string& path, bool sequential) {
+
+	close();
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	bool ok = false;
+	struct stat st;
+	if (fstat(fd, &st) == 0) {
+		m_size = static_cast<size_t>(st.st_size);
+		if (m_size >= MAP_THRESHOLD) {
+			void* view = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (view != MAP_FAILED) {
+				madvise(view, m_size, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+				m_mapping = view;
+				m_data = static_cast<const char*>(view);
+				ok = true;
+			}
+		}
+		else {
+			m_buffer.resize(m_size);
+			size_t done = 0;
+			while (done < m_size) {
+				ssize_t n = ::read(fd, &m_buffer[done], m_size - done);
+				if (n <= 0)
+					break;
+				done += static_cast<size_t>(n);
+			}
+			m_data = m_buffer.data();
+			ok = done == m_size;
+		}
+	}
+	::close(fd);
+	if (!ok)
+		close();
+	return ok;
+}
+
+void MappedFile::close() {
+
+	if (m_mapping)
+		munmap(m_mapping, m_size);
+	m_mapping = nullptr;
+	m_data = nullptr;
+	m_size = 0;
+}
+
+#endif
@@ -0,0 +1,57 @@
+#pragma once
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstddef>
+#include <string>
+
+// Read-only view of a whole file, opened with as few system calls as possible.
+// Large files are memory mapped, small ones are read with a single call into a buffer
+// which is kept between open() calls, so a reused MappedFile does not allocate.
+class MappedFile
+{
+public:
+	// Files of at least this size are mapped, mapping a small file costs more than reading it
+	static const size_t MAP_THRESHOLD = 256 * 1024;
+
+	MappedFile() = default;
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	// Closes the previous file, if any. A file which is read in no particular order
+	// (not sequential) is mapped without read-ahead, which would only waste memory on pages nobody reads.
+	bool open(const std::string& path, bool sequential = true);
+	void close();
+
+	const char* data() const { return m_data; }
+	size_t size() const { return m_size; }
+	bool isMapped() const { return m_mapping != nullptr; }
+
+private:
+	const char* m_data = nullptr;
+	size_t m_size = 0;
+	void* m_mapping = nullptr;	// mapped view, null when the file was read into m_buffer
+	std::string m_buffer;
+};
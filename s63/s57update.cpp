@@ -0,0 +1,502 @@
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "s57update.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <unordered_map>
+
+#include "iso8211.h"
+
+// Record update instructions (RUIN)
+#define S57_INSERT 1
+#define S57_DELETE 2
+#define S57_MODIFY 3
+
+// Record name types (RCNM)
+#define S57_RCNM_DSID 10
+#define S57_RCNM_FEATURE 100
+#define S57_RCNM_ISOLATED_NODE 110
+#define S57_RCNM_CONNECTED_NODE 120
+#define S57_RCNM_EDGE 130
+#define S57_RCNM_FACE 140
+
+#define S57_DELETE_VALUE '\x7f'
+
+// Order of the fields in feature and vector records
+static const char* const feature_fields[] = { "0001", "FRID", "FOID", "ATTF", "NATF", "FFPC", "FFPT", "FSPC", "FSPT" };
+static const char* const vector_fields[] = { "0001", "VRID", "ATTV", "VRPC", "VRPT", "SGCC", "SG2D", "SG3D" };
+
+// Record identifier field (FRID or VRID)
+struct RecordId {
+	Iso8211Field* field = nullptr;
+	Iso8211Rows rows;
+	uint32_t rcnm = 0;
+	uint32_t rcid = 0;
+	uint32_t rver = 0;
+	uint32_t ruin = 0;
+	uint32_t objl = 0;
+
+	uint64_t name() const { return (static_cast<uint64_t>(rcnm) << 32) | rcid; }
+};
+
+static bool readId(const Iso8211File& file, Iso8211Record& record, RecordId& id)
+{
+	id.field = record.find("FRID");
+	if (!id.field)
+		id.field = record.find("VRID");
+	if (!id.field || !file.split(*id.field, id.rows) || id.rows.empty())
+		return false;
+
+	const Iso8211FieldDesc* d = file.desc(id.field->tag);
+	int rcnm = d->find("RCNM");
+	int rcid = d->find("RCID");
+	int rver = d->find("RVER");
+	int ruin = d->find("RUIN");
+	int objl = d->find("OBJL");
+	if (rcnm < 0 || rcid < 0 || rver < 0 || ruin < 0)
+		return false;
+	const auto& row = id.rows[0];
+	id.rcnm = Iso8211File::toUInt(row[rcnm]);
+	id.rcid = Iso8211File::toUInt(row[rcid]);
+	id.rver = Iso8211File::toUInt(row[rver]);
+	id.ruin = Iso8211File::toUInt(row[ruin]);
+	id.objl = objl < 0 ? 0 : Iso8211File::toUInt(row[objl]);
+	return true;
+}
+
+static bool writeId(const Iso8211File& file, RecordId& id, uint32_t rver, uint32_t ruin)
+{
+	const Iso8211FieldDesc* d = file.desc(id.field->tag);
+	int i = d->find("RVER");
+	id.rows[0][i] = Iso8211File::fromUInt(rver, d->subfields[i].width);
+	i = d->find("RUIN");
+	id.rows[0][i] = Iso8211File::fromUInt(ruin, d->subfields[i].width);
+	id.rver = rver;
+	id.ruin = ruin;
+	return file.join(id.field->tag, id.rows, id.field->data);
+}
+
+// Puts a field into a record, new fields go to their place in the record
+static void setField(Iso8211Record& record, const std::string& tag, std::string data)
+{
+	if (Iso8211Field* f = record.find(tag)) {
+		f->data = std::move(data);
+		return;
+	}
+	const char* const* order = feature_fields;
+	size_t order_size = sizeof(feature_fields) / sizeof(feature_fields[0]);
+	if (record.find("VRID")) {
+		order = vector_fields;
+		order_size = sizeof(vector_fields) / sizeof(vector_fields[0]);
+	}
+	auto rank = [&](const std::string& t) {
+		return static_cast<size_t>(std::find(order, order + order_size, t) - order);
+	};
+	size_t r = rank(tag);
+	auto it = record.fields.begin();
+	while (it != record.fields.end() && rank(it->tag) <= r)
+		++it;
+	record.fields.insert(it, { tag, std::move(data) });
+}
+
+static void removeField(Iso8211Record& record, const std::string& tag)
+{
+	record.fields.erase(std::remove_if(record.fields.begin(), record.fields.end(),
+		[&](const Iso8211Field& f) { return f.tag == tag; }), record.fields.end());
+}
+
+static bool storeRows(const Iso8211File& file, Iso8211Record& record, const std::string& tag, const Iso8211Rows& rows)
+{
+	if (rows.empty()) {
+		removeField(record, tag);
+		return true;
+	}
+	std::string data;
+	if (!file.join(tag, rows, data))
+		return false;
+	setField(record, tag, std::move(data));
+	return true;
+}
+
+// ATTF, NATF and ATTV: a value replaces the one of the same attribute or is added,
+// the delete value removes the attribute
+static bool updateAttributes(const Iso8211File& update_file, const Iso8211Field& update,
+	const Iso8211File& file, Iso8211Record& record)
+{
+	Iso8211Rows changes, rows;
+	if (!update_file.split(update, changes))
+		return false;
+	const Iso8211Field* current = record.find(update.tag);
+	if (current && !file.split(*current, rows))
+		return false;
+
+	for (auto& change : changes) {
+		if (change.size() != 2)
+			return false;
+		auto it = std::find_if(rows.begin(), rows.end(),
+			[&](const std::vector<std::string>& row) { return row[0] == change[0]; });
+		const std::string& value = change[1];
+		bool remove = !value.empty() && value[0] == S57_DELETE_VALUE && (value.size() == 1 || (value.size() == 2 && value[1] == 0));
+		if (remove) {
+			if (it != rows.end())
+				rows.erase(it);
+		}
+		else if (it != rows.end()) {
+			(*it)[1] = value;
+		}
+		else {
+			rows.push_back(change);
+		}
+	}
+	return storeRows(file, record, update.tag, rows);
+}
+
+// Pointer and coordinate fields, driven by an update instruction field: FFPC for FFPT, FSPC for FSPT,
+// VRPC for VRPT and SGCC for SG2D or SG3D. Instruction, 1-based index and count of the entries.
+static bool updateList(const Iso8211File& update_file, const Iso8211Record& update, const Iso8211Field& control,
+	const std::string& tag, const Iso8211File& file, Iso8211Record& record)
+{
+	Iso8211Rows control_rows, entries, rows;
+	if (!update_file.split(control, control_rows) || control_rows.empty() || control_rows[0].size() < 3)
+		return false;
+	uint32_t instruction = Iso8211File::toUInt(control_rows[0][0]);
+	size_t index = Iso8211File::toUInt(control_rows[0][1]);
+	size_t count = Iso8211File::toUInt(control_rows[0][2]);
+
+	if (const Iso8211Field* f = update.find(tag)) {
+		if (!update_file.split(*f, entries))
+			return false;
+	}
+	if (const Iso8211Field* f = record.find(tag)) {
+		if (!file.split(*f, rows))
+			return false;
+	}
+	if (index == 0)
+		return false;
+	--index;
+
+	switch (instruction) {
+	case S57_INSERT:
+		if (index > rows.size() || entries.size() < count)
+			return false;
+		rows.insert(rows.begin() + index, entries.begin(), entries.begin() + count);
+		break;
+	case S57_DELETE:
+		if (index + count > rows.size())
+			return false;
+		rows.erase(rows.begin() + index, rows.begin() + index + count);
+		break;
+	case S57_MODIFY:
+		if (index + count > rows.size() || entries.size() < count)
+			return false;
+		std::copy(entries.begin(), entries.begin() + count, rows.begin() + index);
+		break;
+	default:
+		return false;
+	}
+	return storeRows(file, record, tag, rows);
+}
+
+static bool isControlField(const std::string& tag)
+{
+	return tag == "FFPC" || tag == "FSPC" || tag == "VRPC" || tag == "SGCC";
+}
+
+static bool modifyRecord(const Iso8211File& update_file, const Iso8211Record& update, const Iso8211File& file, Iso8211Record& record)
+{
+	for (const auto& f : update.fields) {
+		bool ok = true;
+		if (f.tag == "ATTF" || f.tag == "NATF" || f.tag == "ATTV") {
+			ok = updateAttributes(update_file, f, file, record);
+		}
+		else if (f.tag == "FFPC") {
+			ok = updateList(update_file, update, f, "FFPT", file, record);
+		}
+		else if (f.tag == "FSPC") {
+			ok = updateList(update_file, update, f, "FSPT", file, record);
+		}
+		else if (f.tag == "VRPC") {
+			ok = updateList(update_file, update, f, "VRPT", file, record);
+		}
+		else if (f.tag == "SGCC") {
+			// The coordinates are 2D or 3D, whichever the update or else the record has
+			const char* tag = update.find("SG3D") || (!update.find("SG2D") && record.find("SG3D")) ? "SG3D" : "SG2D";
+			ok = updateList(update_file, update, f, tag, file, record);
+		}
+		if (!ok) {
+			printf("Bad update of field %s\n", f.tag.c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool getSubfield(const Iso8211File& file, const Iso8211Field& field, const char* name, std::string& value)
+{
+	Iso8211Rows rows;
+	const Iso8211FieldDesc* d = file.desc(field.tag);
+	int i = d ? d->find(name) : -1;
+	if (i < 0 || !file.split(field, rows) || rows.empty())
+		return false;
+	value = rows[0][i];
+	return true;
+}
+
+static bool setSubfields(const Iso8211File& file, Iso8211Field& field, const std::vector<std::pair<const char*, std::string>>& values)
+{
+	Iso8211Rows rows;
+	const Iso8211FieldDesc* d = file.desc(field.tag);
+	if (!d || !file.split(field, rows) || rows.empty())
+		return false;
+	for (const auto& v : values) {
+		int i = d->find(v.first);
+		if (i >= 0)
+			rows[0][i] = v.second;
+	}
+	return file.join(field.tag, rows, field.data);
+}
+
+// Position of a record in the cell: data set records, then nodes, edges and faces,
+// then meta, geo and collection features
+static int recordRank(const Iso8211Record& record, const RecordId* id)
+{
+	if (record.find("DSID"))
+		return 0;
+	if (!id)
+		return 1;
+	if (id->rcnm >= S57_RCNM_ISOLATED_NODE && id->rcnm <= S57_RCNM_FACE)
+		return 2 + static_cast<int>(id->rcnm - S57_RCNM_ISOLATED_NODE) / 10;
+	if (id->rcnm != S57_RCNM_FEATURE)
+		return 1;
+	if (id->objl >= 300 && id->objl < 400)
+		return 6;
+	if (id->objl >= 400 && id->objl < 500)
+		return 8;
+	return 7;
+}
+
+// Record counts of the data set structure information field
+static void updateCounts(const Iso8211File& file, Iso8211Field& dssi, const std::vector<RecordId>& ids)
+{
+	uint32_t meta = 0, collection = 0, geo = 0, cartographic = 0, isolated = 0, connected = 0, edges = 0, faces = 0;
+	for (const auto& id : ids) {
+		switch (id.rcnm) {
+		case S57_RCNM_FEATURE:
+			if (id.objl >= 300 && id.objl < 400)
+				++meta;
+			else if (id.objl >= 400 && id.objl < 500)
+				++collection;
+			else if (id.objl >= 500)
+				++cartographic;
+			else
+				++geo;
+			break;
+		case S57_RCNM_ISOLATED_NODE: ++isolated; break;
+		case S57_RCNM_CONNECTED_NODE: ++connected; break;
+		case S57_RCNM_EDGE: ++edges; break;
+		case S57_RCNM_FACE: ++faces; break;
+		}
+	}
+	const Iso8211FieldDesc* d = file.desc("DSSI");
+	int i = d ? d->find("NOMR") : -1;
+	if (i < 0)
+		return;
+	size_t w = d->subfields[i].width;
+	setSubfields(file, dssi, {
+		{ "NOMR", Iso8211File::fromUInt(meta, w) }, { "NOCR", Iso8211File::fromUInt(collection, w) },
+		{ "NOGR", Iso8211File::fromUInt(geo, w) }, { "NOLR", Iso8211File::fromUInt(cartographic, w) },
+		{ "NOIN", Iso8211File::fromUInt(isolated, w) }, { "NOCN", Iso8211File::fromUInt(connected, w) },
+		{ "NOED", Iso8211File::fromUInt(edges, w) }, { "NOFA", Iso8211File::fromUInt(faces, w) } });
+}
+
+bool S57Updater::apply(const CellBuffer& base, const std::vector<CellBuffer>& updates, std::string& out)
+{
+	Iso8211File file;
+	if (!file.parse(base.data(), base.size()))
+		return false;
+
+	Iso8211Record* dsid_record = nullptr;
+	for (auto& r : file.records) {
+		if (r.find("DSID")) {
+			dsid_record = &r;
+			break;
+		}
+	}
+	std::string edition, update_number;
+	if (!dsid_record || !getSubfield(file, *dsid_record->find("DSID"), "EDTN", edition) ||
+		!getSubfield(file, *dsid_record->find("DSID"), "UPDN", update_number)) {
+		puts("Base cell has no data set identification\n");
+		return false;
+	}
+	long expected = std::strtol(update_number.c_str(), nullptr, 10) + 1;
+	std::string last_updn = update_number, last_uadt, last_isdt;
+	bool have_dates = false;
+
+	std::unordered_map<uint64_t, size_t> names;
+	std::vector<char> removed(file.records.size(), 0);
+	for (size_t i = 0; i < file.records.size(); ++i) {
+		RecordId id;
+		if (readId(file, file.records[i], id))
+			names[id.name()] = i;
+	}
+
+	for (const auto& buf : updates) {
+		Iso8211File update;
+		if (!update.parse(buf.data(), buf.size()))
+			return false;
+
+		for (auto& u : update.records) {
+			if (const Iso8211Field* dsid = u.find("DSID")) {
+				std::string edtn, updn;
+				if (!getSubfield(update, *dsid, "EDTN", edtn) || !getSubfield(update, *dsid, "UPDN", updn))
+					return false;
+				if (edtn == "0") {
+					puts("The cell is cancelled\n");
+					return false;
+				}
+				if (edtn != edition || std::strtol(updn.c_str(), nullptr, 10) != expected) {
+					printf("Update %s of edition %s does not follow update %ld of edition %s\n",
+						updn.c_str(), edtn.c_str(), expected - 1, edition.c_str());
+					return false;
+				}
+				++expected;
+				last_updn = updn;
+				have_dates = getSubfield(update, *dsid, "UADT", last_uadt) && getSubfield(update, *dsid, "ISDT", last_isdt);
+				continue;
+			}
+
+			RecordId uid;
+			if (!readId(update, u, uid))
+				continue;
+			auto it = names.find(uid.name());
+			bool exists = it != names.end() && !removed[it->second];
+
+			if (uid.ruin == S57_INSERT) {
+				if (exists) {
+					printf("Inserted record %u/%u is already there\n", uid.rcnm, uid.rcid);
+					return false;
+				}
+				Iso8211Record record;
+				for (const auto& f : u.fields) {
+					if (isControlField(f.tag))
+						continue;
+					// A field the base cell does not have yet brings its format along
+					if (!file.desc(f.tag)) {
+						const Iso8211FieldDesc* d = update.desc(f.tag);
+						if (!d || !file.addFieldDesc(d->tag, d->controls, d->name, d->array_descriptor, d->format))
+							return false;
+					}
+					record.fields.push_back(f);
+				}
+				names[uid.name()] = file.records.size();
+				file.records.push_back(std::move(record));
+				removed.push_back(0);
+				continue;
+			}
+
+			if (!exists) {
+				printf("Updated record %u/%u is not in the cell\n", uid.rcnm, uid.rcid);
+				return false;
+			}
+			Iso8211Record& record = file.records[it->second];
+			RecordId id;
+			if (!readId(file, record, id))
+				return false;
+			if (uid.rver != id.rver + 1) {
+				printf("Record %u/%u has version %u, the update is for version %u\n", id.rcnm, id.rcid, id.rver, uid.rver - 1);
+				return false;
+			}
+
+			if (uid.ruin == S57_DELETE) {
+				removed[it->second] = 1;
+			}
+			else if (uid.ruin == S57_MODIFY) {
+				for (const auto& f : u.fields) {
+					if (!file.desc(f.tag) && update.desc(f.tag)) {
+						const Iso8211FieldDesc* d = update.desc(f.tag);
+						if (!file.addFieldDesc(d->tag, d->controls, d->name, d->array_descriptor, d->format))
+							return false;
+					}
+				}
+				if (!modifyRecord(update, u, file, record))
+					return false;
+				// readId again, the record fields may have moved
+				if (!readId(file, record, id) || !writeId(file, id, uid.rver, S57_INSERT))
+					return false;
+			}
+			else {
+				printf("Bad update instruction %u\n", uid.ruin);
+				return false;
+			}
+		}
+	}
+
+	// Drop the deleted records and put the inserted ones in their place
+	std::vector<std::pair<int, size_t>> order;
+	std::vector<RecordId> ids(file.records.size());
+	for (size_t i = 0; i < file.records.size(); ++i) {
+		if (removed[i])
+			continue;
+		bool has_id = readId(file, file.records[i], ids[i]);
+		order.push_back({ recordRank(file.records[i], has_id ? &ids[i] : nullptr), i });
+	}
+	std::stable_sort(order.begin(), order.end(),
+		[](const std::pair<int, size_t>& a, const std::pair<int, size_t>& b) { return a.first < b.first; });
+
+	std::vector<Iso8211Record> records;
+	std::vector<RecordId> kept;
+	records.reserve(order.size());
+	for (const auto& o : order) {
+		records.push_back(std::move(file.records[o.second]));
+		if (ids[o.second].field)
+			kept.push_back(ids[o.second]);
+	}
+	file.records = std::move(records);
+
+	// Data set identification of the last update, record counts and record numbers for the new content
+	const Iso8211FieldDesc* record_id = file.desc("0001");
+	for (size_t i = 0; i < file.records.size(); ++i) {
+		Iso8211Record& r = file.records[i];
+		if (Iso8211Field* f = r.find("DSID")) {
+			std::vector<std::pair<const char*, std::string>> values = { { "UPDN", last_updn } };
+			if (have_dates) {
+				values.push_back({ "UADT", last_uadt });
+				values.push_back({ "ISDT", last_isdt });
+			}
+			if (!setSubfields(file, *f, values))
+				return false;
+		}
+		if (Iso8211Field* f = r.find("DSSI"))
+			updateCounts(file, *f, kept);
+		Iso8211Field* f = r.find("0001");
+		if (f && record_id && record_id->subfields.size() == 1 && record_id->subfields[0].type == 'b')
+			f->data = Iso8211File::fromUInt(static_cast<uint32_t>(i + 1), record_id->subfields[0].width);
+	}
+
+	out = file.serialize();
+	return true;
+}
@@ -0,0 +1,41 @@
+#pragma once
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string>
+#include <vector>
+
+#include "cell_buffer.h"
+
+// Applies the update cells (.001, .002 ...) of an S-57 base cell in memory, as S-57 Part 3, 8.4 describes:
+// records are inserted, deleted or modified by record name (RCNM + RCID), modifications update
+// the attributes and the pointer and coordinate fields through their update instruction fields.
+// The result is a base cell at the edition and update number of the last update.
+class S57Updater
+{
+public:
+	// base is the decrypted base cell, updates are the decrypted update cells in order.
+	// Fails if an update is not the next one for the cell or does not fit it.
+	static bool apply(const CellBuffer& base, const std::vector<CellBuffer>& updates, std::string& out);
+};
@@ -26,12 +26,18 @@
 
 #include <iostream>
 #include <fstream>
+#include <cstdio>
 #include <cstring> // for memcmp
+#include <algorithm>
+#include <atomic>
 
 #include "simple_zip.h"
 #include "blowfish.h"
+#include "blowfish_cache.h"
+#include "blowfish_simd.h"
+#include "crc32_simd.h"
+#include "thread_pool.h"
 #include "s63utils.hpp"
-#include "zlib/zlib.h"
 
 #define VALID_ZIP_SIGNATURE 0x04034b50
 #define SECONDS_TO_DAYS(S) S/86400
@@ -41,9 +47,42 @@ using key_pair = std::pair<std::string, std::string>;
 using namespace std;
 using namespace hexutils;
 
-CBlowFish S63::m_bf;
+const CBlowFish& S63Context::cipher(const std::string& key) {
 
-bool S63::_validateCellPermit(const std::string& cellpermit, const std::string& HW_ID6) {
+	for (size_t i = 0; i < SLOTS; ++i) {
+		if (m_ciphers[i] && m_keys[i] == key)
+			return *m_ciphers[i];
+	}
+
+	size_t slot = m_next;
+	m_next = (m_next + 1) % SLOTS;
+	m_keys[slot] = key;
+	m_ciphers[slot] = CBlowFishCache::global().get(key);
+	return *m_ciphers[slot];
+}
+
+S63Context::S63Context() = default;
+
+S63Context::~S63Context() = default;
+
+SimpleUnzipStream& S63Context::unzipStream(const std::function<bool(const char*, size_t)>& sink) {
+
+	if (!m_unzip)
+		m_unzip.reset(new SimpleUnzipStream(nullptr));
+	m_unzip->reset(sink);
+	return *m_unzip;
+}
+
+S63Context& S63Context::local() {
+	static thread_local S63Context ctx;
+	return ctx;
+}
+
+void S63::setKeyCacheBudget(size_t bytes) {
+	CBlowFishCache::global().setBudget(bytes);
+}
+
+bool S63::_validateCellPermit(const std::string& cellpermit, const std::string& HW_ID6, S63Context& ctx) {
 
 	
 	if (cellpermit.size() != VALID_CELLPERMIT_SIZE) {
@@ -63,14 +102,13 @@ bool S63::_validateCellPermit(const std::string& cellpermit, const std::string&
 	}
 
 	// 3) Decrypt the crc32 using the Blowfish algorithm with HW_ID6 as the key.
-	m_bf.setKey(HW_ID6);
-	m_bf.decrypt(permit_crc32);
+	ctx.cipher(HW_ID6).decrypt(permit_crc32);
 
 	unsigned long* crc_from_permit = reinterpret_cast<unsigned long*>(&permit_crc32[0]);
 	*crc_from_permit = swap_bytes(*crc_from_permit);
 
 	// 4) Hash the remainder of the Cell Permit as left after ‘a’ using the algorithm CRC32.
-	unsigned long calc_crc32 = crc32(0L, (unsigned char*)&cellpermit[0], VALID_CELLPERMIT_SIZE - 16);
+	unsigned long calc_crc32 = Crc32::update(0, cellpermit.data(), VALID_CELLPERMIT_SIZE - 16);
 
 	// 5) Compare the crc from permit and calculated one.If they are the same, the Cell Permit is valid.If
 	//	they differ, the Cell Permit is corrupt and Cell Permit is not to be used.
@@ -95,7 +133,6 @@ bool S63::_validateCellPermit(const std::string& cellpermit, const std::string&
 	}
 
 	time_t t = std::time(0);
-	tm* now = std::localtime(&t);
 	if (expiry_time < t) {
 		puts("SSE 15 - Subscription service has expired. Please contact your data supplier to renew the subscription licence.\n");
 	}
@@ -115,7 +152,49 @@ bool S63::_validateCellPermit(const std::string& cellpermit, const std::string&
 
 
 
-S63Error S63::decryptCell(std::string& buf, const std::string& key) {
+// Decrypts the first block of a cell aside and tests it against the zip signature,
+// the cell itself stays untouched
+static bool isCellKeyValid(const CBlowFish& bf, const char* first_block) {
+
+	uint32_t test_buf[2];
+	bf.decrypt(reinterpret_cast<const unsigned char*>(first_block), reinterpret_cast<unsigned char*>(test_buf), 8);
+	return test_buf[0] == VALID_ZIP_SIGNATURE;
+}
+
+static std::atomic<size_t> parallel_threshold(S63::DEFAULT_PARALLEL_THRESHOLD);
+
+void S63::setParallelThreshold(size_t bytes) {
+	parallel_threshold = bytes;
+}
+
+// ECB blocks are independent, so a large buffer is cut into 8 byte aligned chunks
+// which are processed on the shared pool. in and out may be the same buffer.
+static void crypt(const CBlowFish& bf, const unsigned char* in, unsigned char* out, size_t len, bool decrypt) {
+
+	const size_t CHUNK = 256 * 1024;
+	size_t threshold = parallel_threshold;
+	ThreadPool& pool = ThreadPool::shared();
+	if (threshold == 0 || len < threshold || len <= CHUNK || pool.threads() == 0) {
+		decrypt ? bf.decrypt(in, out, len) : bf.encrypt(in, out, len);
+		return;
+	}
+
+	pool.parallelFor((len + CHUNK - 1) / CHUNK, [&](size_t i) {
+		size_t offset = i * CHUNK;
+		size_t chunk_len = std::min(CHUNK, len - offset);
+		decrypt ? bf.decrypt(in + offset, out + offset, chunk_len) : bf.encrypt(in + offset, out + offset, chunk_len);
+	});
+}
+
+// Decrypts in place and cuts the padding off without reallocating
+static void decryptInPlace(const CBlowFish& bf, std::string& buf) {
+
+	unsigned char* data = reinterpret_cast<unsigned char*>(&buf[0]);
+	crypt(bf, data, data, buf.size(), true);
+	buf.resize(buf.size() - CBlowFish::paddingLength(data, buf.size()));
+}
+
+S63Error S63::decryptCell(std::string& buf, const std::string& key, S63Context& ctx) {
 
 	size_t size = buf.size();
 	if (size < 8 || size % 8 != 0) {
@@ -123,107 +202,287 @@ S63Error S63::decryptCell(std::string& buf, const std::string& key) {
 		return S63_ERR_DATA;
 	}
 
-	m_bf.setKey(key);
-	m_bf.decrypt((unsigned char*)buf.data(), 8);
-	if (*reinterpret_cast<const uint32_t*>(buf.data()) != VALID_ZIP_SIGNATURE) {
+	const CBlowFish& bf = ctx.cipher(key);
+	if (!isCellKeyValid(bf, buf.data())) {
 	
 		return S63_ERR_KEY;
 	}
 
-	m_bf.decrypt(buf);
+	decryptInPlace(bf, buf);
 
 	return S63_ERR_OK;
 }
 
-void S63::encryptCell(std::string& buf, const std::string& key) {
+void S63::decryptCells(std::vector<S63CellJob>& jobs) {
+
+	// The schedules are held here for the whole batch, the cache may drop them meanwhile
+	std::vector<std::shared_ptr<const CBlowFish>> ciphers(jobs.size());
+	BlowFishMultiBuffer mb;
+
+	for (size_t i = 0; i < jobs.size(); ++i) {
+
+		S63CellJob& job = jobs[i];
+		size_t size = job.buf->size();
+		if (size < 8 || size % 8 != 0) {
+			job.result = S63_ERR_DATA;
+			continue;
+		}
+
+		std::shared_ptr<const CBlowFish> bf = CBlowFishCache::global().get(job.keys.first);
+		if (!isCellKeyValid(*bf, job.buf->data())) {
+			bf = CBlowFishCache::global().get(job.keys.second);
+			if (!isCellKeyValid(*bf, job.buf->data())) {
+				job.result = S63_ERR_KEY;
+				continue;
+			}
+		}
+
+		job.result = S63_ERR_OK;
+		mb.add(*bf, reinterpret_cast<unsigned char*>(&(*job.buf)[0]), size);
+		ciphers[i] = std::move(bf);
+	}
 
-	m_bf.setKey(key);
-	m_bf.encrypt(buf);
+	mb.decrypt();
 
+	for (S63CellJob& job : jobs) {
+		if (job.result != S63_ERR_OK)
+			continue;
+		const unsigned char* data = reinterpret_cast<const unsigned char*>(job.buf->data());
+		job.buf->resize(job.buf->size() - CBlowFish::paddingLength(data, job.buf->size()));
+	}
 }
 
-S63Error S63::decryptCell(const std::string& path, const key_pair& keys, std::string& out_buf) {
+void S63::encryptCell(std::string& buf, const std::string& key, S63Context& ctx) {
 
-	std::ifstream encryptedFile(path, std::ios::binary);
+	size_t size = buf.size();
+	buf.resize(CBlowFish::paddedSize(size));
+	unsigned char* data = reinterpret_cast<unsigned char*>(&buf[0]);
+	size = CBlowFish::pad(data, size);
+	crypt(ctx.cipher(key), data, data, size, false);
 
-	if (!encryptedFile.is_open()) {
-		puts("Could not open encrypted file for reading\n");
-		return S63_ERR_FILE;
+}
+
+// Tests the keys of a cell on its first block, returns the schedule of the valid one or null
+static const CBlowFish* selectCellKey(const char* first_block, const key_pair& keys, S63Context& ctx) {
+
+	const CBlowFish* bf = &ctx.cipher(keys.first);
+	if (isCellKeyValid(*bf, first_block)) {
+		ctx.setLastKey(0);
+		return bf;
 	}
 
+	puts("First key invalid\n");
+	bf = &ctx.cipher(keys.second);
+	if (isCellKeyValid(*bf, first_block)) {
+		ctx.setLastKey(1);
+		return bf;
+	}
 
-	encryptedFile.seekg(0, std::ios::end);
-	size_t size = encryptedFile.tellg();
-	if (size % 8 != 0) {
+	ctx.setLastKey(-1);
+	puts("SSE 21 - WARNING DECRYPTION FAILED - DECRYPTION KEYS INVALID\n");
+	return nullptr;
+}
+
+std::shared_ptr<const CBlowFish> S63::cellCipher(const char* first_block, const key_pair& keys, S63Context& ctx) {
+
+	if (!selectCellKey(first_block, keys, ctx))
+		return nullptr;
+	return CBlowFishCache::global().get(ctx.lastKey() == 0 ? keys.first : keys.second);
+}
+
+// The key is tested on the first block and the data is decrypted from there straight
+// into the buffer alloc(size) gives. Returns the size without the padding in len.
+template <class Alloc>
+static S63Error decryptData(const char* data, size_t size, const key_pair& keys, S63Context& ctx, Alloc alloc, size_t& len) {
+
+	if (size < 8 || size % 8 != 0) {
 		puts("Wrong file size\n");
 		return S63_ERR_DATA;
 	}
-	m_bf.setKey(keys.first);
-	encryptedFile.seekg(0);
 
 	// To ensure that key is valid, let`s decrypt the first 8 bytes of cell and
 	// test it against the valid zip signature. 
-	char test_buf[8];
-	encryptedFile.read(test_buf, 8);
-
-	m_bf.decrypt((unsigned char*)test_buf, 8);
-	if (*reinterpret_cast<uint32_t*>(&test_buf[0]) != VALID_ZIP_SIGNATURE) {
+	const CBlowFish* bf = selectCellKey(data, keys, ctx);
+	if (!bf) {
+		return S63_ERR_KEY;
+	}
 
-		puts("First key invalid\n");
-		m_bf.setKey(keys.second);
+	// Ok, key is valid. Now decrypt the whole file
+	unsigned char* out = reinterpret_cast<unsigned char*>(alloc(size));
+	crypt(*bf, reinterpret_cast<const unsigned char*>(data), out, size, true);
 
-		m_bf.decrypt((unsigned char*)test_buf, 8);
-		if (*reinterpret_cast<const uint32_t*>(&test_buf[0]) != VALID_ZIP_SIGNATURE) {
+	len = size - CBlowFish::paddingLength(out, size);
+	return S63_ERR_OK;
+}
 
-			puts("SSE 21 - WARNING DECRYPTION FAILED - DECRYPTION KEYS INVALID\n");
-			return S63_ERR_KEY;
-		}
+// The file is read once (or mapped, if it is large)
+template <class Alloc>
+static S63Error decryptFile(const std::string& path, const key_pair& keys, S63Context& ctx, Alloc alloc, size_t& len) {
 
+	MappedFile& file = ctx.file();
+	if (!file.open(path)) {
+		puts("Could not open encrypted file for reading\n");
+		return S63_ERR_FILE;
 	}
-	encryptedFile.seekg(0);
 
-	// Ok, key is valid. Now read all the whole file an decrypt it
-	out_buf.resize(size);
-	encryptedFile.read(const_cast<char*>(out_buf.data()), size);
-	encryptedFile.close();
+	S63Error err = decryptData(file.data(), file.size(), keys, ctx, alloc, len);
+	file.close();
+	return err;
+}
 
-	m_bf.decrypt(out_buf);
+S63Error S63::decryptCell(const std::string& path, const key_pair& keys, std::string& out_buf, S63Context& ctx) {
 
-	return S63_ERR_OK;
+	size_t len;
+	S63Error err = decryptFile(path, keys, ctx, [&](size_t size) {
+		out_buf.resize(size);
+		return &out_buf[0];
+	}, len);
+	if (err == S63_ERR_OK)
+		out_buf.resize(len);
+	return err;
 }
 
-S63Error S63::decryptAndUnzipCellByKey(const std::string& in_path, const key_pair& keys, const std::string& out_path) {
+S63Error S63::decryptCell(const std::string& path, const key_pair& keys, CellBuffer& out, S63Context& ctx) {
+
+	// Decryption writes every byte, the buffer is not zeroed first
+	CellBuffer buf;
+	size_t len;
+	S63Error err = decryptFile(path, keys, ctx, [&](size_t size) {
+		char* data;
+		buf = CellBuffer::allocate(size, data);
+		return data;
+	}, len);
+	if (err == S63_ERR_OK)
+		out = buf.view(0, len);
+	return err;
+}
 
-	std::string decrypted;
+S63Error S63::decryptCell(const CellBuffer& in, const key_pair& keys, CellBuffer& out, S63Context& ctx) {
+
+	CellBuffer buf;
+	size_t len;
+	S63Error err = decryptData(in.data(), in.size(), keys, ctx, [&](size_t size) {
+		char* data;
+		buf = CellBuffer::allocate(size, data);
+		return data;
+	}, len);
+	if (err == S63_ERR_OK)
+		out = buf.view(0, len);
+	return err;
+}
 
-	S63Error err = decryptCell(in_path,keys,decrypted);
-	if (err != S63_ERR_OK) {
-		return err;
+S63Error S63::decryptAndUnzipCellStream(const std::string& in_path, const key_pair& keys, const std::function<bool(const char*, size_t)>& sink, S63Context& ctx) {
+
+	// Small cells are read into the reused buffer of the context, large ones are mapped
+	MappedFile& file = ctx.file();
+	if (!file.open(in_path)) {
+		puts("Could not open encrypted file for reading\n");
+		return S63_ERR_FILE;
 	}
 
-	// Cell compressed with zip. So we got to unzip it.
-	SimpleZip unz;
-	string out_buf;
-	if (!unz.unzip(decrypted, out_buf)) {
+	size_t size = file.size();
+	if (size < 8 || size % 8 != 0) {
+		file.close();
+		puts("Wrong file size\n");
+		return S63_ERR_DATA;
+	}
+
+	const CBlowFish* bf = selectCellKey(file.data(), keys, ctx);
+	if (!bf) {
+		file.close();
+		return S63_ERR_KEY;
+	}
+
+	// Whole decrypted cell never sits in memory: a chunk is decrypted and inflated before the next one
+	const size_t CHUNK = 64 * 1024;
+	std::string& chunk = ctx.chunk();
+	if (chunk.size() < CHUNK)
+		chunk.resize(CHUNK);
+	unsigned char* data = reinterpret_cast<unsigned char*>(&chunk[0]);
+	const unsigned char* in = reinterpret_cast<const unsigned char*>(file.data());
+
+	SimpleUnzipStream& unz = ctx.unzipStream(sink);
+	for (size_t pos = 0; pos < size; ) {
+
+		size_t len = std::min(CHUNK, size - pos);
+		bf->decrypt(in + pos, data, len);
+		pos += len;
+
+		// Padding sits at the very end of the cell
+		if (pos == size)
+			len -= CBlowFish::paddingLength(data, len);
+
+		if (!unz.write(chunk.data(), len)) {
+			file.close();
+			puts("Cant unzip cell\n");
+			return S63_ERR_ZIP;
+		}
+	}
+	file.close();
+
+	if (!unz.finish()) {
 		puts("Cant unzip cell\n");
 		return S63_ERR_ZIP;
 	}
+	return S63_ERR_OK;
+}
 
-	std::ofstream decryptedFile(out_path, std::ios::binary);
+S63Error S63::decryptAndUnzipCellByKey(const std::string& in_path, const key_pair& keys, const std::string& out_path, S63Context& ctx) {
+
+	// Output is opened with the first inflated bytes, so a cell with wrong keys leaves no file.
+	// The file buffer comes from the context, the stream does not allocate its own.
+	struct Output {
+		std::ofstream file;
+		const std::string* path;
+		std::vector<char>* buffer;
+		bool error = false;
+
+		bool open() {
+			const size_t BUFFER = 64 * 1024;
+			if (buffer->size() < BUFFER)
+				buffer->resize(BUFFER);
+			file.rdbuf()->pubsetbuf(buffer->data(), buffer->size());
+			file.open(*path, std::ios::binary);
+			if (!file.is_open()) {
+				puts("Could not open dencrypted file for writing\n");
+				error = true;
+			}
+			return !error;
+		}
+	} output;
+	output.path = &out_path;
+	output.buffer = &ctx.outputBuffer();
+
+	// One pointer in the capture, so the std::function keeps it without an allocation
+	Output* out = &output;
+	S63Error err = decryptAndUnzipCellStream(in_path, keys, [out](const char* data, size_t len) {
+		if (!out->file.is_open() && !out->open())
+			return false;
+		out->error = !out->file.write(data, len);
+		return !out->error;
+	}, ctx);
+
+	if (err == S63_ERR_OK && !output.file.is_open() && !output.open())
+		err = S63_ERR_FILE;
+	if (output.error)
+		err = S63_ERR_FILE;
 
-	if (!decryptedFile.is_open()) {
-		puts("Could not open dencrypted file for writing\n");
-		return S63_ERR_FILE;
+	if (err != S63_ERR_OK) {
+		// Do not leave a partial cell behind
+		if (output.file.is_open()) {
+			output.file.close();
+			std::remove(out_path.c_str());
+		}
+		return err;
 	}
 
-	decryptedFile.write(out_buf.data(), out_buf.size());
-	decryptedFile.close();
+	output.file.close();
 	printf("Cell succefully decrypted\n");
 	return S63_ERR_OK;
 }
 
 
-std::string S63::createUserPermit(const std::string& M_KEY, const std::string& HW_ID, const std::string& M_ID) {
+std::string S63::createUserPermit(const std::string& M_KEY, const std::string& HW_ID, const std::string& M_ID, S63Context& ctx) {
 
 
 	if (M_KEY.size() != VALID_M_KEY_SIZE) {
@@ -243,15 +502,14 @@ std::string S63::createUserPermit(const std::string& M_KEY, const std::string& H
 
 	//a) Encrypt HW_ID using the Blowfish algorithm with M_KEY as the key.
 	string encrypted_hwid = HW_ID;
-	m_bf.setKey(M_KEY);
-	m_bf.encrypt(encrypted_hwid);
+	ctx.cipher(M_KEY).encrypt(encrypted_hwid);
 	//b) Convert the resultant value to a 16 characterhexadecimal string.Any alphabetic character
 	//should be in upper case.
 	string userpermit = string_to_hex(encrypted_hwid);
 	userpermit.reserve(VALID_USERPERMIT_SIZE);
 
 	//c) Hash the 16 hexadecimal characters using the algorithm CRC32
-	uint32_t calc_crc32 = crc32(0L, (unsigned char*)userpermit.data(), 16);
+	uint32_t calc_crc32 = Crc32::update(0, userpermit.data(), 16);
 	
 	//d) Convert output from ‘c’ to an 8 character hexadecimal string.Any alphabetic characters
 	//should be in upper case.This is the Check Sum
@@ -268,7 +526,7 @@ std::string S63::createUserPermit(const std::string& M_KEY, const std::string& H
 
 }
 
-std::string S63::extractHwIdFromUserpermit(const std::string& userpermit, const std::string& M_KEY) {
+std::string S63::extractHwIdFromUserpermit(const std::string& userpermit, const std::string& M_KEY, S63Context& ctx) {
 
 	// Example: Userpermit Structure
 	//        16              8         4
@@ -305,7 +563,7 @@ std::string S63::extractHwIdFromUserpermit(const std::string& userpermit, const
 
 
 	//c) Hash the Encrypted HW_ID(the first 16 characters of the User Permit) using the algorithm CRC32.
-	uint32_t cacl_crc32 = crc32(0L, reinterpret_cast<const unsigned char*>(userpermit.data()), 16);
+	uint32_t cacl_crc32 = Crc32::update(0, userpermit.data(), 16);
 	//d) Compare the outputs of ‘b’ and ‘c’.If they are identical, the User Permit is valid.If the two results
 	// differ the User Permit is invalid and the HW_ID cannot be obtained.
 	cacl_crc32 = swap_bytes(cacl_crc32);
@@ -323,8 +581,7 @@ std::string S63::extractHwIdFromUserpermit(const std::string& userpermit, const
 
 	//f) Decrypt the Encrypted HW_ID using the Blowfish algorithm with M_KEY as the key.The output will
 	//be HW_ID.
-	m_bf.setKey(M_KEY);
-	m_bf.decrypt(hw_id);
+	ctx.cipher(M_KEY).decrypt(hw_id);
 
 	if (hw_id.size() != VALID_HW_ID_SIZE) {
 		puts("SSE 17 - WARNING INVALID USERPERMIT\n");
@@ -336,67 +593,127 @@ std::string S63::extractHwIdFromUserpermit(const std::string& userpermit, const
 }
 
 
-std::string S63::createCellPermit(const std::string& HW_ID, const std::string& CK1, const std::string& CK2, const std::string& cellname, const std::string& expiry_date) {
+// Checks the arguments of a cell permit, the same for a single permit and a bulk run
+static bool checkCellPermitArgs(const std::string& CK1, const std::string& CK2, const std::string& cellname, const std::string& expiry_date) {
 
 	if (cellname.size() != VALID_CELLNAME_SIZE) {
 		printf("Invalid CellName size. Must be %d characters\n", VALID_CELLNAME_SIZE);
-		return "";
-	}
-	if (HW_ID.size() != VALID_HW_ID_SIZE) {
-		printf("Invalid HW_ID size. Must be %d characters\n", VALID_HW_ID_SIZE);
-		return "";
+		return false;
 	}
 
 	if (CK1.size() != VALID_CELL_KEY_SIZE || CK2.size() != VALID_CELL_KEY_SIZE) {
 		printf("Invalid VALID_CELL_KEY_SIZE size. Must be %d characters\n", VALID_CELL_KEY_SIZE);
-		return "";
+		return false;
 	}
 
 	if (expiry_date.size() != 8 ) {
 		printf("Invalid Expity date size. Must be %d characters\n", 8);
-		return "";
+		return false;
 	}
 	std::time_t expiry_time;
 	if (!parseYYYYMMDD(expiry_date, expiry_time)) {
 		puts("Invalid expiry date string. Must be in YYYYMMDD format and correct\n");
-		return "";
+		return false;
 	}
+	return true;
+}
+
+// Builds a cell permit with the schedule of HW_ID6, the arguments are already checked
+static std::string makeCellPermit(const CBlowFish& bf, const std::string& CK1, const std::string& CK2, const std::string& cellname, const std::string& expiry_date) {
+
 	string cellpermit = cellname;
 	cellpermit.reserve(VALID_CELLPERMIT_SIZE);
 	//a) Remove the file extension from the name of the ENC file.This leaves 8 characters and is the Cell Name of the Cell Permit.
 	// This procedure takes cellname without extension 
 	//b) Append the licence Expiry Date, in the format YYYYMMDD, to the Cell Name from ‘a’.
 	cellpermit.append(expiry_date);
-	//c) Append the first byte of HW_ID to the end of HW_ID to form a 6 byte HW_ID(called HW_ID6).This is
-	//to create a 48 bit key to encrypt the cell keys.
-	string HW_ID6 = HW_ID + HW_ID[0];
 	//d) Encrypt Cell Key 1 using the Blowfish algorithm with HW_ID6 from ‘c’ as the key to create ECK1.
 	//e) Convert ECK1 to 16 hexadecimal characters.Any alphabetic character is to be in upper case.
 	//f) Append to ‘b’ the output from ‘e’.
 	//h) Convert ECK2 to 16 hexadecimal characters.Any alphabetic characters are to be in upper case.
 	//i) Append to ‘f’ the output from ‘h’
-	m_bf.setKey(HW_ID6);
-	cellpermit += string_to_hex(m_bf.encryptConst(CK1));
-	cellpermit += string_to_hex(m_bf.encryptConst(CK2));
+	cellpermit += string_to_hex(bf.encryptConst(CK1));
+	cellpermit += string_to_hex(bf.encryptConst(CK2));
 	
 	//j) Hash the output from ‘i’ using the algorithm CRC32.Note the hash is computed after it has been
 	//converted to a hex string as opposed to the User Permit where the hash is computed on the raw binary data.
-	uint32_t calc_crc32 = crc32(0L, (unsigned char*)&cellpermit[0], VALID_CELLPERMIT_SIZE - 16);
+	uint32_t calc_crc32 = Crc32::update(0, cellpermit.data(), VALID_CELLPERMIT_SIZE - 16);
 	calc_crc32 = swap_bytes(calc_crc32);
 	//k) Encrypt the hash(output from ‘j’) using the Blowfish algorithm with HW_ID6 as the key.
-	m_bf.setKey(HW_ID6);
 	string crc(reinterpret_cast<const char*>(&calc_crc32),4);
-	m_bf.encrypt(crc);
+	bf.encrypt(crc);
 	cellpermit += string_to_hex(crc);
 
 	//l) Convert output from ‘k’ to a 16 character hexadecimal string.Any alphabetic character is to be in upper case.This forms the ENC Check Sum.
 	//m) Append to ‘i’ the output from ‘l’.This is the Cell Permit
 
 	return cellpermit;
+}
+
+std::string S63::createCellPermit(const std::string& HW_ID, const std::string& CK1, const std::string& CK2, const std::string& cellname, const std::string& expiry_date, S63Context& ctx) {
+
+	if (HW_ID.size() != VALID_HW_ID_SIZE) {
+		printf("Invalid HW_ID size. Must be %d characters\n", VALID_HW_ID_SIZE);
+		return "";
+	}
+	if (!checkCellPermitArgs(CK1, CK2, cellname, expiry_date))
+		return "";
+
+	//c) Append the first byte of HW_ID to the end of HW_ID to form a 6 byte HW_ID(called HW_ID6).This is
+	//to create a 48 bit key to encrypt the cell keys.
+	string HW_ID6 = HW_ID + HW_ID[0];
+	return makeCellPermit(ctx.cipher(HW_ID6), CK1, CK2, cellname, expiry_date);
 
 }
 
-std::pair<std::string, std::string> S63::extractCellKeysFromCellpermit(const std::string& cellpermit, const std::string& HW_ID, bool& ok) {
+std::vector<std::string> S63::createCellPermits(const std::vector<std::string>& HW_IDs, const std::vector<S63PermitCell>& cells) {
+
+	std::vector<std::string> permits(HW_IDs.size() * cells.size());
+
+	std::vector<bool> valid_cells(cells.size());
+	for (size_t c = 0; c < cells.size(); ++c) {
+		const S63PermitCell& cell = cells[c];
+		valid_cells[c] = checkCellPermitArgs(cell.CK1, cell.CK2, cell.cellname, cell.expiry_date);
+	}
+
+	// HW_ID6 schedules are expanded in chunks, several keys at once, and every one of them
+	// is used for all the cells before the next chunk
+	const size_t CHUNK = 64;
+	std::vector<CBlowFish> ciphers(CHUNK);
+	std::vector<std::string> keys;
+	std::vector<size_t> owners;
+	keys.reserve(CHUNK);
+	owners.reserve(CHUNK);
+
+	for (size_t h = 0; h < HW_IDs.size(); ) {
+
+		keys.clear();
+		owners.clear();
+		for (; h < HW_IDs.size() && keys.size() < CHUNK; ++h) {
+			const std::string& HW_ID = HW_IDs[h];
+			if (HW_ID.size() != VALID_HW_ID_SIZE) {
+				printf("Invalid HW_ID size. Must be %d characters\n", VALID_HW_ID_SIZE);
+				continue;
+			}
+			keys.push_back(HW_ID + HW_ID[0]);
+			owners.push_back(h);
+		}
+		CBlowFish::setKeys(ciphers.data(), keys.data(), keys.size());
+
+		for (size_t k = 0; k < keys.size(); ++k) {
+			std::string* row = &permits[owners[k] * cells.size()];
+			for (size_t c = 0; c < cells.size(); ++c) {
+				const S63PermitCell& cell = cells[c];
+				if (valid_cells[c])
+					row[c] = makeCellPermit(ciphers[k], cell.CK1, cell.CK2, cell.cellname, cell.expiry_date);
+			}
+		}
+	}
+
+	return permits;
+}
+
+std::pair<std::string, std::string> S63::extractCellKeysFromCellpermit(const std::string& cellpermit, const std::string& HW_ID, bool& ok, S63Context& ctx) {
 	pair<string, string> cell_keys;
 
 	if (HW_ID.size() != VALID_HW_ID_SIZE) {
@@ -405,27 +722,31 @@ std::pair<std::string, std::string> S63::extractCellKeysFromCellpermit(const std
 		return cell_keys;
 	}
 
-	if (!validateCellPermit(cellpermit, HW_ID)) {
+	if (!validateCellPermit(cellpermit, HW_ID, ctx)) {
 		puts("Invalid cellpermit\n");
 		ok = false;
 		return cell_keys;
 	}
 
+	ok = _decryptCellKeys(cellpermit, HW_ID + HW_ID[0], cell_keys, ctx);
+	return cell_keys;
+
+}
+
+bool S63::_decryptCellKeys(const std::string& cellpermit, const std::string& HW_ID6, std::pair<std::string, std::string>& keys, S63Context& ctx) {
+
 	string ECK1 = hex_to_string(cellpermit.substr(16, 16));
 	string ECK2 = hex_to_string(cellpermit.substr(32, 16));
 
 	if (ECK1.size() != 8 || ECK2.size() != 8) {
-		return cell_keys;
+		return false;
 	}
-	string HW_ID6 = HW_ID + HW_ID[0];
-	m_bf.setKey(HW_ID6);
-
-	m_bf.decrypt(ECK1);
-	m_bf.decrypt(ECK2);
-	cell_keys.first  = std::move(ECK1);
-	cell_keys.second = std::move(ECK2);
-	ok = true;
-	return cell_keys;
+	const CBlowFish& bf = ctx.cipher(HW_ID6);
 
+	bf.decrypt(ECK1);
+	bf.decrypt(ECK2);
+	keys.first  = std::move(ECK1);
+	keys.second = std::move(ECK2);
+	return true;
 }
 
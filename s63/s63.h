@@ -23,10 +23,15 @@
  * SOFTWARE.
  */
 
+#include <functional>
+#include <memory>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "blowfish.h"
+#include "cell_buffer.h"
+#include "mapped_file.h"
 
 #define VALID_CELLPERMIT_SIZE 64
 #define VALID_CELLNAME_SIZE 8
@@ -46,31 +51,119 @@ enum S63Error {
 	S63_ERR_CRC
 };
 
+class SimpleUnzipStream;
+
+// Cipher state and input buffer for one thread of work.
+// A context must not be used by two threads at once, but can be reused for any number of calls.
+// The S63 functions take the context of the calling thread unless one is passed explicitly.
+class S63Context
+{
+public:
+	S63Context();
+	~S63Context();
+	S63Context(const S63Context&) = delete;
+	S63Context& operator=(const S63Context&) = delete;
+
+	// Expanded schedule for a key. The few last keys are kept in the context, so repeating keys
+	// (HW_ID6, the cell keys of all the update files of a cell) do not touch the shared cache.
+	// The reference stays valid until another key is requested.
+	const CBlowFish& cipher(const std::string& key);
+
+	// Context of the calling thread
+	static S63Context& local();
+
+	// Input file of the current call, its read buffer is reused from call to call
+	MappedFile& file() { return m_file; }
+
+	// Which of the two cell keys decrypted the last cell: 0 the first, 1 the second, -1 none
+	int lastKey() const { return m_last_key; }
+	void setLastKey(int key) { m_last_key = key; }
+
+	// State of the streaming calls, kept for the next cell so a run over many cells does not
+	// allocate per cell: the decrypted chunk, the output file buffer and the unzipper with its inflate state
+	std::string& chunk() { return m_chunk; }
+	std::vector<char>& outputBuffer() { return m_output; }
+	SimpleUnzipStream& unzipStream(const std::function<bool(const char*, size_t)>& sink);
+
+private:
+	static const size_t SLOTS = 4;
+	std::string m_keys[SLOTS];
+	std::shared_ptr<const CBlowFish> m_ciphers[SLOTS];
+	size_t m_next = 0;
+	int m_last_key = -1;
+	MappedFile m_file;
+	std::string m_chunk;
+	std::vector<char> m_output;
+	std::unique_ptr<SimpleUnzipStream> m_unzip;
+};
+
+// One cell of a batch decryption
+struct S63CellJob {
+	std::string* buf;	// encrypted cell, decrypted in place
+	std::pair<std::string, std::string> keys;
+	S63Error result = S63_ERR_OK;
+};
+
+// One cell of a bulk permit run
+struct S63PermitCell {
+	std::string cellname;
+	std::string CK1;
+	std::string CK2;
+	std::string expiry_date;
+};
+
+// All the functions are reentrant and can be called from several threads at once.
 class S63 {
 
 public:
 	
-	static inline bool validateCellPermit(const std::string& permit, const std::string& HW_ID);
-	static std::string createUserPermit(const std::string& M_KEY, const std::string& HW_ID, const std::string& M_ID);
-	static std::string extractHwIdFromUserpermit(const std::string& userpermit, const std::string& M_KEY);
+	static inline bool validateCellPermit(const std::string& permit, const std::string& HW_ID, S63Context& ctx = S63Context::local());
+	static std::string createUserPermit(const std::string& M_KEY, const std::string& HW_ID, const std::string& M_ID, S63Context& ctx = S63Context::local());
+	static std::string extractHwIdFromUserpermit(const std::string& userpermit, const std::string& M_KEY, S63Context& ctx = S63Context::local());
 
-	static std::string createCellPermit(const std::string& HW_ID, const std::string& CK1, const std::string& CK2, const std::string& cellname, const std::string& expiry_date);
-	static std::pair<std::string,std::string> extractCellKeysFromCellpermit(const std::string& cellpermit, const std::string& HW_ID, bool& ok);
+	static std::string createCellPermit(const std::string& HW_ID, const std::string& CK1, const std::string& CK2, const std::string& cellname, const std::string& expiry_date, S63Context& ctx = S63Context::local());
+	// Cell permits of every cell for every HW_ID, the permit for HW_IDs[h] and cells[c] is at h * cells.size() + c.
+	// The HW_ID keys are expanded several at once, invalid arguments give empty permits.
+	static std::vector<std::string> createCellPermits(const std::vector<std::string>& HW_IDs, const std::vector<S63PermitCell>& cells);
+	static std::pair<std::string,std::string> extractCellKeysFromCellpermit(const std::string& cellpermit, const std::string& HW_ID, bool& ok, S63Context& ctx = S63Context::local());
 	
 	// Note, that after being decrypted, cell still need to be uncompressed
-	static S63Error decryptCell(const std::string& path, const std::pair<std::string, std::string>& keys, std::string& out_buf);
-	static S63Error decryptCell(std::string& buf, const std::string& key);
+	static S63Error decryptCell(const std::string& path, const std::pair<std::string, std::string>& keys, std::string& out_buf, S63Context& ctx = S63Context::local());
+	static S63Error decryptCell(const std::string& path, const std::pair<std::string, std::string>& keys, CellBuffer& out, S63Context& ctx = S63Context::local());
+	// Cell which is already in memory, e.g. an entry of a zipped exchange set
+	static S63Error decryptCell(const CellBuffer& in, const std::pair<std::string, std::string>& keys, CellBuffer& out, S63Context& ctx = S63Context::local());
+	static S63Error decryptCell(std::string& buf, const std::string& key, S63Context& ctx = S63Context::local());
+
+	// Decrypts a batch of cells, each with its own keys, with the multi-buffer engine.
+	// The result of every cell is stored in its job, cells with invalid keys are left untouched.
+	static void decryptCells(std::vector<S63CellJob>& jobs);
+
+	static void encryptCell(std::string& buf, const std::string& key, S63Context& ctx = S63Context::local());
+
+	// Cell is read, decrypted and inflated in small chunks, memory use does not depend on its size
+	static S63Error decryptAndUnzipCellByKey(const std::string& in_path, const std::pair<std::string, std::string>& keys, const std::string& out_path, S63Context& ctx = S63Context::local());
+	// Same, but the uncompressed data is passed to sink chunk by chunk. The sink returns false to abort.
+	static S63Error decryptAndUnzipCellStream(const std::string& in_path, const std::pair<std::string, std::string>& keys, const std::function<bool(const char*, size_t)>& sink, S63Context& ctx = S63Context::local());
+
+	// Schedule of the cell key which decrypts a cell, tested on the first 8 bytes of it; null if neither does.
+	// ctx.lastKey() tells which of the two it was. Unlike ctx.cipher() it stays valid for as long as it is held.
+	static std::shared_ptr<const CBlowFish> cellCipher(const char* first_block, const std::pair<std::string, std::string>& keys, S63Context& ctx = S63Context::local());
 
-	static void encryptCell(std::string& buf, const std::string& key);
+	// Expanded key schedules are shared through a LRU cache, this sets its memory budget in bytes
+	static void setKeyCacheBudget(size_t bytes);
 
-	static S63Error decryptAndUnzipCellByKey(const std::string& in_path, const std::pair<std::string, std::string>& keys, const std::string& out_path);
+	static const size_t DEFAULT_PARALLEL_THRESHOLD = 1024 * 1024;
+	// Cells of at least this many bytes are decrypted and encrypted in chunks on the shared thread pool,
+	// 0 turns it off
+	static void setParallelThreshold(size_t bytes);
 
 protected:
-	static bool _validateCellPermit(const std::string& permit, const std::string& HW_ID6);
-	static CBlowFish m_bf;
+	static bool _validateCellPermit(const std::string& permit, const std::string& HW_ID6, S63Context& ctx = S63Context::local());
+	// Decrypts ECK1 and ECK2 of a permit which is already validated
+	static bool _decryptCellKeys(const std::string& permit, const std::string& HW_ID6, std::pair<std::string, std::string>& keys, S63Context& ctx = S63Context::local());
 };
 
-bool S63::validateCellPermit(const std::string& permit, const std::string& HW_ID) {
+bool S63::validateCellPermit(const std::string& permit, const std::string& HW_ID, S63Context& ctx) {
 	std::string HW_ID6 = HW_ID + HW_ID[0];
-	return _validateCellPermit(permit,HW_ID6);
+	return _validateCellPermit(permit,HW_ID6,ctx);
 }
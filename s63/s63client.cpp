@@ -24,15 +24,15 @@
 
 #include "s63client.h"
 
+#include <filesystem>
 #include <fstream>
 
-#include "s63utils.hpp"
+#include "s57update.h"
 #include "simple_zip.h"
 
 using key_pair = std::pair<std::string, std::string>;
 
 using namespace std;
-using namespace hexutils;
 
 S63Client::S63Client(const std::string& HW_ID, const std::string& M_KEY, const std::string& M_ID): m_mkey(M_KEY), m_mid(M_ID) {
 
@@ -40,41 +40,78 @@ S63Client::S63Client(const std::string& HW_ID, const std::string& M_KEY, const s
 }
 
 
-S63Error S63Client::decryptAndUnzipCell(const std::string& in_path, const std::string& out_path) {
+const S63Client::CellPermit* S63Client::findPermit(const std::string& path) const {
 
-	string cellname = in_path.substr(in_path.size() - VALID_CELLNAME_SIZE - 4, VALID_CELLNAME_SIZE);
+	if (path.size() < VALID_CELLNAME_SIZE + 4) {
+		return nullptr;
+	}
+	string cellname = path.substr(path.size() - VALID_CELLNAME_SIZE - 4, VALID_CELLNAME_SIZE);
+
+	const auto permit = m_permits.find(cellname);
+	return permit == m_permits.end() ? nullptr : &permit->second;
+}
+
+// The key which worked last time goes first, so S63 does not try the wrong one again
+static key_pair orderKeys(const key_pair& keys, int first) {
+	if (first == 1) {
+		return { keys.second, keys.first };
+	}
+	return keys;
+}
+
+S63Error S63Client::withPermitKeys(const CellPermit& permit, S63Context& ctx, const std::function<S63Error(const key_pair&)>& call) const {
+
+	int first = permit.good_key.load(std::memory_order_relaxed);
+	ctx.setLastKey(-1);
+	S63Error err = call(orderKeys(permit.keys, first));
+	if (ctx.lastKey() >= 0) {
+		permit.good_key.store(ctx.lastKey() ^ first, std::memory_order_relaxed);
+	}
+	return err;
+}
+
+S63Error S63Client::decryptPermitCell(const CellPermit& permit, const std::string& path, CellBuffer& out_buf, S63Context& ctx) const {
 
-	if (m_permits.find(cellname) == m_permits.end()) {
+	return withPermitKeys(permit, ctx, [&](const key_pair& keys) { return S63::decryptCell(path, keys, out_buf, ctx); });
+}
+
+S63Error S63Client::decryptPermitCell(const CellPermit& permit, const CellBuffer& in, CellBuffer& out_buf, S63Context& ctx) const {
+
+	return withPermitKeys(permit, ctx, [&](const key_pair& keys) { return S63::decryptCell(in, keys, out_buf, ctx); });
+}
+
+S63Error S63Client::decryptAndUnzipCell(const CellPermit& permit, const std::string& in_path, const std::string& out_path, S63Context& ctx) const {
+
+	return withPermitKeys(permit, ctx, [&](const key_pair& keys) { return decryptAndUnzipCellByKey(in_path, keys, out_path, ctx); });
+}
+
+S63Error S63Client::decryptAndUnzipCell(const std::string& in_path, const std::string& out_path, S63Context& ctx) const {
+
+	const CellPermit* permit = findPermit(in_path);
+	if (!permit) {
 		//SSE 21 – Decryption failed no valid cell permit found. Permits may be for another system or new 
 		//permits may be required, please contact your supplier to obtain a new licence.”
-		printf("There is no permit for basecell %s\n", cellname.c_str());
+		printf("There is no permit for cell %s\n", in_path.c_str());
 		return S63_ERR_PERMIT;
 	}
 
-	return decryptAndUnzipCell(in_path, m_permits[cellname], out_path);
+	return decryptAndUnzipCell(*permit, in_path, out_path, ctx);
 
 }
 
-S63Error S63Client::decryptAndUnzipCell(const std::string& in_path, const std::string& cellpermit, const std::string& out_path) {
+S63Error S63Client::decryptAndUnzipCell(const std::string& in_path, const std::string& cellpermit, const std::string& out_path, S63Context& ctx) const {
 
 	if (cellpermit.size() != VALID_CELLPERMIT_SIZE) {
 		puts("Wrong permit size\n");
 		return S63_ERR_PERMIT;
 	}
 	bool ok;
-	const auto keys = extractCellKeysFromCellpermit(cellpermit, m_hwid, ok);
+	const auto keys = extractCellKeysFromCellpermit(cellpermit, m_hwid, ok, ctx);
 	if (!ok) {
 		return S63_ERR_PERMIT;
 	}
-	std::string cellKey = hex_to_string(cellpermit.substr(16, 16));
-	if (cellKey.size() != 8) {
-		return S63_ERR_PERMIT;
-	}
 
-	m_bf.setKey(m_hwid6);
-	m_bf.decrypt(cellKey);
-
-	return decryptAndUnzipCellByKey(in_path, keys, out_path);
+	return decryptAndUnzipCellByKey(in_path, keys, out_path, ctx);
 
 }
 
@@ -123,9 +160,17 @@ bool S63Client::installCellPermit(const std::string& cellpermit) {
 		return false;
 	}
 
+	pair<string, string> keys;
+	if (!_decryptCellKeys(cellpermit, m_hwid6, keys)) {
+		return false;
+	}
+
 	string cellname = cellpermit.substr(0, VALID_CELLNAME_SIZE);
 
-	m_permits[cellname] = cellpermit;
+	CellPermit& permit = m_permits[cellname];
+	permit.permit = cellpermit;
+	permit.keys = std::move(keys);
+	permit.good_key = 0;
 
 	printf("Permit for basecell %s succefully installed\n", cellname.c_str());
 
@@ -133,32 +178,192 @@ bool S63Client::installCellPermit(const std::string& cellpermit) {
 }
 
 
-std::string S63Client::open(const std::string& path) {
-	string cellname = path.substr(path.size() - VALID_CELLNAME_SIZE - 4, VALID_CELLNAME_SIZE);
+CellBuffer S63Client::open(const std::string& path, S63Context& ctx) const {
+
+	// A packed cell is a view into the mapped pack, there is nothing to cache
+	CellBuffer packed = m_pack.get(path);
+	if (!packed.empty()) {
+		return packed;
+	}
+
+	// The stamp is taken before the file is read, a file changed meanwhile is a miss next time
+	std::string stamp;
+	bool cache = m_cells.budget() && S63CellCache::stamp(path, stamp);
+	if (cache) {
+		CellBuffer cell = m_cells.get(path, stamp);
+		if (!cell.empty()) {
+			return cell;
+		}
+	}
 
-	if (m_permits.find(cellname) == m_permits.end()) {
+	const CellPermit* permit = findPermit(path);
+	if (!permit) {
 		puts("SSE 21 – Decryption failed no valid cell permit found. Permits may be for another system or new \
 		permits may be required, please contact your supplier to obtain a new licence.”");
 		return {};
 	}
-	bool ok;
-	key_pair keys = S63::extractCellKeysFromCellpermit(m_permits[cellname],m_hwid,ok);
+	CellBuffer decrypted;
 
-	if (!ok) {
+	if (decryptPermitCell(*permit, path, decrypted, ctx) != S63_ERR_OK) {
+		return {};
+	}
+	return unzipCell(path, stamp, cache, decrypted);
+	
+}
+
+CellBuffer S63Client::open(const ZipArchive& archive, const std::string& name, S63Context& ctx) const {
+
+	const ZipArchive::Entry* entry = archive.find(name);
+	if (!entry) {
+		printf("There is no %s in the archive\n", name.c_str());
 		return {};
 	}
-	std::string decrypted;
 
-	if (S63::decryptCell(path, keys, decrypted) != S63_ERR_OK) {
+	// There is no file to stamp, an entry is told apart by its CRC and size
+	const std::string key = archive.path() + "/" + entry->name;
+	const std::string stamp = std::to_string(entry->compressed_size) + ":" + std::to_string(entry->crc);
+	bool cache = m_cells.budget() != 0;
+	if (cache) {
+		CellBuffer cell = m_cells.get(key, stamp);
+		if (!cell.empty()) {
+			return cell;
+		}
+	}
+
+	const CellPermit* permit = findPermit(entry->name);
+	if (!permit) {
+		printf("There is no permit for cell %s\n", entry->name.c_str());
+		return {};
+	}
+	// A stored entry is a view into the mapped archive, it is decrypted from there
+	CellBuffer encrypted;
+	if (!archive.extract(*entry, encrypted)) {
 		return {};
 	}
-	std::string unzipped;
+	CellBuffer decrypted;
+	if (decryptPermitCell(*permit, encrypted, decrypted, ctx) != S63_ERR_OK) {
+		return {};
+	}
+	return unzipCell(key, stamp, cache, decrypted);
+}
+
+CellBuffer S63Client::unzipCell(const std::string& key, const std::string& stamp, bool cache, const CellBuffer& decrypted) const {
+
+	CellBuffer unzipped;
 	if (!SimpleZip::unzip(decrypted, unzipped)) {
 		return {};
 	}
-	
+	if (cache) {
+		// The decrypted zip is kept too, the cell stays cached in it once it is no longer hot
+		m_cells.put(key, stamp, unzipped, decrypted);
+	}
 	return unzipped;
-	
+}
+
+bool S63Client::updateCellPack(S63Context& ctx) const {
+
+	return m_pack.update([this, &ctx](const std::string& path) { return open(path, ctx); });
+}
+
+std::unique_ptr<S63CellReader> S63Client::openReader(const std::string& path, S63Context& ctx) const {
+
+	const CellPermit* permit = findPermit(path);
+	if (!permit) {
+		printf("There is no permit for cell %s\n", path.c_str());
+		return nullptr;
+	}
+
+	std::unique_ptr<S63CellReader> reader(new S63CellReader());
+	S63Error err = withPermitKeys(*permit, ctx, [&](const key_pair& keys) { return reader->open(path, keys, ctx); });
+	if (err != S63_ERR_OK) {
+		return nullptr;
+	}
+	return reader;
+}
+
+CellBuffer S63Client::openUpdated(const std::string& base_path, S63Context& ctx) const {
+
+	std::filesystem::path base(base_path);
+	if (base.extension() != ".000") {
+		return open(base_path, ctx);
+	}
+
+	// The update chain: .001, .002 ... up to the first missing one. In an exchange set every update
+	// is in a directory of its own next to the one of the base cell (CELL/<edition>/<update>/CELL.00n),
+	// a flat copy has them all in one directory.
+	std::vector<std::string> paths{ base_path };
+	std::string stamp;
+	if (!S63CellCache::stamp(base_path, stamp)) {
+		printf("Could not open %s\n", base_path.c_str());
+		return {};
+	}
+	const std::filesystem::path edition_dir = base.parent_path().parent_path();
+	for (int n = 1; n < 1000; ++n) {
+		std::filesystem::path p = base;
+		char ext[8];
+		snprintf(ext, sizeof(ext), ".%03d", n);
+		p.replace_extension(ext);
+		std::string file_stamp;
+		if (!S63CellCache::stamp(p.string(), file_stamp)) {
+			if (edition_dir.empty()) {
+				break;
+			}
+			p = edition_dir / std::to_string(n) / p.filename();
+			if (!S63CellCache::stamp(p.string(), file_stamp)) {
+				break;
+			}
+		}
+		paths.push_back(p.string());
+		stamp += ";" + file_stamp;
+	}
+
+	CellBuffer cached = m_updated.get(base_path, stamp);
+	if (!cached.empty()) {
+		return cached;
+	}
+
+	CellBuffer cell = open(base_path, ctx);
+	if (cell.empty()) {
+		return {};
+	}
+	std::vector<CellBuffer> updates;
+	for (size_t i = 1; i < paths.size(); ++i) {
+		updates.push_back(open(paths[i], ctx));
+		if (updates.back().empty()) {
+			return {};
+		}
+	}
+
+	CellBuffer merged = cell;
+	if (!updates.empty()) {
+		std::string out;
+		if (!S57Updater::apply(cell, updates, out)) {
+			printf("Could not apply the updates of %s\n", base_path.c_str());
+			return {};
+		}
+		merged = CellBuffer(std::move(out));
+	}
+
+	m_updated.put(base_path, stamp, merged);
+	return merged;
+}
+
+CellLoader::Ticket S63Client::openAsync(const std::string& path, int priority, CellLoader::Callback callback) const {
+
+	std::call_once(m_loader_once, [this]() {
+		m_loader.reset(new CellLoader([this](const std::string& p, S63Context& ctx) { return open(p, ctx); }, m_async_threads));
+	});
+	return m_loader->request(path, priority, std::move(callback));
+}
+
+std::vector<CellLoader::Ticket> S63Client::openMany(const std::vector<std::string>& paths, int priority, const CellLoader::Callback& callback) const {
+
+	std::vector<CellLoader::Ticket> tickets;
+	tickets.reserve(paths.size());
+	for (const auto& path : paths) {
+		tickets.push_back(openAsync(path, priority, callback));
+	}
+	return tickets;
 }
 
 std::string S63Client::getUserpermit() {
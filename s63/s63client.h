@@ -23,8 +23,19 @@
  * SOFTWARE.
  */
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+
 #include "s63.h"
+#include "cell_cache.h"
+#include "cell_loader.h"
+#include "cell_pack.h"
+#include "cell_reader.h"
+#include "zip_archive.h"
 
+// Installing permits and changing the keys is not synchronized, but once the permits are installed,
+// open and decryptAndUnzipCell can be called from several threads at once.
 class S63Client : public S63
 {
 public:
@@ -48,17 +59,77 @@ public:
 	std::string getUserpermit();
 
 	// Opens a s63 file, finds a corresponding cellpermit among installed,
-	// then decrypted and unziped cell retuns as a memory buffer (yeah, string used just as a byte array)
-	std::string open(const std::string& path);
+	// then decrypted and unziped cell retuns as a shared memory buffer, empty on error.
+	// If cellCache() has a budget, the decoded cell is kept there until the file changes.
+	CellBuffer open(const std::string& path, S63Context& ctx = S63Context::local()) const;
+
+	// Same for a cell inside a zipped exchange set, name is its path in the archive. The cell is decrypted
+	// straight from the mapped archive, nothing is unpacked to disk. Cached like open() as long as
+	// the entry has the same CRC and size.
+	CellBuffer open(const ZipArchive& archive, const std::string& name, S63Context& ctx = S63Context::local()) const;
+
+	// Opens a cell for random access without decoding it as a whole, for readers which only need a part
+	// of a big cell (the DDR and a few records). Null if there is no permit or the cell can not be opened.
+	// The reader is not cached and does not use cellCache().
+	std::unique_ptr<S63CellReader> openReader(const std::string& path, S63Context& ctx = S63Context::local()) const;
+
+	// Opens a base cell (.000) together with the updates found next to it (.001, .002 ...) and
+	// returns the up-to-date S57 cell with all the updates applied. The result is kept in updatedCache()
+	// and merged again only when an update is added or one of the files changes.
+	CellBuffer openUpdated(const std::string& base_path, S63Context& ctx = S63Context::local()) const;
 
-	S63Error decryptAndUnzipCell(const std::string& in_path, const std::string& out_path);
-	S63Error decryptAndUnzipCell(const std::string& in_path, const std::string& cellpermit, const std::string& out_path);
+	// Opens a cell in the background, so the caller does not stall: the most urgent (highest priority)
+	// requests first, a cell already on its way is not opened twice. The cell comes from the ticket,
+	// or from the callback on a background thread. Cancel the tickets of cells no longer needed.
+	CellLoader::Ticket openAsync(const std::string& path, int priority = 0, CellLoader::Callback callback = nullptr) const;
+	// Same for a batch of cells, the tickets come in the order of the paths
+	std::vector<CellLoader::Ticket> openMany(const std::vector<std::string>& paths, int priority = 0, const CellLoader::Callback& callback = nullptr) const;
+	// Number of background threads, takes effect if set before the first openAsync()
+	void setAsyncThreads(size_t threads) { m_async_threads = threads; }
+
+	static const size_t DEFAULT_UPDATED_CACHE_BUDGET = 64 * 1024 * 1024;
+	// Decoded cells of open(), off until a budget is set. Cells which are not hot are kept as
+	// their decrypted zip, see S63CellCache::setHotShare.
+	S63CellCache& cellCache() const { return m_cells; }
+	// Merged cells of openUpdated()
+	S63CellCache& updatedCache() const { return m_updated; }
+	// Decoded cells of an ENC_ROOT packed into a mapped file, open() looks there first.
+	// cellPack().open(enc_root) maps the pack made by an earlier run.
+	S63CellPack& cellPack() const { return m_pack; }
+	// Brings the pack up to date with the cells under its root, only new and changed cells are decoded
+	bool updateCellPack(S63Context& ctx = S63Context::local()) const;
+
+	S63Error decryptAndUnzipCell(const std::string& in_path, const std::string& out_path, S63Context& ctx = S63Context::local()) const;
+	S63Error decryptAndUnzipCell(const std::string& in_path, const std::string& cellpermit, const std::string& out_path, S63Context& ctx = S63Context::local()) const;
 	
 private:
+	// Installed permit with its cell keys, decrypted once at install time
+	struct CellPermit {
+		std::string permit;
+		std::pair<std::string, std::string> keys;
+		// Which key decrypted the cell last time, it is tried first from then on
+		mutable std::atomic<int> good_key{ 0 };
+	};
+	const CellPermit* findPermit(const std::string& path) const;
+	// Runs call with the permit keys, the one which worked last time first, and remembers which one works
+	S63Error withPermitKeys(const CellPermit& permit, S63Context& ctx, const std::function<S63Error(const std::pair<std::string, std::string>&)>& call) const;
+	S63Error decryptPermitCell(const CellPermit& permit, const std::string& path, CellBuffer& out_buf, S63Context& ctx) const;
+	S63Error decryptPermitCell(const CellPermit& permit, const CellBuffer& in, CellBuffer& out_buf, S63Context& ctx) const;
+	CellBuffer unzipCell(const std::string& key, const std::string& stamp, bool cache, const CellBuffer& decrypted) const;
+	S63Error decryptAndUnzipCell(const CellPermit& permit, const std::string& in_path, const std::string& out_path, S63Context& ctx) const;
+
 	std::string m_mkey;
 	std::string m_mid;
 	std::string m_hwid;
 	std::string m_hwid6;
-	std::unordered_map <std::string, std::string> m_permits;
+	std::unordered_map <std::string, CellPermit> m_permits;
+	mutable S63CellCache m_cells;
+	mutable S63CellCache m_updated{ DEFAULT_UPDATED_CACHE_BUDGET };
+	mutable S63CellPack m_pack;
+
+	size_t m_async_threads = 2;
+	mutable std::once_flag m_loader_once;
+	// Last, so the background threads stop before the rest goes away
+	mutable std::unique_ptr<CellLoader> m_loader;
 };
 
@@ -29,6 +29,15 @@
 #include <sstream>
 #include <fstream>
 #include <ctime>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <memory>
+#include <vector>
+
+#include "crc32_simd.h"
+#include "fast_inflate.h"
+#include "thread_pool.h"
 
 #include "zlib/zlib.h"
 
@@ -38,7 +47,8 @@
 #define ZIP_CENTRAL_DIR_SIGNATURE 0x02014b50
 #define ZIP_EOCD_RECORD_SIGNATURE 0x06054b50
 #define ZIP_LOCAL_HEADER_MIN_SIZE 30
-#define ZIP_SIZE_UNKNOWN  0x0800
+#define ZIP_DATA_DESCRIPTOR_SIGNATURE 0x08074b50
+#define ZIP_SIZE_UNKNOWN  0x0008
 #define ZIP_ZIP64 0xffffffff
 
 using namespace std;
@@ -109,84 +119,149 @@ static uint32_t getCurrentDateTime()
 		((ptm->tm_sec / 2) + (32 * ptm->tm_min) + (2048 * (uint32_t)ptm->tm_hour));
 }
 
+// Inflate state of a thread, reset between the calls instead of a new inflateInit2 and inflateEnd
+// for every cell
+struct InflateState
+{
+	z_stream zs = {};
+	bool ready = false;
+
+	~InflateState() {
+		if (ready)
+			inflateEnd(&zs);
+	}
+
+	z_stream* get() {
+		if (ready)
+			inflateReset(&zs);
+		else
+			ready = inflateInit2(&zs, -MAX_WBITS) == Z_OK;
+		return ready ? &zs : nullptr;
+	}
+};
+
 static int uncompressData(const char* const abSrc, size_t nLenSrc, char* abDst, size_t nLenDst)
 {
-	z_stream zInfo = { 0 };
-	zInfo.total_in = zInfo.avail_in = nLenSrc;
-	zInfo.total_out = zInfo.avail_out = nLenDst;
-	zInfo.next_in = (Bytef*)abSrc;
-	zInfo.next_out = (unsigned char*)abDst;
-
-	int nErr, nRet = -1;
-
-	nErr = inflateInit2(&zInfo, -MAX_WBITS);               // zlib function
-	if (nErr == Z_OK) {
-		nErr = inflate(&zInfo, Z_FINISH);     // zlib function
-		if (nErr == Z_STREAM_END) {
-			nRet = zInfo.total_out;
-		}
+	static thread_local InflateState state;
+	z_stream* zInfo = state.get();
+	if (!zInfo)
+		return -1;
+
+	zInfo->avail_in = nLenSrc;
+	zInfo->avail_out = nLenDst;
+	zInfo->next_in = (Bytef*)abSrc;
+	zInfo->next_out = (unsigned char*)abDst;
+
+	int nRet = -1;
+	int nErr = inflate(zInfo, Z_FINISH);     // zlib function
+	if (nErr == Z_STREAM_END) {
+		nRet = zInfo->total_out;
 	}
-	inflateEnd(&zInfo);   // zlib function
 	return(nRet); // -1 or len of output
 }
 
-static int compressData(const char* const in, size_t in_size, string& out_buffer)
+// Deflate state of a thread, reset between the blocks instead of a new deflateInit2 and deflateEnd
+struct DeflateState
 {
-	
-	const size_t BUFSIZE = 128 * 1024;
-	uint8_t temp_buffer[BUFSIZE];
-
-	z_stream strm;
-	strm.zalloc = 0;
-	strm.zfree = 0;
-	strm.next_in = (unsigned char*)in;
-	strm.avail_in = in_size;
-	strm.next_out = temp_buffer;
-	strm.avail_out = BUFSIZE;
-
-	deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
-
-	while (strm.avail_in != 0)
-	{
-		int res = deflate(&strm, Z_NO_FLUSH);
-		if (res != Z_OK) return res;
-		if (strm.avail_out == 0)
-		{
-			out_buffer.insert(out_buffer.end(), temp_buffer, temp_buffer + BUFSIZE);
-			strm.next_out = temp_buffer;
-			strm.avail_out = BUFSIZE;
-		}
+	z_stream zs = {};
+	bool ready = false;
+
+	~DeflateState() {
+		if (ready)
+			deflateEnd(&zs);
 	}
 
-	int deflate_res = Z_OK;
-	while (deflate_res == Z_OK)
-	{
-		if (strm.avail_out == 0)
-		{
-			out_buffer.insert(out_buffer.end(), temp_buffer, temp_buffer + BUFSIZE);
-			strm.next_out = temp_buffer;
-			strm.avail_out = BUFSIZE;
-		}
-		deflate_res = deflate(&strm, Z_FINISH);
+	z_stream* get() {
+		if (ready)
+			deflateReset(&zs);
+		else
+			ready = deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+		return ready ? &zs : nullptr;
 	}
+};
 
-	if(deflate_res != Z_STREAM_END)  return deflate_res;
-	out_buffer.insert(out_buffer.end(), temp_buffer, temp_buffer + BUFSIZE - strm.avail_out);
-	deflateEnd(&strm);
+// Deflates in straight onto the end of out. dict is the data right before in. A block which is not
+// the last one ends with a sync flush, on a byte boundary, so the next block can follow it as it is.
+static bool compressBlock(const char* dict, size_t dict_len, const char* in, size_t len, bool last, string& out)
+{
+	static thread_local DeflateState state;
+	z_stream* zs = state.get();
+	if (!zs)
+		return false;
+	if (dict_len && deflateSetDictionary(zs, (const Bytef*)dict, (uInt)dict_len) != Z_OK)
+		return false;
 
-	return 0;
+	const size_t start = out.size();
+	out.resize(start + deflateBound(zs, (uLong)len));
+	zs->next_in = (Bytef*)in;
+	zs->avail_in = (uInt)len;
+	zs->next_out = (Bytef*)&out[start];
+	zs->avail_out = (uInt)(out.size() - start);
+
+	// The bound is for Z_FINISH, a flush may need a few bytes more
+	const int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+	int res = deflate(zs, flush);
+	while (zs->avail_out == 0 && res != Z_STREAM_END && res != Z_STREAM_ERROR) {
+		out.resize(out.size() + 64);
+		zs->next_out = (Bytef*)&out[start + zs->total_out];
+		zs->avail_out = (uInt)(out.size() - start - zs->total_out);
+		res = deflate(zs, flush);
+	}
+	out.resize(start + zs->total_out);
+	return last ? res == Z_STREAM_END : zs->avail_in == 0 && (res == Z_OK || res == Z_BUF_ERROR);
 }
 
+// Input of a zip is cut into blocks of this size, which are deflated in parallel
+static const size_t ZIP_BLOCK = 128 * 1024;
+static const size_t ZIP_DICT = 32 * 1024;
 
+// Deflates in onto the end of out and computes its CRC
+static bool compressData(const string& in, string& out, uint32_t& crc)
+{
+	const size_t blocks = (in.size() + ZIP_BLOCK - 1) / ZIP_BLOCK;
+	if (blocks < 2) {
+		crc = Crc32::update(0, in.data(), in.size());
+		return compressBlock(nullptr, 0, in.data(), in.size(), true, out);
+	}
 
-bool SimpleZip::unzip(const std::string& in, std::string& out) {
+	// As pigz does: every block is deflated on its own with the 32KB before it as the dictionary,
+	// so it packs nearly as well as one stream. The blocks and their CRCs are joined in order.
+	// Blocks are used without workers too, the zip is the same whatever the number of threads.
+	std::vector<string> parts(blocks);
+	std::vector<uint32_t> crcs(blocks);
+	std::atomic<bool> ok(true);
+	ThreadPool::shared().parallelFor(blocks, [&](size_t i) {
+		const size_t offset = i * ZIP_BLOCK;
+		const size_t len = std::min(ZIP_BLOCK, in.size() - offset);
+		const size_t dict = std::min(offset, ZIP_DICT);
+		crcs[i] = Crc32::update(0, in.data() + offset, len);
+		if (!compressBlock(in.data() + offset - dict, dict, in.data() + offset, len, i + 1 == blocks, parts[i]))
+			ok = false;
+	});
+	if (!ok)
+		return false;
+
+	size_t total = 0;
+	for (const auto& part : parts)
+		total += part.size();
+	out.reserve(out.size() + total);
+	crc = crcs[0];
+	for (size_t i = 0; i < blocks; ++i) {
+		out.append(parts[i]);
+		if (i)
+			crc = crc32_combine(crc, crcs[i], (z_off_t)std::min(ZIP_BLOCK, in.size() - i * ZIP_BLOCK));
+	}
+	return true;
+}
 
-	size_t len = in.size();
-	const char* buf = in.data();
-	if (len < ZIP_MIN_FILE_SIZE)
+
+
+bool SimpleZip::entryInfo(const char* head, size_t head_len, const char* tail, size_t tail_len, size_t len, EntryInfo& info) {
+
+	if (len < ZIP_MIN_FILE_SIZE || head_len < sizeof(FileHeader))
 		return false;
 
-	const FileHeader* file_header = reinterpret_cast<const FileHeader*>(buf);
+	const FileHeader* file_header = reinterpret_cast<const FileHeader*>(head);
 
 	if (file_header->signature != ZIP_LOCAL_HEADER_SIGNATURE) {
 		cout << "wrong zip signature\n";
@@ -198,66 +273,175 @@ bool SimpleZip::unzip(const std::string& in, std::string& out) {
 		return false;
 	}
 
-	const char* data_start_ptr = buf + sizeof(FileHeader) + file_header->extra_field_len + file_header->filename_len;
-	uint32_t file_crc = file_header->crc32;
-	size_t compressed_size = file_header->compressed_size;
-	size_t uncompressed_size = file_header->uncompressed_size;
+	info.data_offset = sizeof(FileHeader) + file_header->extra_field_len + file_header->filename_len;
+	info.crc = file_header->crc32;
+	info.compressed_size = file_header->compressed_size;
+	info.uncompressed_size = file_header->uncompressed_size;
+	info.deflated = file_header->compression_method == Z_DEFLATED;
 
-	if (file_header->gp_flag & ZIP_SIZE_UNKNOWN || compressed_size == 0) {
+	if (file_header->gp_flag & ZIP_SIZE_UNKNOWN || info.compressed_size == 0) {
 
 		// Bad news. The file size is unkown in local file header.
 		// But we steel knows where it begins
 		// To figure out a file size we got to find the End Of Catalog record at the end of zip file
 		// Then read an position of Central Catalog record where we can find a file size finaly
 
-		const char* eocd_pos = findEOCD(buf, len);
+		const char* eocd_pos = findEOCD(tail, tail_len);
 		if (0 == eocd_pos) {
 			puts("cant find end of dirrectory record\n");
 			return false;
 		}
 		const EOCD* eocd = reinterpret_cast<const EOCD*>(eocd_pos);
 
-		if (eocd->CD_start_offset > len) {
+		// Offsets are from the start of the archive, the tail holds its last tail_len bytes
+		size_t cd_offset = size_t(eocd->disk_CD) + eocd->CD_start_offset;
+		size_t tail_offset = len - tail_len;
+		if (cd_offset > len || cd_offset < tail_offset || len - cd_offset < sizeof(CentralDirRecord)) {
 			puts("wrong CD offset value\n");
 			return false;
 		}
 
-		const CentralDirRecord* cd = reinterpret_cast<const CentralDirRecord*>(buf + eocd->disk_CD + eocd->CD_start_offset);
+		const CentralDirRecord* cd = reinterpret_cast<const CentralDirRecord*>(tail + (cd_offset - tail_offset));
 
 		if (cd->signature != ZIP_CENTRAL_DIR_SIGNATURE) {
 			cout << "wrong central dir signature\n";
 			return false;
 
 		}
-		file_crc = cd->crc32;
-		compressed_size = cd->compressed_size;
-		uncompressed_size = cd->uncompressed_size;
+		info.crc = cd->crc32;
+		info.compressed_size = cd->compressed_size;
+		info.uncompressed_size = cd->uncompressed_size;
 
 	}
 
+	if (info.data_offset > len || info.compressed_size > len - info.data_offset ||
+		(!info.deflated && info.compressed_size != info.uncompressed_size)) {
+		puts("wrong entry size\n");
+		return false;
+	}
+	return true;
+}
 
-	out.resize(uncompressed_size);
+// Finds the data of the single entry and its sizes, from the local header or the central directory
+bool SimpleZip::findEntry(const char* buf, size_t len, Entry& entry) {
 
+	EntryInfo info;
+	if (!entryInfo(buf, len, buf, len, len, info))
+		return false;
 
-	if (file_header->compression_method == Z_DEFLATED) {
-		int ret = uncompressData(data_start_ptr, compressed_size, const_cast<char*>(out.data()), uncompressed_size);
+	entry.data = buf + info.data_offset;
+	entry.crc = info.crc;
+	entry.compressed_size = info.compressed_size;
+	entry.uncompressed_size = info.uncompressed_size;
+	entry.deflated = info.deflated;
+	return true;
+}
+
+static std::atomic<SimpleZip::InflateEngine> inflate_engine(SimpleZip::INFLATE_FAST);
+
+void SimpleZip::setInflateEngine(InflateEngine engine) {
+	inflate_engine = engine;
+}
+
+SimpleZip::InflateEngine SimpleZip::inflateEngine() {
+	return inflate_engine;
+}
+
+bool SimpleZip::inflateEntry(const Entry& entry, char* out) {
 
-		if (ret < 0 || ret != uncompressed_size) {
-			puts("erro while decompresing\n");
+	const InflateEngine engine = inflate_engine;
+	const bool fast = engine != INFLATE_ZLIB &&
+		FastInflate::decode(entry.data, entry.compressed_size, out, entry.uncompressed_size);
+	if (fast && engine == INFLATE_FAST)
+		return true;
+
+	if (fast) {
+		// Checked: zlib inflates it once more and the outputs must be the same
+		std::unique_ptr<char[]> check(new char[entry.uncompressed_size + 1]);
+		int ret = uncompressData(entry.data, entry.compressed_size, check.get(), entry.uncompressed_size);
+		if (ret < 0 || size_t(ret) != entry.uncompressed_size || memcmp(check.get(), out, entry.uncompressed_size) != 0) {
+			puts("fast inflate and zlib disagree\n");
 			return false;
 		}
+		return true;
+	}
+
+	int ret = uncompressData(entry.data, entry.compressed_size, out, entry.uncompressed_size);
+
+	if (ret < 0 || size_t(ret) != entry.uncompressed_size) {
+		puts("erro while decompresing\n");
+		return false;
+	}
+	if (engine == INFLATE_CHECKED) {
+		puts("fast inflate refused data zlib takes\n");
+		return false;
+	}
+	return true;
+}
+
+bool SimpleZip::inflate(const char* in, size_t in_len, char* out, size_t out_len) {
+
+	Entry entry;
+	entry.data = in;
+	entry.compressed_size = in_len;
+	entry.uncompressed_size = out_len;
+	entry.crc = 0;
+	entry.deflated = true;
+	return inflateEntry(entry, out);
+}
+
+bool SimpleZip::unzip(const std::string& in, std::string& out) {
+
+	Entry entry;
+	if (!findEntry(in.data(), in.size(), entry))
+		return false;
+
+	out.resize(entry.uncompressed_size);
+
+	if (entry.deflated) {
+		if (!inflateEntry(entry, &out[0]))
+			return false;
 	}
 	else { // NO COMPRESSION
 		puts("there no compresson\n");
-		memcpy(const_cast<char*>(out.data()), data_start_ptr,compressed_size);
+		memcpy(&out[0], entry.data, entry.compressed_size);
+	}
+
+	unsigned long  crc = Crc32::update(0, out.data(), entry.uncompressed_size);
+	if (crc != entry.crc) {
+		puts("wrong crc\n");
+		return false;
 	}
 
-	unsigned long  crc = crc32(0L, (const unsigned char*)out.data(), uncompressed_size);
-	if (crc != file_crc) {
+	return true;
+}
+
+bool SimpleZip::unzip(const CellBuffer& in, CellBuffer& out) {
+
+	Entry entry;
+	if (!findEntry(in.data(), in.size(), entry))
+		return false;
+
+	CellBuffer result;
+	if (entry.deflated) {
+		// Inflate overwrites every byte, no need to zero them first
+		char* data;
+		result = CellBuffer::allocate(entry.uncompressed_size, data);
+		if (!inflateEntry(entry, data))
+			return false;
+	}
+	else {
+		result = in.view(entry.data - in.data(), entry.uncompressed_size);
+	}
+
+	unsigned long  crc = Crc32::update(0, result.data(), entry.uncompressed_size);
+	if (crc != entry.crc) {
 		puts("wrong crc\n");
 		return false;
 	}
-	
+
+	out = std::move(result);
+	return true;
 }
 
 bool SimpleZip::zip(const std::string& filename, const std::string& in, std::string& out) {
@@ -277,14 +461,18 @@ bool SimpleZip::zip(const std::string& filename, const std::string& in, std::str
 		return false;
 	}
 
-	unsigned long  crc = crc32(0L, (const unsigned char*)in.data(), in.size());
-	string compressed;
-	int res = compressData(in.data(),in.size(), compressed);
+	// The local header goes first and is filled in once the data is compressed after it
+	const size_t start = out.size();
+	out.resize(start + sizeof(FileHeader));
+	out.append(filename.data(), filename.size());
+	const size_t data_start = out.size();
 
-	if (res != Z_OK) {
+	uint32_t crc;
+	if (!compressData(in, out, crc)) {
+		out.resize(start);
 		return false;
 	}
-
+	const size_t compressed_size = out.size() - data_start;
 
 	FileHeader file_header;
 	file_header.version_to_extract = 20; 
@@ -292,14 +480,12 @@ bool SimpleZip::zip(const std::string& filename, const std::string& in, std::str
 	file_header.compression_method = 8;
 	file_header.last_modification_dostime = getCurrentDateTime();
 	file_header.crc32 = crc;
-	file_header.compressed_size = compressed.size();
+	file_header.compressed_size = compressed_size;
 	file_header.uncompressed_size = in.size();
 	file_header.filename_len = filename.size();
 	file_header.extra_field_len = 0;
 
-	out.append(reinterpret_cast<char*>(&file_header),sizeof(FileHeader));
-	out.append(filename.data(), filename.size());
-	out.append(compressed.data(), compressed.size());
+	memcpy(&out[start], &file_header, sizeof(FileHeader));
 
 	CentralDirRecord central_dir;
 	central_dir.version_to_extract = file_header.version_to_extract;
@@ -328,7 +514,7 @@ bool SimpleZip::zip(const std::string& filename, const std::string& in, std::str
 	eocd.n_CD = 1;
 	eocd.n_CD_total = 1;
 	eocd.CD_size = sizeof(CentralDirRecord)+central_dir.filename_len;
-	eocd.CD_start_offset = sizeof(FileHeader)+filename.size()+compressed.size();
+	eocd.CD_start_offset = sizeof(FileHeader)+filename.size()+compressed_size;
 	eocd.comment_len = 0;
 
 	out.append(reinterpret_cast<char*>(&eocd), sizeof(EOCD));
@@ -336,6 +522,216 @@ bool SimpleZip::zip(const std::string& filename, const std::string& in, std::str
 	return true;
 }
 
+SimpleUnzipStream::SimpleUnzipStream(Sink sink) : m_sink(std::move(sink)), m_target(&m_sink) {
+}
+
+void SimpleUnzipStream::reset(const Sink& sink) {
+
+	m_target = &sink;
+	m_state = HEADER;
+	m_pending.clear();
+	m_skip = 0;
+	m_flags = 0;
+	m_method = 0;
+	m_header_crc = 0;
+	m_compressed = 0;
+	m_header_size = 0;
+	m_crc = 0;
+	m_size = 0;
+}
+
+SimpleUnzipStream::~SimpleUnzipStream() {
+
+	if (m_zs) {
+		inflateEnd(static_cast<z_stream*>(m_zs));
+		delete static_cast<z_stream*>(m_zs);
+	}
+}
+
+bool SimpleUnzipStream::fail(const char* msg) {
+
+	puts(msg);
+	m_state = FAILED;
+	return false;
+}
+
+bool SimpleUnzipStream::emit(const char* data, size_t len) {
+
+	m_crc = Crc32::update(m_crc, data, len);
+	m_size += len;
+	return (*m_target)(data, len);
+}
+
+bool SimpleUnzipStream::write(const char* data, size_t len) {
+
+	while (len && m_state != FAILED) {
+
+		size_t used = 0;
+		switch (m_state) {
+		case HEADER:
+			used = header(data, len);
+			break;
+		case NAME:
+			used = std::min(m_skip, len);
+			m_skip -= used;
+			if (m_skip == 0)
+				m_state = DATA;
+			break;
+		case DATA:
+			used = inflateData(data, len);
+			break;
+		case TAIL:
+			// Descriptor and central directory, only the first record is needed
+			used = m_pending.size() < MAX_TAIL ? std::min<size_t>(len, MAX_TAIL - m_pending.size()) : 0;
+			m_pending.append(data, used);
+			used = len;
+			break;
+		default:
+			break;
+		}
+		data += used;
+		len -= used;
+	}
+	return m_state != FAILED;
+}
+
+size_t SimpleUnzipStream::header(const char* data, size_t len) {
+
+	size_t used = std::min(len, sizeof(FileHeader) - m_pending.size());
+	m_pending.append(data, used);
+	if (m_pending.size() < sizeof(FileHeader))
+		return used;
+
+	FileHeader file_header;
+	memcpy(&file_header, m_pending.data(), sizeof(FileHeader));
+	m_pending.clear();
+
+	if (file_header.signature != ZIP_LOCAL_HEADER_SIGNATURE) {
+		fail("wrong zip signature\n");
+		return used;
+	}
+	m_method = file_header.compression_method;
+	m_flags = file_header.gp_flag;
+	m_header_crc = file_header.crc32;
+	m_compressed = file_header.compressed_size;
+	m_header_size = file_header.uncompressed_size;
+
+	if (m_method == Z_DEFLATED) {
+		if (m_zs) {
+			inflateReset(static_cast<z_stream*>(m_zs));
+		}
+		else {
+			z_stream* zs = new z_stream();
+			if (inflateInit2(zs, -MAX_WBITS) != Z_OK) {
+				delete zs;
+				fail("erro while decompresing\n");
+				return used;
+			}
+			m_zs = zs;
+		}
+		m_out.resize(OUT_SIZE);
+	}
+	else if (m_method == Z_NO_COMPRESSION) {
+		// Stored data has no end marker, its size must be known up front
+		if ((m_flags & ZIP_SIZE_UNKNOWN) || m_compressed != m_header_size) {
+			fail("stored entry of unknown size\n");
+			return used;
+		}
+	}
+	else {
+		fail("unsupported compression method\n");
+		return used;
+	}
+
+	m_skip = size_t(file_header.filename_len) + file_header.extra_field_len;
+	m_state = m_skip ? NAME : DATA;
+	return used;
+}
+
+size_t SimpleUnzipStream::inflateData(const char* data, size_t len) {
+
+	if (m_method == Z_NO_COMPRESSION) {
+		size_t used = static_cast<size_t>(std::min<uint64_t>(len, m_compressed));
+		m_compressed -= used;
+		if (!emit(data, used))
+			fail("output error\n");
+		else if (m_compressed == 0)
+			m_state = TAIL;
+		return used;
+	}
+
+	z_stream* zs = static_cast<z_stream*>(m_zs);
+	zs->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+	zs->avail_in = static_cast<uInt>(std::min<size_t>(len, UINT_MAX));
+	const size_t avail = zs->avail_in;
+
+	for (;;) {
+		zs->next_out = reinterpret_cast<Bytef*>(&m_out[0]);
+		zs->avail_out = static_cast<uInt>(m_out.size());
+		int ret = inflate(zs, Z_NO_FLUSH);
+		size_t produced = m_out.size() - zs->avail_out;
+		if (produced && !emit(m_out.data(), produced)) {
+			fail("output error\n");
+			break;
+		}
+		if (ret == Z_STREAM_END) {
+			// Deflate data ends by itself, no matter whether its size is known
+			m_state = TAIL;
+			break;
+		}
+		if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			fail("erro while decompresing\n");
+			break;
+		}
+		if (zs->avail_in == 0 && zs->avail_out != 0)
+			break;
+	}
+	return avail - zs->avail_in;
+}
+
+bool SimpleUnzipStream::finish() {
+
+	if (m_state == FAILED)
+		return false;
+	if (m_state != TAIL)
+		return fail("unexpected end of zip data\n");
+
+	uint32_t file_crc = m_header_crc;
+	uint64_t file_size = m_header_size;
+	const char* tail = m_pending.data();
+	size_t tail_len = m_pending.size();
+
+	if (m_flags & ZIP_SIZE_UNKNOWN) {
+		// Data descriptor, the signature is optional
+		uint32_t descriptor[4];
+		size_t n = std::min(tail_len, sizeof(descriptor));
+		memset(descriptor, 0, sizeof(descriptor));
+		memcpy(descriptor, tail, n);
+		const uint32_t* d = descriptor[0] == ZIP_DATA_DESCRIPTOR_SIGNATURE ? descriptor + 1 : descriptor;
+		if (n < size_t(reinterpret_cast<const char*>(d + 3) - reinterpret_cast<const char*>(descriptor)))
+			return fail("wrong data descriptor\n");
+		file_crc = d[0];
+		file_size = d[2];
+	}
+	else if (file_size == 0 && m_header_crc == 0 && m_size != 0) {
+		// Sizes are left out of the local header, take them from the central directory right after the data
+		CentralDirRecord cd;
+		if (tail_len < sizeof(cd))
+			return fail("cant find central dir record\n");
+		memcpy(&cd, tail, sizeof(cd));
+		if (cd.signature != ZIP_CENTRAL_DIR_SIGNATURE)
+			return fail("wrong central dir signature\n");
+		file_crc = cd.crc32;
+		file_size = cd.uncompressed_size;
+	}
+
+	if (file_size != (m_size & 0xffffffff))
+		return fail("erro while decompresing\n");
+	if (m_crc != file_crc)
+		return fail("wrong crc\n");
+	return true;
+}
+
 //void SimpleUnzipper::zipInfo(const std::string& path) {
 //
 //	
@@ -434,19 +830,19 @@ bool SimpleZip::zip(const std::string& filename, const std::string& in, std::str
 
 const char* SimpleZip::findEOCD(const char* buf, size_t len) {
 
-	// First of all seek to the end of the buffer minus size of EOCD record size (except signature)
+	// The record is at the very end, unless the archive has a comment of up to 64KB after it.
 	// There is no use start searching from very end
-	buf += (len-18);
-	const char* start_pos = buf;
-	const size_t max_comment_size = USHRT_MAX;
-	while ((start_pos - buf) < max_comment_size) {
-		if (*(buf--) == 0x06)
-			if (*(buf--) == 0x05)
-				if (*(buf--) == 0x4b)
-					if (*(buf--) == 0x50)
-						return buf+1;
-	}
-
-	return nullptr;
+	if (len < sizeof(EOCD))
+		return nullptr;
+	size_t pos = len - sizeof(EOCD);
+	const size_t stop = pos > USHRT_MAX ? pos - USHRT_MAX : 0;
+	for (;; --pos) {
+		uint32_t signature;
+		memcpy(&signature, buf + pos, sizeof(signature));
+		if (signature == ZIP_EOCD_RECORD_SIGNATURE)
+			return buf + pos;
+		if (pos == stop)
+			return nullptr;
+	}
 }
 
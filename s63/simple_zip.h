@@ -24,8 +24,11 @@
  */
 
 #include <cstdint>
+#include <functional>
 #include <string>
 
+#include "cell_buffer.h"
+
 //This class is not a fully functional zip implementation.
 //It was designed to a very specific purpose: zip and unzip 
 //a single ENC Cell, according to the S63 standart.
@@ -36,11 +39,98 @@ class SimpleZip
 public:
 	// Uncompress a zip file from one buffer(in) into another(out)
 	static bool unzip(const std::string& in, std::string& out);
+	// Same, but a deflated entry is inflated straight into an uninitialized buffer
+	// and a stored one is returned as a view into in, without a copy
+	static bool unzip(const CellBuffer& in, CellBuffer& out);
+	// How unzip() inflates a deflated entry. FAST uses FastInflate, which knows the size of the
+	// output up front, and falls back to zlib for data it refuses. CHECKED runs both and fails
+	// unless they agree, to try the fast one on real cells.
+	enum InflateEngine { INFLATE_FAST, INFLATE_ZLIB, INFLATE_CHECKED };
+	static void setInflateEngine(InflateEngine engine);
+	static InflateEngine inflateEngine();
+	// Inflates a raw deflate stream of exactly out_len bytes with the engine above, as unzip() does
+	static bool inflate(const char* in, size_t in_len, char* out, size_t out_len);
 	// Compress a buffer(in) with a given filename to a zip archive buffer(out) 
 	static bool zip(const std::string& filename, const std::string& in, std::string& out);
 	//void zipInfo(const std::string& path);
 
+	// Where the data of the single entry is and its sizes
+	struct EntryInfo {
+		uint64_t data_offset;
+		uint64_t compressed_size;
+		uint64_t uncompressed_size;
+		uint32_t crc;
+		bool deflated;
+	};
+	// Same as unzip() reads, for an archive of len bytes which is not in memory as a whole:
+	// head holds its first bytes, tail its last ones. The tail is only used when the sizes are
+	// not in the local header and have to be taken from the central directory.
+	static bool entryInfo(const char* head, size_t head_len, const char* tail, size_t tail_len, size_t len, EntryInfo& info);
+
 private:
+	struct Entry {
+		const char* data;
+		size_t compressed_size;
+		size_t uncompressed_size;
+		uint32_t crc;
+		bool deflated;
+	};
+	static bool findEntry(const char* buf, size_t len, Entry& entry);
+	static bool inflateEntry(const Entry& entry, char* out);
 	static const char* findEOCD(const char* buf, size_t len);
 };
 
+
+// Push based unzipper for a single ENC Cell archive which arrives in chunks.
+// Inflated data goes to the sink as soon as it is produced, so memory use does not depend on the cell size.
+// CRC32 and size are checked at the end against the local header, the data descriptor
+// (entries written with unknown sizes) or the central directory, whichever carries them.
+class SimpleUnzipStream
+{
+public:
+	// The sink returns false to abort
+	using Sink = std::function<bool(const char* data, size_t len)>;
+
+	explicit SimpleUnzipStream(Sink sink);
+	~SimpleUnzipStream();
+	SimpleUnzipStream(const SimpleUnzipStream&) = delete;
+	SimpleUnzipStream& operator=(const SimpleUnzipStream&) = delete;
+
+	// Starts over with the next archive, keeping the buffers and the inflate state (inflateReset
+	// instead of a new inflateInit2). The sink is not copied, it must outlive the use of the stream.
+	void reset(const Sink& sink);
+
+	// Feeds the next bytes of the archive
+	bool write(const char* data, size_t len);
+	// Call after the last write(), checks that the entry is complete and valid
+	bool finish();
+
+	// Uncompressed bytes passed to the sink so far
+	uint64_t size() const { return m_size; }
+
+private:
+	enum State { HEADER, NAME, DATA, TAIL, FAILED };
+
+	bool fail(const char* msg);
+	bool emit(const char* data, size_t len);
+	size_t header(const char* data, size_t len);
+	size_t inflateData(const char* data, size_t len);
+
+	static const size_t OUT_SIZE = 64 * 1024;
+	static const size_t MAX_TAIL = 64 * 1024;
+
+	Sink m_sink;
+	const Sink* m_target;	// m_sink, or the sink given to reset()
+	State m_state = HEADER;
+	std::string m_pending;	// header bytes, then everything after the compressed data
+	size_t m_skip = 0;
+	uint16_t m_flags = 0;
+	uint16_t m_method = 0;
+	uint32_t m_header_crc = 0;
+	uint64_t m_compressed = 0;
+	uint64_t m_header_size = 0;
+	uint32_t m_crc = 0;
+	uint64_t m_size = 0;
+	void* m_zs = nullptr;	// z_stream, zlib.h is not exposed from here
+	std::string m_out;
+};
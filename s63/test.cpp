@@ -1,11 +1,33 @@
 #include <iostream>
 #include <fstream>
 #include <cassert>
+#include <cstring>
+#include <filesystem>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+#include <stdexcept>
 
 #include "blowfish.h"
+#include "blowfish_simd.h"
+#include "blowfish_cache.h"
+#include "thread_pool.h"
+#include "buffer_pool.h"
+#include "cell_loader.h"
+#include "cell_pack.h"
+#include "cell_reader.h"
+#include "crc32_simd.h"
+#include "fast_inflate.h"
 #include "s63client.h"
 #include "simple_zip.h"
+#include "zip_archive.h"
+#include "iso8211.h"
+#include "s57update.h"
 #include "s63utils.hpp"
+#include "zlib/zlib.h"
 
 
 using namespace std;
@@ -20,6 +42,145 @@ static void testBlowFish() {
 
 	assert(test_text == decrypted);
 
+	// Known answer tests from Eric Young's test vectors (key, plain, cipher)
+	const char* vectors[][3] = {
+		{"0000000000000000", "0000000000000000", "4EF997456198DD78"},
+		{"FFFFFFFFFFFFFFFF", "FFFFFFFFFFFFFFFF", "51866FD5B85ECB8A"},
+		{"3000000000000000", "1000000000000001", "7D856F9A613063F2"},
+	};
+	for (const auto& v : vectors) {
+		CBlowFish kat(hex_to_string(v[0]));
+		assert(string_to_hex(kat.encryptConst(hex_to_string(v[1]))) == v[2]);
+		assert(string_to_hex(kat.decryptConst(hex_to_string(v[2]), false)) == v[1]);
+	}
+
+	// Bulk ECB path must match block by block processing, including the tail blocks
+	string bulk(8 * 13, 0);
+	for (size_t i = 0; i < bulk.size(); ++i)
+		bulk[i] = static_cast<char>(i * 7 + 3);
+	string blocks = bulk;
+	bf.decrypt(reinterpret_cast<unsigned char*>(&bulk[0]), bulk.size());
+	for (size_t i = 0; i < blocks.size(); i += 8)
+		bf.decrypt(reinterpret_cast<unsigned char*>(&blocks[i]), 8);
+	assert(bulk == blocks);
+
+	// Pointer API pads in place and reports the padding as a length
+	unsigned char raw[16] = "0123456789";
+	size_t padded = CBlowFish::pad(raw, 10);
+	assert(padded == CBlowFish::paddedSize(10) && padded == 16);
+	unsigned char cipher[16];
+	bf.encrypt(raw, cipher, padded);
+	assert(string(reinterpret_cast<char*>(cipher), 16) == bf.encryptConst("0123456789"));
+	bf.decrypt(cipher, padded);
+	assert(padded - CBlowFish::paddingLength(cipher, padded) == 10);
+	assert(memcmp(cipher, "0123456789", 10) == 0);
+
+	// Every vector engine available on this machine must be byte-identical to the scalar code
+	string plain(8 * 101, 0);
+	for (size_t i = 0; i < plain.size(); ++i)
+		plain[i] = static_cast<char>(i * 13 + 5);
+	const BlowFishSimd::Isa best = BlowFishSimd::isa();
+	BlowFishSimd::setIsa(BlowFishSimd::ISA_SCALAR);
+	const string scalar = bf.encryptConst(plain);
+	for (auto isa : { BlowFishSimd::ISA_AVX2, BlowFishSimd::ISA_AVX512 }) {
+		if (BlowFishSimd::setIsa(isa) != isa)
+			continue;
+		assert(bf.encryptConst(plain) == scalar);
+		assert(bf.decryptConst(scalar, false) == plain);
+	}
+	// Batched key expansion must give the same schedules as setKey, keys of any length
+	std::vector<string> key_strings;
+	for (int k = 0; k < 37; ++k)
+		key_strings.push_back(plain.substr(k, k * 3 % 60 + 1));
+	for (auto isa : { BlowFishSimd::ISA_SCALAR, BlowFishSimd::ISA_AVX2, BlowFishSimd::ISA_AVX512 }) {
+		if (BlowFishSimd::setIsa(isa) != isa)
+			continue;
+		std::vector<CBlowFish> batch(key_strings.size());
+		CBlowFish::setKeys(batch.data(), key_strings.data(), key_strings.size());
+		for (size_t k = 0; k < batch.size(); ++k)
+			assert(batch[k].encryptConst(plain) == CBlowFish(key_strings[k]).encryptConst(plain));
+	}
+	BlowFishSimd::setIsa(best);
+
+	// Multi-buffer engine: jobs of different lengths and keys, more jobs than lanes
+	std::vector<CBlowFish> keys;
+	for (int k = 0; k < 37; ++k)
+		keys.emplace_back("key" + std::to_string(k));
+	std::vector<string> expected(keys.size());
+	for (size_t k = 0; k < keys.size(); ++k)
+		expected[k] = keys[k].decryptConst(plain.substr(0, 8 * (k * 5 % 23 + 1)), false);
+	for (auto isa : { BlowFishSimd::ISA_SCALAR, BlowFishSimd::ISA_AVX2, BlowFishSimd::ISA_AVX512 }) {
+		if (BlowFishSimd::setIsa(isa) != isa)
+			continue;
+		std::vector<string> bufs(keys.size());
+		BlowFishMultiBuffer mb;
+		for (size_t k = 0; k < keys.size(); ++k) {
+			bufs[k] = plain.substr(0, 8 * (k * 5 % 23 + 1));
+			mb.add(keys[k], reinterpret_cast<unsigned char*>(&bufs[k][0]), bufs[k].size());
+		}
+		mb.decrypt();
+		assert(bufs == expected && mb.size() == 0);
+		for (size_t k = 0; k < keys.size(); ++k)
+			mb.add(keys[k], reinterpret_cast<unsigned char*>(&bufs[k][0]), bufs[k].size());
+		mb.encrypt();
+		for (size_t k = 0; k < keys.size(); ++k)
+			assert(bufs[k] == plain.substr(0, bufs[k].size()));
+	}
+	BlowFishSimd::setIsa(best);
+
+}
+
+static void testKeyCache() {
+
+	CBlowFishCache cache;
+	auto first = cache.get("12348");
+	assert(cache.get("12348") == first);
+	assert(cache.hits() == 1 && cache.misses() == 1);
+
+	// Cached schedule must be the same as a freshly expanded one
+	string data(64, 'x');
+	assert(first->encryptConst(data) == CBlowFish("12348").encryptConst(data));
+
+	// Budget for about two schedules, the least recently used one goes first
+	cache.setBudget(cache.size() * 2);
+	cache.get("98765");
+	cache.get("12348");
+	cache.get("C1CB5");
+	assert(cache.get("12348") == first);
+	assert(cache.misses() == 3);
+	cache.get("98765");
+	assert(cache.misses() == 4);
+
+}
+
+static void testCrc32() {
+
+	const string check = "123456789";
+	assert(Crc32::update(0, check.data(), check.size()) == 0xcbf43926);
+	assert(Crc32::update(0, nullptr, 0) == 0);
+
+	// Every engine available on this machine must give what zlib gives: all the lengths around the
+	// folding steps, unaligned starts, and a CRC continued over several calls
+	string data(5000, 0);
+	for (size_t i = 0; i < data.size(); ++i)
+		data[i] = static_cast<char>(i * 131 + (i >> 7));
+	const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data.data());
+	const Crc32::Isa best = Crc32::isa();
+	for (auto isa : { Crc32::ISA_SCALAR, Crc32::ISA_PCLMUL, Crc32::ISA_VPCLMUL }) {
+		if (Crc32::setIsa(isa) != isa)
+			continue;
+		for (size_t offset = 0; offset < 4; ++offset) {
+			for (size_t len = 0; len + offset <= data.size(); len += len < 600 ? 1 : 97) {
+				const uint32_t seed = static_cast<uint32_t>(len * 2654435761u);
+				assert(Crc32::update(seed, bytes + offset, len) == crc32(seed, bytes + offset, uInt(len)));
+			}
+		}
+		uint32_t crc = 0;
+		for (size_t pos = 0, step = 1; pos < data.size(); pos += step, step = step * 3 % 1021)
+			crc = Crc32::update(crc, bytes + pos, std::min(step, data.size() - pos));
+		assert(crc == crc32(0L, bytes, uInt(data.size())));
+	}
+	Crc32::setIsa(best);
 }
 
 static void testS63() {
@@ -33,6 +194,8 @@ static void testS63() {
 	string test_cellname = "NO4D0613";
 	string test_expiry_date = "20000830";
 	string test_cellpermit = "NO4D061320000830BEB9BFE3C7C6CE68B16411FD09F96982795C77B204F54D48";
+	using key_pair = std::pair<string, string>;
+	const string ck_wrong = hex_to_string("0102030405");
 
 	assert(S63::createUserPermit(test_m_key, test_hw_id, test_m_id) == test_userpermit);
 	assert(S63::extractHwIdFromUserpermit(test_userpermit, test_m_key) == test_hw_id);
@@ -44,6 +207,419 @@ static void testS63() {
 	assert(cell_keys.first == hex_to_string(test_ck1_hex));
 	assert(cell_keys.second == hex_to_string(test_ck2_hex));
 
+	// Bulk permits match the single ones, an invalid HW_ID gives an empty row
+	std::vector<string> hw_ids = { test_hw_id, "1234" };
+	for (int i = 0; i < 40; ++i)
+		hw_ids.push_back(n2hexstr(uint32_t(0x10000 + i * 977)).substr(3));
+	std::vector<S63PermitCell> permit_cells = {
+		{ test_cellname, hex_to_string(test_ck1_hex), hex_to_string(test_ck2_hex), test_expiry_date },
+		{ "GB100001", hex_to_string(test_ck2_hex), hex_to_string(test_ck1_hex), "20991231" },
+	};
+	auto permits = S63::createCellPermits(hw_ids, permit_cells);
+	assert(permits.size() == hw_ids.size() * 2 && permits[0] == test_cellpermit);
+	assert(permits[2].empty() && permits[3].empty());
+	for (size_t h = 0; h < hw_ids.size(); ++h) {
+		if (h == 1)
+			continue;
+		for (size_t c = 0; c < permit_cells.size(); ++c) {
+			const S63PermitCell& pc = permit_cells[c];
+			assert(permits[h * 2 + c] == S63::createCellPermit(hw_ids[h], pc.CK1, pc.CK2, pc.cellname, pc.expiry_date));
+		}
+	}
+
+	// Encrypted cell round trip, a wrong key must be detected on the first block
+	string cell;
+	assert(SimpleZip::zip(test_cellname + ".000", "Some S57 content of a test cell", cell));
+	string zipped = cell;
+	S63::encryptCell(cell, cell_keys.first);
+	string wrong_key = cell;
+	assert(S63::decryptCell(wrong_key, cell_keys.second) == S63_ERR_KEY);
+	assert(S63::decryptCell(cell, cell_keys.first) == S63_ERR_OK);
+	assert(cell == zipped);
+
+	// Batch decryption, every cell with its own keys, one of them with a key from the second slot
+	std::vector<string> cells(9);
+	std::vector<S63CellJob> jobs(cells.size());
+	for (size_t i = 0; i < cells.size(); ++i) {
+		assert(SimpleZip::zip(test_cellname + ".00" + std::to_string(i), string(100 * i + 1, 'a' + i), cells[i]));
+		string key = hex_to_string("C1CB518E" + string_to_hex(string(1, char(i))));
+		jobs[i].buf = &cells[i];
+		jobs[i].keys = i == 3 ? key_pair(ck_wrong, key) : key_pair(key, ck_wrong);
+		S63::encryptCell(cells[i], key);
+	}
+	string expected_cell = cells[5];
+	jobs[7].keys = key_pair(ck_wrong, ck_wrong);
+	S63::decryptCells(jobs);
+	for (size_t i = 0; i < cells.size(); ++i) {
+		if (i == 7) {
+			assert(jobs[i].result == S63_ERR_KEY);
+			continue;
+		}
+		assert(jobs[i].result == S63_ERR_OK);
+		string unzipped;
+		assert(SimpleZip::unzip(cells[i], unzipped) && unzipped == string(100 * i + 1, 'a' + i));
+	}
+	assert(S63::decryptCell(expected_cell, jobs[5].keys.first) == S63_ERR_OK && expected_cell == cells[5]);
+
+	// Streaming decryption from a file, bigger than one read chunk
+	string content;
+	for (int i = 0; i < 50000; ++i)
+		content += std::to_string(i * 48271LL % 65537);
+	string stream_cell;
+	assert(SimpleZip::zip(test_cellname + ".000", content, stream_cell));
+	S63::encryptCell(stream_cell, cell_keys.second);
+	const string in_path = "test_stream_cell.000", out_path = "test_stream_cell.s57";
+	std::ofstream(in_path, std::ios::binary).write(stream_cell.data(), stream_cell.size());
+	assert(S63::decryptAndUnzipCellByKey(in_path, cell_keys, out_path) == S63_ERR_OK);
+	std::ifstream out_file(out_path, std::ios::binary);
+	assert(string(std::istreambuf_iterator<char>(out_file), std::istreambuf_iterator<char>()) == content);
+	out_file.close();
+	std::remove(out_path.c_str());
+	assert(S63::decryptAndUnzipCellByKey(in_path, key_pair(ck_wrong, ck_wrong), out_path) == S63_ERR_KEY);
+	assert(!std::ifstream(out_path).is_open());
+	size_t streamed = 0;
+	assert(S63::decryptAndUnzipCellStream(in_path, cell_keys, [&](const char*, size_t len) { streamed += len; return true; }) == S63_ERR_OK);
+	assert(streamed == content.size());
+	string whole, unzipped_whole;
+	assert(S63::decryptCell(in_path, cell_keys, whole) == S63_ERR_OK);
+	assert(SimpleZip::unzip(whole, unzipped_whole) && unzipped_whole == content);
+	std::remove(in_path.c_str());
+
+	// Files above the threshold are mapped, smaller ones read into the reused buffer
+	for (size_t size : { size_t(100), MappedFile::MAP_THRESHOLD + 8 }) {
+		string data(size, 0);
+		for (size_t i = 0; i < size; ++i)
+			data[i] = static_cast<char>(i * 131);
+		std::ofstream(in_path, std::ios::binary).write(data.data(), data.size());
+		MappedFile file;
+		assert(file.open(in_path) && file.size() == size && file.isMapped() == (size >= MappedFile::MAP_THRESHOLD));
+		assert(memcmp(file.data(), data.data(), size) == 0);
+		file.close();
+		std::remove(in_path.c_str());
+	}
+	MappedFile missing;
+	assert(!missing.open("no_such_cell.000") && missing.size() == 0);
+
+	// Client keeps the cell keys of the installed permits and remembers which one works:
+	// a cell encrypted with CK2 fails on CK1 only once
+	S63Client client(test_hw_id, test_m_key, test_m_id);
+	assert(client.installCellPermit(S63::createCellPermit(test_hw_id, hex_to_string(test_ck1_hex),
+		hex_to_string(test_ck2_hex), "GB100001", "20991231")));
+	string client_cell;
+	assert(SimpleZip::zip("GB100001.000", content, client_cell));
+	S63::encryptCell(client_cell, hex_to_string(test_ck2_hex));
+	const string client_path = "GB100001.000";
+	std::ofstream(client_path, std::ios::binary).write(client_cell.data(), client_cell.size());
+	S63Context client_ctx;
+	assert(client.open(client_path, client_ctx) == content && client_ctx.lastKey() == 1);
+	assert(client.open(client_path, client_ctx) == content && client_ctx.lastKey() == 0);
+	assert(client.decryptAndUnzipCell(client_path, out_path, client_ctx) == S63_ERR_OK && client_ctx.lastKey() == 0);
+	std::remove(out_path.c_str());
+	assert(client.open("XX100001.000", client_ctx).empty());
+
+	// Decoded cells are cached once there is a budget, a changed file is decoded again
+	S63CellCache& cell_cache = client.cellCache();
+	assert(cell_cache.budget() == 0);
+	cell_cache.setBudget(4 * content.size());
+	assert(client.open(client_path, client_ctx) == content && cell_cache.misses() == 1);
+	assert(client.open(client_path, client_ctx) == content && cell_cache.hits() == 1);
+	assert(cell_cache.size() >= content.size());
+	string changed_cell;
+	assert(SimpleZip::zip("GB100001.000", content + "!", changed_cell));
+	S63::encryptCell(changed_cell, hex_to_string(test_ck2_hex));
+	std::ofstream(client_path, std::ios::binary | std::ios::trunc).write(changed_cell.data(), changed_cell.size());
+	assert(client.open(client_path, client_ctx) == content + "!" && cell_cache.misses() == 2);
+	assert(client.open(client_path, client_ctx) == content + "!" && cell_cache.hits() == 2);
+
+	// Cells out of the hot share are kept as their zip and inflated on a hit, until they are hit often enough
+	const string changed = content + "!";
+	cell_cache.setHotShare(0);
+	assert(cell_cache.hotSize() == 0 && cell_cache.size() > 0 && cell_cache.size() < content.size());
+	assert(client.open(client_path, client_ctx) == changed && cell_cache.warmHits() == 1);
+	cell_cache.setHotShare(100);
+	assert(cell_cache.hotSize() == 0);
+	assert(client.open(client_path, client_ctx) == changed && cell_cache.warmHits() == 2);
+	assert(cell_cache.hotSize() == changed.size());
+	assert(client.open(client_path, client_ctx) == changed && cell_cache.warmHits() == 2 && cell_cache.hits() == 5);
+	cell_cache.setBudget(100);
+	assert(cell_cache.size() == 0);
+	assert(client.open(client_path, client_ctx) == changed && cell_cache.size() == 0);
+	cell_cache.setBudget(0);
+
+	// Background opens, the second request for a cell shares the first one
+	client.setAsyncThreads(2);
+	auto tickets = client.openMany({ client_path, client_path, "XX100001.000" }, 1);
+	assert(tickets.size() == 3 && tickets[0].get() == changed && tickets[1].get() == changed);
+	assert(tickets[2].get().empty());
+	std::atomic<bool> delivered(false);
+	auto ticket = client.openAsync(client_path, 0, [&](const string& path, const CellBuffer& cell) {
+		assert(path == client_path && cell == changed);
+		delivered = true;
+	});
+	assert(ticket.get() == changed);
+	while (!delivered)
+		std::this_thread::yield();
+
+	// Random access reader of a cell, with the key that worked
+	auto cell_reader = client.openReader(client_path, client_ctx);
+	assert(cell_reader && cell_reader->size() == changed.size() && client_ctx.lastKey() == 0);
+	std::vector<char> tail(10);
+	assert(cell_reader->seek(changed.size() - tail.size()) && cell_reader->read(tail.data(), tail.size()) == tail.size());
+	assert(string(tail.data(), tail.size()) == changed.substr(changed.size() - tail.size()));
+	assert(!client.openReader("XX100001.000", client_ctx));
+	std::remove(client_path.c_str());
+
+}
+
+static void testCellReader() {
+
+	using key_pair = std::pair<string, string>;
+	const key_pair keys(hex_to_string("0102030405"), hex_to_string("C1CB518E9C"));
+
+	// Compressible, but not so much that the deflate blocks get too long
+	string content;
+	uint32_t seed = 1;
+	while (content.size() < 1500000) {
+		seed = seed * 1103515245 + 12345;
+		content += "Record " + std::to_string(seed % 100000) + (seed & 0x10000 ? " sounding;" : " depth;");
+	}
+	string cell;
+	assert(SimpleZip::zip("GB100002.000", content, cell));
+	S63::encryptCell(cell, keys.second);
+	const string path = "test_reader_cell.000";
+	std::ofstream(path, std::ios::binary).write(cell.data(), cell.size());
+
+	S63CellReader reader;
+	S63Context ctx;
+	assert(reader.open(path, key_pair(keys.first, keys.first), ctx) == S63_ERR_KEY && !reader.isOpen());
+	assert(reader.open(path, keys, ctx) == S63_ERR_OK && ctx.lastKey() == 1);
+	reader.setCheckpointSpan(64 * 1024);
+	assert(reader.size() == content.size());
+
+	// The head of the cell does not inflate the rest of it. The first chunk may end on a block of
+	// the parallel deflate, which gives a checkpoint there.
+	char head[24];
+	assert(reader.read(head, sizeof(head)) == sizeof(head) && string(head, sizeof(head)) == content.substr(0, sizeof(head)));
+	assert(reader.checkpoints() <= 2 && reader.tell() == sizeof(head));
+
+	// Whole cell in pieces of odd sizes, checkpoints are taken on the way
+	string all = string(head, sizeof(head));
+	std::vector<char> piece(7777);
+	for (size_t n; (n = reader.read(piece.data(), piece.size())) != 0; )
+		all.append(piece.data(), n);
+	assert(all == content && !reader.failed());
+	size_t checkpoints = reader.checkpoints();
+	assert(checkpoints > 5);
+
+	// Back and forth from the checkpoints, no new ones on the way
+	for (uint64_t pos : { uint64_t(1000000), uint64_t(5), uint64_t(700000), uint64_t(content.size() - 100), uint64_t(300000), uint64_t(299990) }) {
+		assert(reader.seek(pos));
+		char buf[1000];
+		size_t n = reader.read(buf, sizeof(buf));
+		assert(n == std::min<size_t>(sizeof(buf), content.size() - pos));
+		assert(memcmp(buf, content.data() + pos, n) == 0);
+	}
+	assert(reader.checkpoints() == checkpoints && !reader.failed());
+	assert(reader.seek(content.size()) && reader.read(head, 1) == 0);
+	assert(!reader.seek(content.size() + 1));
+
+	// A seek far ahead in a new reader inflates up to there once
+	S63CellReader ahead;
+	assert(ahead.open(path, keys, ctx) == S63_ERR_OK);
+	assert(ahead.seek(1200000) && ahead.read(head, sizeof(head)) == sizeof(head));
+	assert(string(head, sizeof(head)) == content.substr(1200000, sizeof(head)));
+
+	// istream over the reader
+	{
+		S63CellStreambuf buf(reader, 4096);
+		std::istream in(&buf);
+		in.seekg(123456);
+		string word;
+		in >> word;
+		size_t expected = content.find_first_not_of(' ', 123456);
+		assert(word == content.substr(expected, content.find(' ', expected) - expected));
+		in.seekg(-10, std::ios_base::cur);
+		assert(size_t(in.tellg()) == expected + word.size() - 10);
+		std::vector<char> big(100000);
+		in.seekg(50);
+		assert(in.read(big.data(), big.size()) && memcmp(big.data(), content.data() + 50, big.size()) == 0);
+		assert(size_t(in.tellg()) == 50 + big.size());
+		in.seekg(-5, std::ios_base::end);
+		assert(in.read(big.data(), 10).gcount() == 5 && memcmp(big.data(), content.data() + content.size() - 5, 5) == 0);
+	}
+	// A read past the buffer, then a seek back into what the buffer held before it
+	{
+		assert(reader.seek(0));
+		S63CellStreambuf buf(reader, 16 * 1024);
+		std::istream in(&buf);
+		std::vector<char> big(100000);
+		assert(in.read(big.data(), 10) && in.read(big.data(), big.size()));
+		assert(memcmp(big.data(), content.data() + 10, big.size()) == 0);
+		in.seekg(95000);
+		assert(in.read(big.data(), 100) && memcmp(big.data(), content.data() + 95000, 100) == 0);
+	}
+
+	// Sizes only in the central directory, which is found in the last chunk of the file
+	string described;
+	assert(SimpleZip::zip("GB100002.000", content, described));
+	described[6] |= 0x08;
+	memset(&described[14], 0, 12);
+	S63::encryptCell(described, keys.second);
+	std::ofstream(path, std::ios::binary | std::ios::trunc).write(described.data(), described.size());
+	S63CellReader no_sizes;
+	assert(no_sizes.open(path, keys, ctx) == S63_ERR_OK && no_sizes.size() == content.size());
+	assert(no_sizes.seek(content.size() - 100) && no_sizes.read(piece.data(), 100) == 100);
+	assert(memcmp(piece.data(), content.data() + content.size() - 100, 100) == 0 && !no_sizes.failed());
+
+	// A broken byte in the compressed data fails the reader, at the latest when the CRC32 is checked at the end
+	string broken_zip;
+	assert(SimpleZip::zip("GB100002.000", content, broken_zip));
+	broken_zip[broken_zip.size() / 2] ^= 0x20;
+	S63::encryptCell(broken_zip, keys.second);
+	std::ofstream(path, std::ios::binary | std::ios::trunc).write(broken_zip.data(), broken_zip.size());
+	S63CellReader broken;
+	assert(broken.open(path, keys, ctx) == S63_ERR_OK);
+	all.clear();
+	for (size_t n; (n = broken.read(piece.data(), piece.size())) != 0; )
+		all.append(piece.data(), n);
+	assert(broken.failed() && all != content);
+	std::remove(path.c_str());
+}
+
+static void testThreads() {
+
+	// Every thread works with its own keys, results must not leak between threads
+	const string ck1 = hex_to_string("C1CB518E9C");
+	const string ck2 = hex_to_string("421571CC66");
+	std::vector<std::thread> threads;
+	std::vector<int> failures(4, 0);
+	for (int t = 0; t < 4; ++t) {
+		threads.emplace_back([&, t]() {
+			S63Context ctx;
+			string hw_id = "1234" + std::to_string(t);
+			for (int i = 0; i < 50; ++i) {
+				string permit = S63::createCellPermit(hw_id, ck1, ck2, "NO4D0613", "20991231", ctx);
+				bool ok;
+				auto keys = S63::extractCellKeysFromCellpermit(permit, hw_id, ok);
+				if (!ok || keys.first != ck1 || keys.second != ck2)
+					++failures[t];
+			}
+		});
+	}
+	for (auto& thread : threads)
+		thread.join();
+	for (int f : failures)
+		assert(f == 0);
+
+}
+
+static void testThreadPool() {
+
+	ThreadPool pool(3);
+	std::vector<int> hits(1000, 0);
+	pool.parallelFor(hits.size(), [&](size_t i) { ++hits[i]; });
+	for (int h : hits)
+		assert(h == 1);
+
+	// Nested loops run on the callers when all the workers are busy
+	std::vector<int> nested(64, 0);
+	pool.parallelFor(8, [&](size_t i) {
+		pool.parallelFor(8, [&](size_t j) { ++nested[i * 8 + j]; });
+	});
+	for (int h : nested)
+		assert(h == 1);
+
+	// Tasks submitted from tasks land on the worker's own deque and get stolen by the others
+	std::atomic<int> leaves(0);
+	std::function<void(int)> spawn = [&](int depth) {
+		if (depth == 0) {
+			++leaves;
+			return;
+		}
+		pool.submit([&, depth] { spawn(depth - 1); });
+		pool.submit([&, depth] { spawn(depth - 1); });
+	};
+	spawn(10);
+	pool.wait();
+	assert(leaves == 1024);
+	ThreadPool single_pool(1);
+	single_pool.submit([&] { ++leaves; });
+	single_pool.wait();
+	assert(leaves == 1025);
+
+	bool thrown = false;
+	try {
+		pool.parallelFor(10, [](size_t i) { if (i == 7) throw std::runtime_error("test"); });
+	}
+	catch (const std::runtime_error&) {
+		thrown = true;
+	}
+	assert(thrown);
+
+	// Large cells are split across the shared pool, the result must not depend on it
+	string big(3 * 1024 * 1024 + 13, 0);
+	for (size_t i = 0; i < big.size(); ++i)
+		big[i] = static_cast<char>(i * 31 + (i >> 11));
+	string serial = big, parallel = big;
+	const string key = hex_to_string("C1CB518E9C");
+	S63::setParallelThreshold(0);
+	S63::encryptCell(serial, key);
+	S63::setParallelThreshold(1);
+	S63::encryptCell(parallel, key);
+	assert(parallel == serial);
+	S63::setParallelThreshold(S63::DEFAULT_PARALLEL_THRESHOLD);
+	CBlowFish bf(key);
+	bf.decrypt(reinterpret_cast<unsigned char*>(&serial[0]), serial.size());
+	assert(serial.compare(0, big.size(), big) == 0);
+
+}
+
+static void testCellLoader() {
+	// One worker, held on the first cell until the rest is queued
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool open_gate = false;
+	std::vector<string> opened;
+	CellLoader loader([&](const string& path, S63Context&) {
+		std::unique_lock<std::mutex> lock(mutex);
+		opened.push_back(path);
+		if (path == "gate")
+			cv.wait(lock, [&] { return open_gate; });
+		if (path == "throw")
+			throw std::runtime_error("unreadable cell");
+		return path == "bad" ? CellBuffer() : CellBuffer("cell " + path);
+	}, 1);
+
+	auto gate = loader.request("gate");
+	while (loader.pending() != 0)
+		std::this_thread::yield();
+	std::atomic<int> callbacks(0);
+	auto low = loader.request("low", 0, [&](const string& path, const CellBuffer& cell) {
+		assert(path == "low" && cell == string("cell low"));
+		++callbacks;
+	});
+	auto high = loader.request("high", 5);
+	auto low_again = loader.request("low", 1);	// joins the queued one
+	auto gone = loader.request("gone", 9);
+	auto raised = loader.request("raised", -1);
+	auto bad = loader.request("bad", -5);
+	auto thrown = loader.request("throw", -6);
+	assert(loader.pending() == 6);
+	gone.cancel();
+	raised.setPriority(3);
+	assert(loader.pending() == 5 && gone.ready() && gone.get().empty());
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		open_gate = true;
+	}
+	cv.notify_all();
+
+	assert(low.get() == string("cell low") && low_again.get() == string("cell low"));
+	assert(high.get() == string("cell high") && raised.get() == string("cell raised"));
+	assert(bad.get().empty() && thrown.get().empty() && gate.get() == string("cell gate"));
+	assert(callbacks == 1);
+	std::lock_guard<std::mutex> lock(mutex);
+	assert((opened == std::vector<string>{ "gate", "high", "raised", "low", "bad", "throw" }));
 }
 
 static void testZip() {
@@ -63,16 +639,556 @@ static void testZip() {
 
 	assert(test_unzipped_data == unzipped);
 
+	// Large inputs are deflated in blocks on the pool: the joined stream must give the input back
+	// with both inflate engines, and pack about as well as one stream
+	string text;
+	for (int i = 0; text.size() < 600000; ++i)
+		text += "Feature " + std::to_string(i * 7919 % 100003) + " depth " + std::to_string(i % 97) + ";";
+	for (size_t len : { size_t(128 * 1024), size_t(256 * 1024), size_t(256 * 1024 + 1), text.size() }) {
+		const string part = text.substr(0, len);
+		string part_zip, part_unzipped;
+		assert(zip.zip("part.000", part, part_zip));
+		SimpleZip::setInflateEngine(SimpleZip::INFLATE_CHECKED);
+		assert(zip.unzip(part_zip, part_unzipped) && part_unzipped == part);
+		SimpleZip::setInflateEngine(SimpleZip::INFLATE_FAST);
+
+		string single(compressBound(uLong(len)), 0);
+		uLongf single_len = uLongf(single.size());
+		assert(compress2((Bytef*)&single[0], &single_len, (const Bytef*)part.data(), uLong(len), Z_BEST_COMPRESSION) == Z_OK);
+		assert(part_zip.size() - (30 + 46 + 22 + 2 * 8) < single_len + single_len / 50);
+	}
+
+	// Streaming unzip, fed in pieces of any size
+	string big;
+	for (int i = 0; i < 20000; ++i)
+		big += "Record " + std::to_string(i * 7919 % 10007) + ";";
+	string big_zip;
+	assert(zip.zip("big.000", big, big_zip));
+	for (size_t piece : { size_t(1), size_t(7), size_t(4096), big_zip.size() }) {
+		string streamed;
+		SimpleUnzipStream unz([&](const char* data, size_t len) { streamed.append(data, len); return true; });
+		for (size_t pos = 0; pos < big_zip.size(); pos += piece)
+			assert(unz.write(big_zip.data() + pos, std::min(piece, big_zip.size() - pos)));
+		assert(unz.finish() && streamed == big);
+	}
+
+	// Entry with sizes only in the data descriptor (general purpose flag bit 3)
+	uint32_t compressed_size, crc;
+	memcpy(&crc, &big_zip[14], 4);
+	memcpy(&compressed_size, &big_zip[18], 4);
+	const size_t data_end = 30 + 7 + compressed_size;
+	string described = big_zip.substr(0, data_end);
+	described[6] |= 0x08;
+	memset(&described[14], 0, 12);
+	const uint32_t descriptor[4] = { 0x08074b50, crc, compressed_size, uint32_t(big.size()) };
+	described.append(reinterpret_cast<const char*>(descriptor), sizeof(descriptor));
+	described += big_zip.substr(data_end);
+	uint32_t cd_offset = uint32_t(data_end + sizeof(descriptor));
+	memcpy(&described[described.size() - 6], &cd_offset, 4);
+	assert(zip.unzip(described, unzipped) && unzipped == big);
+	{
+		string streamed;
+		SimpleUnzipStream unz([&](const char* data, size_t len) { streamed.append(data, len); return true; });
+		assert(unz.write(described.data(), described.size()) && unz.finish() && streamed == big);
+	}
+
+	// Corrupted CRC is detected at the end
+	described[data_end + 4] ^= 1;
+	{
+		SimpleUnzipStream unz([](const char*, size_t) { return true; });
+		assert(unz.write(described.data(), described.size()) && !unz.finish());
+	}
+
+	// Shared buffers: a deflated entry is inflated into a new buffer, a stored one is a view into the zip
+	CellBuffer cell_zip(big_zip), cell_out;
+	assert(SimpleZip::unzip(cell_zip, cell_out) && cell_out == big && !cell_out.sharesWith(cell_zip));
+	const string stored_name = "stored.000";
+	uint32_t stored_crc = crc32(0L, reinterpret_cast<const unsigned char*>(big.data()), uInt(big.size()));
+	uint32_t stored_size = uint32_t(big.size());
+	string stored(30, 0);
+	stored[0] = 'P'; stored[1] = 'K'; stored[2] = 3; stored[3] = 4; stored[4] = 20;
+	memcpy(&stored[14], &stored_crc, 4);
+	memcpy(&stored[18], &stored_size, 4);
+	memcpy(&stored[22], &stored_size, 4);
+	stored[26] = char(stored_name.size());
+	stored += stored_name + big;
+	CellBuffer stored_zip(stored);
+	assert(SimpleZip::unzip(stored_zip, cell_out) && cell_out == big && cell_out.sharesWith(stored_zip));
+	assert(cell_out.data() == stored_zip.data() + 30 + stored_name.size());
+	stored[40] ^= 1;
+	assert(!SimpleZip::unzip(CellBuffer(stored), cell_out));
+
+	// A reset stream takes the next archive with the same buffers and inflate state
+	{
+		string first, second;
+		SimpleUnzipStream unz([&](const char* data, size_t len) { first.append(data, len); return true; });
+		assert(unz.write(big_zip.data(), big_zip.size()) && unz.finish() && first == big);
+		SimpleUnzipStream::Sink sink = [&](const char* data, size_t len) { second.append(data, len); return true; };
+		unz.reset(sink);
+		assert(unz.write(zipped_data.data(), zipped_data.size()) && unz.finish() && second == test_unzipped_data);
+		assert(unz.size() == test_unzipped_data.size());
+	}
+
+	// Buffer pool hands a block out again once it is free
+	BufferPool pool(1024 * 1024);
+	{
+		auto a = pool.allocate(10000);
+		size_t heap = pool.heapAllocations();
+		char* block = a.get();
+		a.reset();
+		auto b = pool.allocate(9000);
+		assert(b.get() == block && pool.heapAllocations() == heap);
+		auto c = pool.allocate(9000);
+		assert(c.get() != block && pool.heapAllocations() == heap + 1);
+		assert(pool.pooledBytes() >= 2 * 10000);
+		auto big_block = pool.allocate(2 * 1024 * 1024);
+		assert(pool.pooledBytes() < 1024 * 1024);
+	}
+	pool.trim();
+	assert(pool.pooledBytes() == 0);
+
+}
+
+
+static std::string rawDeflate(const std::string& in, int level, int strategy) {
+	z_stream zs = {};
+	assert(deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8, strategy) == Z_OK);
+	std::string out(deflateBound(&zs, uLong(in.size())), 0);
+	zs.next_in = (Bytef*)in.data();
+	zs.avail_in = uInt(in.size());
+	zs.next_out = (Bytef*)&out[0];
+	zs.avail_out = uInt(out.size());
+	assert(deflate(&zs, Z_FINISH) == Z_STREAM_END);
+	out.resize(zs.total_out);
+	deflateEnd(&zs);
+	return out;
+}
+
+// zlib result for the same call: the stream ends with exactly len bytes of output
+static bool zlibInflate(const std::string& in, std::string& out, size_t len) {
+	z_stream zs = {};
+	inflateInit2(&zs, -MAX_WBITS);
+	out.assign(len + 1, 0);
+	zs.next_in = (Bytef*)in.data();
+	zs.avail_in = uInt(in.size());
+	zs.next_out = (Bytef*)&out[0];
+	zs.avail_out = uInt(out.size());
+	bool ok = inflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out == len;
+	inflateEnd(&zs);
+	out.resize(len);
+	return ok;
+}
+
+static void testFastInflate() {
+
+	std::vector<string> inputs = { "", "a", string(100000, 'x'), "abcabcabcabcabcabcabcabcabcabc" };
+	string text, noise, short_distances;
+	uint32_t seed = 7;
+	for (int i = 0; i < 30000; ++i) {
+		seed = seed * 1103515245 + 12345;
+		text += "Record " + std::to_string(seed % 5000) + (seed & 0x100 ? " LNDARE;" : " DEPARE;");
+		noise += char(seed >> 16);
+		short_distances += string(1 + seed % 3, char('a' + (seed >> 20) % 4));
+	}
+	inputs.push_back(text);
+	inputs.push_back(noise);
+	inputs.push_back(short_distances);
+	inputs.push_back(text.substr(0, 70000) + noise.substr(0, 70000) + text.substr(0, 70000));
+
+	for (const string& in : inputs) {
+		for (int level : { 0, 1, 6, 9 }) {
+			for (int strategy : { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE, Z_FIXED }) {
+				string packed = rawDeflate(in, level, strategy);
+				string out(in.size(), 0);
+				assert(FastInflate::decode(packed.data(), packed.size(), &out[0], out.size()) && out == in);
+				// The size must be right and the data complete
+				string longer(in.size() + 1, 0);
+				assert(!FastInflate::decode(packed.data(), packed.size(), &longer[0], longer.size()));
+				if (!in.empty())
+					assert(!FastInflate::decode(packed.data(), packed.size(), &out[0], out.size() - 1));
+				assert(!FastInflate::decode(packed.data(), packed.size() / 2, &out[0], out.size()) || in.size() < 2);
+			}
+		}
+	}
+
+	// Broken streams: whatever the fast decoder takes, zlib takes and decodes the same way
+	string packed = rawDeflate(text.substr(0, 20000), 9, Z_DEFAULT_STRATEGY);
+	string fixed = rawDeflate(text.substr(0, 20000), 9, Z_FIXED);
+	for (int i = 0; i < 3000; ++i) {
+		seed = seed * 1103515245 + 12345;
+		string broken = (i & 1) ? fixed : packed;
+		broken[(seed >> 8) % broken.size()] ^= char(1 << (seed % 8));
+		if (i % 3 == 0)
+			broken[(seed >> 12) % 64] ^= char(seed >> 24);
+		string out(20000, 0), expected;
+		bool fast_ok = FastInflate::decode(broken.data(), broken.size(), &out[0], out.size());
+		bool zlib_ok = zlibInflate(broken, expected, out.size());
+		assert(fast_ok == zlib_ok && (!fast_ok || out == expected));
+	}
+
+	// Checked engine runs both on every entry
+	string zipped, unzipped;
+	assert(SimpleZip::zip("text.000", text, zipped));
+	SimpleZip::setInflateEngine(SimpleZip::INFLATE_CHECKED);
+	assert(SimpleZip::unzip(zipped, unzipped) && unzipped == text);
+	SimpleZip::setInflateEngine(SimpleZip::INFLATE_ZLIB);
+	assert(SimpleZip::unzip(zipped, unzipped) && unzipped == text);
+	SimpleZip::setInflateEngine(SimpleZip::INFLATE_FAST);
+	assert(SimpleZip::unzip(zipped, unzipped) && unzipped == text);
+}
+
+// Small S-57 cells built with the ISO 8211 writer
+static std::string s57Cell(const std::vector<std::vector<std::pair<std::string, Iso8211Rows>>>& records) {
+	Iso8211File file;
+	file.addFieldDesc("0000", "0000;&   ", "S63TEST", "", "");
+	file.addFieldDesc("0001", "0100;&   ", "ISO 8211 Record Identifier", "", "(b12)");
+	file.addFieldDesc("DSID", "1600;&   ", "Data set identification field",
+		"RCNM!RCID!EXPP!INTU!DSNM!EDTN!UPDN!UADT!ISDT!STED!PRSP!PSDN!PRED!PROF!AGEN!COMT",
+		"(b11,b14,2b11,3A,2A(8),R(4),b11,2A,b11,b12,A)");
+	file.addFieldDesc("DSSI", "1600;&   ", "Data set structure information field",
+		"DSTR!AALL!NALL!NOMR!NOCR!NOGR!NOLR!NOIN!NOCN!NOED!NOFA", "(3b11,8b14)");
+	file.addFieldDesc("FRID", "1600;&   ", "Feature record identifier field", "RCNM!RCID!PRIM!GRUP!OBJL!RVER!RUIN", "(b11,b14,2b11,2b12,b11)");
+	file.addFieldDesc("FOID", "1600;&   ", "Feature object identifier field", "AGEN!FIDN!FIDS", "(b12,b14,b12)");
+	file.addFieldDesc("ATTF", "2600;&   ", "Feature record attribute field", "*ATTL!ATVL", "(b12,A)");
+	file.addFieldDesc("NATF", "2600;&%/@", "Feature record national attribute field", "*ATTL!ATVL", "(b12,A)");
+	file.addFieldDesc("FSPC", "1600;&   ", "Feature record to spatial record pointer control field", "FSUI!FSIX!NSPT", "(b11,2b12)");
+	file.addFieldDesc("FSPT", "2600;&   ", "Feature record to spatial record pointer field", "*NAME!ORNT!USAG!MASK", "(B(40),3b11)");
+	file.addFieldDesc("VRID", "1600;&   ", "Vector record identifier field", "RCNM!RCID!RVER!RUIN", "(b11,b14,b12,b11)");
+	file.addFieldDesc("SGCC", "1600;&   ", "Coordinate control field", "CCUI!CCIX!CCNC", "(b11,2b12)");
+	file.addFieldDesc("SG2D", "2500;&   ", "2-D coordinate field", "*YCOO!XCOO", "(2b24)");
+
+	for (size_t i = 0; i < records.size(); ++i) {
+		Iso8211Record record;
+		record.fields.push_back({ "0001", Iso8211File::fromUInt(static_cast<uint32_t>(i + 1), 2) });
+		for (const auto& f : records[i]) {
+			std::string data;
+			bool ok = file.join(f.first, f.second, data);
+			assert(ok);
+			record.fields.push_back({ f.first, data });
+		}
+		file.records.push_back(record);
+	}
+	return file.serialize();
+}
+
+static void testS57Update() {
+	auto b = [](uint32_t v, size_t w) { return Iso8211File::fromUInt(v, w); };
+	auto dsid = [&](const std::string& updn, const std::string& date) {
+		return std::pair<std::string, Iso8211Rows>("DSID", { { b(10, 1), b(1, 4), b(updn == "0" ? 1 : 2, 1), b(1, 1), "TEST0001.000",
+			"1", updn, date, date, "03.1", b(1, 1), "", "2.0", b(1, 1), b(540, 2), "" } });
+	};
+	auto frid = [&](uint32_t rcid, uint32_t rver, uint32_t ruin) {
+		return std::pair<std::string, Iso8211Rows>("FRID", { { b(100, 1), b(rcid, 4), b(2, 1), b(2, 1), b(42, 2), b(rver, 2), b(ruin, 1) } });
+	};
+	auto vrid = [&](uint32_t rcid, uint32_t rver, uint32_t ruin) {
+		return std::pair<std::string, Iso8211Rows>("VRID", { { b(130, 1), b(rcid, 4), b(rver, 2), b(ruin, 1) } });
+	};
+	auto pointer = [&](uint32_t rcid) {
+		return std::vector<std::string>{ b(130, 1) + b(rcid, 4), b(1, 1), b(1, 1), b(255, 1) };
+	};
+	auto point = [&](uint32_t y, uint32_t x) { return std::vector<std::string>{ b(y, 4), b(x, 4) }; };
+	const std::string wide_delete("\x7f\0", 2);
+
+	std::string base = s57Cell({
+		{ dsid("0", "20260101"), { "DSSI", { { b(2, 1), b(1, 1), b(1, 1), b(0, 4), b(0, 4), b(1, 4), b(0, 4), b(0, 4), b(0, 4), b(1, 4), b(0, 4) } } } },
+		{ vrid(1, 1, 1), { "SG2D", { point(10, 20), point(30, 40), point(50, 60) } } },
+		{ frid(1, 1, 1), { "FOID", { { b(540, 2), b(1, 4), b(1, 2) } } },
+			{ "ATTF", { { b(1, 2), "A" }, { b(2, 2), "B" } } },
+			{ "NATF", { { b(300, 2), std::string("n\0", 2) } } },
+			{ "FSPT", { pointer(1), pointer(2) } } },
+	});
+	std::string update1 = s57Cell({
+		{ dsid("1", "20260201") },
+		{ vrid(1, 2, 3), { "SGCC", { { b(1, 1), b(2, 2), b(1, 2) } } }, { "SG2D", { point(70, 80) } } },
+		{ frid(1, 2, 3), { "ATTF", { { b(1, 2), "Z" }, { b(2, 2), "\x7f" }, { b(3, 2), "C" } } },
+			{ "NATF", { { b(300, 2), wide_delete } } },
+			{ "FSPC", { { b(2, 1), b(1, 2), b(1, 2) } } } },
+		{ frid(2, 1, 1), { "FOID", { { b(540, 2), b(2, 4), b(1, 2) } } }, { "ATTF", { { b(1, 2), "new" } } } },
+	});
+	std::string update2 = s57Cell({
+		{ dsid("2", "20260301") },
+		{ frid(2, 2, 2) },
+		{ frid(1, 3, 3), { "FSPC", { { b(1, 1), b(2, 2), b(1, 2) } } }, { "FSPT", { pointer(3) } } },
+	});
+
+	// Parsing and writing back gives the same bytes
+	Iso8211File file;
+	assert(file.parse(base));
+	assert(file.serialize() == base);
+
+	std::string merged;
+	assert(S57Updater::apply(base, { update1 }, merged));
+	assert(file.parse(merged));
+	assert(file.records.size() == 4);
+	Iso8211Rows rows;
+	const Iso8211Field* f = file.records[1].find("SG2D");
+	assert(f && file.split(*f, rows));
+	assert(rows.size() == 4 && rows[1] == point(70, 80) && rows[2] == point(30, 40));
+	f = file.records[3].find("FRID");
+	assert(f && file.split(*f, rows) && Iso8211File::toUInt(rows[0][1]) == 2);
+
+	assert(S57Updater::apply(base, { update1, update2 }, merged));
+	assert(file.parse(merged));
+	assert(file.records.size() == 3);
+	// record numbers, update number, dates and counts follow the updates
+	for (size_t i = 0; i < file.records.size(); ++i)
+		assert(Iso8211File::toUInt(file.records[i].find("0001")->data) == i + 1);
+	assert(file.split(*file.records[0].find("DSID"), rows));
+	assert(rows[0][6] == "2" && rows[0][7] == "20260301" && rows[0][8] == "20260301");
+	assert(file.split(*file.records[0].find("DSSI"), rows));
+	assert(Iso8211File::toUInt(rows[0][5]) == 1 && Iso8211File::toUInt(rows[0][9]) == 1);
+
+	Iso8211Record& feature = file.records[2];
+	assert(file.split(*feature.find("FRID"), rows));
+	assert(Iso8211File::toUInt(rows[0][1]) == 1 && Iso8211File::toUInt(rows[0][5]) == 3 && Iso8211File::toUInt(rows[0][6]) == 1);
+	assert(file.split(*feature.find("ATTF"), rows));
+	assert(rows.size() == 2 && rows[0][1] == "Z" && Iso8211File::toUInt(rows[1][0]) == 3 && rows[1][1] == "C");
+	assert(!feature.find("NATF") && !feature.find("FSPC"));
+	assert(file.split(*feature.find("FSPT"), rows));
+	assert(rows.size() == 2 && rows[0] == pointer(2) && rows[1] == pointer(3));
+	assert(feature.fields.back().tag == "FSPT");
 
+	// Updates out of order or for another version of a record are refused
+	assert(!S57Updater::apply(base, { update2 }, merged));
+	assert(!S57Updater::apply(base, { update1, update1 }, merged));
+
+	// The client finds the updates of an exchange set, each in its own directory next to the base cell
+	const string hw_id = "12348", ck1 = hex_to_string("C1CB518E9C"), ck2 = hex_to_string("421571CC66");
+	const std::filesystem::path root = "test_update_root";
+	std::filesystem::remove_all(root);
+	auto write = [&](const std::string& rel, const std::string& content) {
+		string cell;
+		assert(SimpleZip::zip(std::filesystem::path(rel).filename().string(), content, cell));
+		S63::encryptCell(cell, ck1);
+		std::filesystem::create_directories((root / rel).parent_path());
+		std::ofstream((root / rel).string(), std::ios::binary | std::ios::trunc).write(cell.data(), cell.size());
+		return (root / rel).string();
+	};
+	S63Client client(hw_id, "98765", "01");
+	assert(client.installCellPermit(S63::createCellPermit(hw_id, ck1, ck2, "TEST0001", "20991231")));
+	const string base_path = write("GB/TEST0001/1/0/TEST0001.000", base);
+	assert(client.openUpdated(base_path) == base);
+	write("GB/TEST0001/1/1/TEST0001.001", update1);
+	assert(S57Updater::apply(base, { update1 }, merged) && client.openUpdated(base_path) == merged);
+	write("GB/TEST0001/1/2/TEST0001.002", update2);
+	assert(S57Updater::apply(base, { update1, update2 }, merged) && client.openUpdated(base_path) == merged);
+	std::filesystem::remove_all(root);
+
+	// And in a flat copy, next to it
+	const string flat_path = write("TEST0001.000", base);
+	write("TEST0001.001", update1);
+	assert(S57Updater::apply(base, { update1 }, merged) && client.openUpdated(flat_path) == merged);
+	std::filesystem::remove_all(root);
 }
 
+static void testCellPack() {
+	auto b = [](uint32_t v, size_t w) { return Iso8211File::fromUInt(v, w); };
+	auto s57 = [&](const std::string& edtn, const std::string& updn) {
+		return s57Cell({ { { "DSID", { { b(10, 1), b(1, 4), b(1, 1), b(1, 1), "GB100001.000",
+			edtn, updn, "20260101", "20260101", "03.1", b(1, 1), "", "2.0", b(1, 1), b(540, 2), "" } } } } });
+	};
+	const string hw_id = "12348", ck1 = hex_to_string("C1CB518E9C"), ck2 = hex_to_string("421571CC66");
+	const std::filesystem::path root = "test_enc_root";
+	std::filesystem::remove_all(root);
+	auto write = [&](const std::string& rel, const std::string& content) {
+		string cell;
+		assert(SimpleZip::zip(std::filesystem::path(rel).filename().string(), content, cell));
+		S63::encryptCell(cell, ck1);
+		std::filesystem::create_directories((root / rel).parent_path());
+		std::ofstream((root / rel).string(), std::ios::binary | std::ios::trunc).write(cell.data(), cell.size());
+		return (root / rel).string();
+	};
+	const string base = s57("2", "0"), update = s57("2", "1"), other = "Not a S-57 cell";
+	const string base_path = write("GB/GB100001/2/0/GB100001.000", base);
+	const string update_path = write("GB/GB100001/2/1/GB100001.001", update);
+	const string other_path = write("GB/GB100002/1/0/GB100002.000", other);
+	std::ofstream((root / "GB" / "README.TXT").string()) << "not a cell";
+	std::ofstream((root / "CATALOG.031").string()) << "not a cell either";
+
+	S63Client client(hw_id, "98765", "01");
+	assert(client.installCellPermit(S63::createCellPermit(hw_id, ck1, ck2, "GB100001", "20991231")));
+	assert(client.installCellPermit(S63::createCellPermit(hw_id, ck1, ck2, "GB100002", "20991231")));
+	S63CellPack& pack = client.cellPack();
+	assert(!pack.open(root.string()) && !pack.isOpen());
+	assert(client.updateCellPack() && pack.decoded() == 3 && pack.copied() == 0 && pack.cells() == 3);
+	CellBuffer packed = client.open(base_path);
+	assert(packed == base && packed.sharesWith(pack.get(base_path)));
+	assert(pack.find("GB100001", 2, 1) == update && pack.find("GB100002", 0, 0) == other);
+	assert(pack.find("GB100001", 1, 0).empty());
+
+	// Next start: the cells are there before any permit is installed
+	{
+		S63Client cold(hw_id, "98765", "01");
+		assert(cold.cellPack().open(root.string()) && cold.cellPack().cells() == 3);
+		assert(cold.open(update_path) == update && cold.open(other_path) == other);
+	}
+
+	// A changed cell is decoded again and the rest copied, the buffers of the old pack stay valid.
+	// A cell which is gone is dropped.
+	const string changed = other + " any more";
+	write("GB/GB100002/1/0/GB100002.000", changed);
+	assert(pack.get(other_path).empty());
+	size_t opened = 0;
+	assert(pack.update([&](const std::string& path) { ++opened; return client.open(path); }));
+	assert(opened == 1 && pack.decoded() == 1 && pack.copied() == 2);
+	assert(client.open(other_path) == changed && packed == base);
+	std::filesystem::remove(update_path);
+	assert(client.updateCellPack() && pack.decoded() == 0 && pack.cells() == 2);
+	assert(pack.find("GB100001", 2, 1).empty() && client.open(base_path) == base);
+
+	pack.close();
+	std::filesystem::remove_all(root);
+}
+
+// Archive with many entries as the zip tools write it: deflated or stored, the sizes in the local
+// headers or in data descriptors after the data, and optionally ZIP64 records for every size and offset
+static std::string zipArchive(const std::vector<std::pair<std::string, std::string>>& files, bool deflated, bool descriptor, bool zip64, const std::string& comment = "") {
+	auto put = [](std::string& s, uint64_t v, size_t bytes) {
+		for (size_t i = 0; i < bytes; ++i)
+			s += static_cast<char>(v >> (8 * i));
+	};
+	const uint32_t SAT = 0xffffffff;
+	std::string out, cd;
+	for (const auto& file : files) {
+		const std::string data = deflated ? rawDeflate(file.second, 6, Z_DEFAULT_STRATEGY) : file.second;
+		const uint32_t crc = uint32_t(crc32(0L, reinterpret_cast<const Bytef*>(file.second.data()), uInt(file.second.size())));
+		const uint64_t offset = out.size();
+		const uint16_t flags = descriptor ? 8 : 0;
+		const uint16_t method = deflated ? 8 : 0;
+
+		put(out, 0x04034b50, 4); put(out, zip64 ? 45 : 20, 2); put(out, flags, 2); put(out, method, 2); put(out, 0, 4);
+		put(out, descriptor ? 0 : crc, 4);
+		put(out, descriptor ? 0 : zip64 ? SAT : data.size(), 4);
+		put(out, descriptor ? 0 : zip64 ? SAT : file.second.size(), 4);
+		put(out, file.first.size(), 2); put(out, zip64 && !descriptor ? 20 : 0, 2);
+		out += file.first;
+		if (zip64 && !descriptor) {
+			put(out, 1, 2); put(out, 16, 2); put(out, file.second.size(), 8); put(out, data.size(), 8);
+		}
+		out += data;
+		if (descriptor) {
+			put(out, 0x08074b50, 4); put(out, crc, 4);
+			put(out, data.size(), zip64 ? 8 : 4); put(out, file.second.size(), zip64 ? 8 : 4);
+		}
+
+		put(cd, 0x02014b50, 4); put(cd, 45, 2); put(cd, zip64 ? 45 : 20, 2); put(cd, flags, 2); put(cd, method, 2); put(cd, 0, 4);
+		put(cd, crc, 4); put(cd, zip64 ? SAT : data.size(), 4); put(cd, zip64 ? SAT : file.second.size(), 4);
+		put(cd, file.first.size(), 2); put(cd, zip64 ? 28 : 0, 2); put(cd, 0, 2); put(cd, 0, 2); put(cd, 0, 2); put(cd, 0, 4);
+		put(cd, zip64 ? SAT : offset, 4);
+		cd += file.first;
+		if (zip64) {
+			put(cd, 1, 2); put(cd, 24, 2); put(cd, file.second.size(), 8); put(cd, data.size(), 8); put(cd, offset, 8);
+		}
+	}
+	const uint64_t cd_offset = out.size();
+	out += cd;
+	if (zip64) {
+		const uint64_t record = out.size();
+		put(out, 0x06064b50, 4); put(out, 44, 8); put(out, 45, 2); put(out, 45, 2); put(out, 0, 4); put(out, 0, 4);
+		put(out, files.size(), 8); put(out, files.size(), 8); put(out, cd.size(), 8); put(out, cd_offset, 8);
+		put(out, 0x07064b50, 4); put(out, 0, 4); put(out, record, 8); put(out, 1, 4);
+	}
+	put(out, 0x06054b50, 4); put(out, 0, 2); put(out, 0, 2);
+	put(out, zip64 ? 0xffff : files.size(), 2); put(out, zip64 ? 0xffff : files.size(), 2);
+	put(out, zip64 ? SAT : cd.size(), 4); put(out, zip64 ? SAT : cd_offset, 4);
+	put(out, comment.size(), 2);
+	out += comment;
+	return out;
+}
+
+static void testZipArchive() {
+	string text;
+	for (int i = 0; text.size() < 100000; ++i)
+		text += "Record " + std::to_string(i * 7 % 1000) + " of the cell;";
+	const std::vector<std::pair<std::string, std::string>> files = {
+		{ "ENC_ROOT/", "" },
+		{ "ENC_ROOT/GB/GB100001/1/0/GB100001.000", text },
+		{ "ENC_ROOT/GB/GB100002/1/0/GB100002.000", text.substr(0, 777) },
+		{ "ENC_ROOT/EMPTY.TXT", "" },
+		{ "ENC_ROOT/CATALOG.031", "catalogue" },
+	};
+
+	// Every way of writing the sizes, and a comment which has the end of directory signature in it
+	for (int variant = 0; variant < 8; ++variant) {
+		const bool deflated = variant & 1, descriptor = variant & 2, zip64 = variant & 4;
+		const CellBuffer data(zipArchive(files, deflated, descriptor, zip64, variant == 5 ? string("PK\x05\x06", 4) + string(30, 'c') : ""));
+		ZipArchive zip;
+		assert(zip.open(data) && zip.isOpen() && zip.path().empty());
+		assert(zip.entries().size() == files.size() - 1);
+		for (size_t i = 1; i < files.size(); ++i) {
+			const ZipArchive::Entry* entry = zip.find(files[i].first);
+			assert(entry && entry->name == files[i].first && entry->uncompressed_size == files[i].second.size());
+			CellBuffer out;
+			assert(zip.extract(*entry, out) && out == files[i].second);
+			// Stored entries are not copied
+			assert(deflated || out.empty() || out.sharesWith(data));
+		}
+		assert(zip.find("ENC_ROOT\\CATALOG.031") == zip.find("ENC_ROOT/CATALOG.031"));
+		CellBuffer none;
+		assert(!zip.find("ENC_ROOT/") && !zip.find("CATALOG.031") && !zip.extract("ENC_ROOT/GB", none));
+	}
+
+	// A broken entry fails on its own, the rest of the archive is still fine
+	string broken = zipArchive(files, false, false, false);
+	broken[broken.find("catalogue")] = 'C';
+	ZipArchive zip;
+	assert(zip.open(CellBuffer(broken)));
+	CellBuffer out;
+	assert(!zip.extract("ENC_ROOT/CATALOG.031", out) && zip.extract("ENC_ROOT/EMPTY.TXT", out) && out.empty());
+	assert(!zip.open(CellBuffer(broken.substr(0, broken.size() - 1))) && !zip.isOpen());
+	assert(!zip.open(CellBuffer(string("PK"))));
+
+	// The last of two entries with the same name counts
+	assert(zip.open(CellBuffer(zipArchive({ { "A", "old" }, { "A", "new" } }, true, false, false))));
+	assert(zip.extract("A", out) && out == "new");
+
+	// A zipped exchange set: the cells are decrypted straight out of the mapped archive
+	const string hw_id = "12348", ck1 = hex_to_string("C1CB518E9C"), ck2 = hex_to_string("421571CC66");
+	std::vector<std::pair<std::string, std::string>> cells;
+	for (const auto& file : files) {
+		string cell;
+		if (file.first.size() > 4 && file.first.compare(file.first.size() - 4, 4, ".000") == 0) {
+			assert(SimpleZip::zip(std::filesystem::path(file.first).filename().string(), file.second, cell));
+			S63::encryptCell(cell, ck2);
+		}
+		else {
+			cell = file.second;
+		}
+		cells.emplace_back(file.first, cell);
+	}
+	const string zip_path = "test_exchange_set.zip";
+	std::ofstream(zip_path, std::ios::binary | std::ios::trunc) << zipArchive(cells, false, true, true);
+
+	S63Client client(hw_id, "98765", "01");
+	assert(client.installCellPermit(S63::createCellPermit(hw_id, ck1, ck2, "GB100001", "20991231")));
+	client.cellCache().setBudget(1024 * 1024);
+	{
+		ZipArchive exchange_set;
+		assert(exchange_set.open(zip_path) && exchange_set.path() == zip_path);
+		CellBuffer cell = client.open(exchange_set, "ENC_ROOT/GB/GB100001/1/0/GB100001.000");
+		assert(cell == text && client.open(exchange_set, "ENC_ROOT/GB/GB100001/1/0/GB100001.000").sharesWith(cell));
+		assert(client.open(exchange_set, "ENC_ROOT/GB/GB100002/1/0/GB100002.000").empty());
+		assert(client.open(exchange_set, "ENC_ROOT/GB/GB100003/1/0/GB100003.000").empty());
+	}
+	std::filesystem::remove(zip_path);
+}
 
 int main(int argc, char *argv[])
 {
 	
 	testBlowFish();
+	testKeyCache();
+	testCrc32();
 	testZip();
+	testFastInflate();
+	testS57Update();
+	testCellPack();
+	testZipArchive();
 	testS63();
+	testCellReader();
+	testThreads();
+	testThreadPool();
+	testCellLoader();
 	puts("All test passed!\n");
 
 
@@ -95,17 +1211,17 @@ int main(int argc, char *argv[])
 	//	}
 	//}
 
-	/*auto cell = s63.open("D:\\Maps\\s63\\ENC_ROOT\\UA\\UA5T3519\\3\\0\\UA5T3519.000");
+	/*auto cell = s63.openReader("D:\\Maps\\s63\\ENC_ROOT\\UA\\UA5T3519\\3\\0\\UA5T3519.000");
 
-	cout << cell.getSize() << endl;
+	cout << cell->size() << endl;
 
-	std::vector<char> buf(cell.getSize());
+	std::vector<char> buf(cell->size());
 
-	int read = cell.read(buf.data(), cell.getSize());
+	int read = cell->read(buf.data(), cell->size());
 
 	cout <<"read " << read << endl;
 
-	read = cell.read(buf.data(), 1);
+	read = cell->read(buf.data(), 1);
 
 	cout << "read " << read << endl;*/
 
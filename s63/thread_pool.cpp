@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <exception>
+
+#include "buffer_pool.h"
+
+// Worker the current thread belongs to, if any
+static thread_local const ThreadPool* current_pool = nullptr;
+static thread_local size_t current_index = 0;
+
+ThreadPool::ThreadPool(size_t threads) {
+
+	if (threads == 0) {
+		size_t hw = std::thread::hardware_concurrency();
+		threads = hw > 1 ? hw - 1 : 0;
+	}
+	for (size_t i = 0; i <= threads; ++i)
+		m_queues.emplace_back(new Queue);
+	m_threads.reserve(threads);
+	for (size_t i = 0; i < threads; ++i)
+		m_threads.emplace_back(&ThreadPool::work, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_work_cv.notify_all();
+	for (auto& thread : m_threads)
+		thread.join();
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+
+	size_t index;
+	if (current_pool == this)
+		index = current_index;
+	else if (m_threads.empty())
+		index = m_queues.size() - 1;
+	else
+		index = m_next_queue.fetch_add(1) % m_threads.size();
+
+	++m_unfinished;
+	{
+		std::lock_guard<std::mutex> lock(m_queues[index]->mutex);
+		m_queues[index]->tasks.push_back(std::move(task));
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		++m_queued;
+	}
+	m_work_cv.notify_one();
+}
+
+bool ThreadPool::pop(size_t self, std::function<void()>& task) {
+
+	const size_t n = m_queues.size();
+	if (self < n) {
+		Queue& own = *m_queues[self];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.tasks.empty()) {
+			task = std::move(own.tasks.back());
+			own.tasks.pop_back();
+			--m_queued;
+			return true;
+		}
+	}
+	for (size_t i = 1; i <= n; ++i) {
+		Queue& victim = *m_queues[(self + i) % n];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.tasks.empty()) {
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			--m_queued;
+			return true;
+		}
+	}
+	return false;
+}
+
+void ThreadPool::run(std::function<void()>& task) {
+
+	task();
+	task = nullptr;
+	if (--m_unfinished == 0) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_done_cv.notify_all();
+	}
+}
+
+void ThreadPool::work(size_t index) {
+
+	current_pool = this;
+	current_index = index;
+	std::function<void()> task;
+	for (;;) {
+		if (pop(index, task)) {
+			run(task);
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (!m_stop && m_queued == 0) {
+			// Going to sleep, the free buffers of this thread go back to the heap
+			lock.unlock();
+			BufferPool::local().trim();
+			lock.lock();
+		}
+		m_work_cv.wait(lock, [this] { return m_stop || m_queued != 0; });
+		if (m_stop && m_queued == 0)
+			return;
+	}
+}
+
+void ThreadPool::wait() {
+
+	const size_t self = current_pool == this ? current_index : m_queues.size() - 1;
+	std::function<void()> task;
+	while (m_unfinished != 0) {
+		if (pop(self, task)) {
+			run(task);
+			continue;
+		}
+		// The rest is running on other threads
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_done_cv.wait(lock, [this] { return m_unfinished == 0 || m_queued != 0; });
+	}
+}
+
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t)>& fn) {
+
+	if (count == 0)
+		return;
+
+	// Helpers may start after the caller has already finished everything,
+	// so the state they touch is owned jointly and not kept on this stack
+	struct State {
+		std::function<void(size_t)> fn;
+		size_t count;
+		std::atomic<size_t> next{ 0 };
+		size_t done = 0;
+		std::exception_ptr error;
+		std::mutex mutex;
+		std::condition_variable cv;
+
+		void run() {
+			size_t finished = 0;
+			std::exception_ptr err;
+			for (size_t i; (i = next.fetch_add(1)) < count; ++finished) {
+				try {
+					fn(i);
+				}
+				catch (...) {
+					if (!err)
+						err = std::current_exception();
+				}
+			}
+			if (finished == 0)
+				return;
+			std::lock_guard<std::mutex> lock(mutex);
+			if (err && !error)
+				error = err;
+			done += finished;
+			if (done == count)
+				cv.notify_all();
+		}
+	};
+	auto state = std::make_shared<State>();
+	state->fn = fn;
+	state->count = count;
+
+	size_t helpers = std::min(m_threads.size(), count - 1);
+	for (size_t i = 0; i < helpers; ++i)
+		submit([state] { state->run(); });
+
+	state->run();
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->cv.wait(lock, [&] { return state->done == state->count; });
+	if (state->error)
+		std::rethrow_exception(state->error);
+}
+
+ThreadPool& ThreadPool::shared() {
+	static ThreadPool pool;
+	return pool;
+}
@@ -0,0 +1,85 @@
+#pragma once
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads with work stealing.
+// Every worker has its own task deque: it takes its newest task first and, when it runs out,
+// steals the oldest task of another worker. Tasks submitted from a worker go to its own deque,
+// tasks from other threads are spread over the workers round robin.
+// The caller of parallelFor() or wait() takes part in the work itself, so they never deadlock,
+// even when called from a worker.
+class ThreadPool
+{
+public:
+	// 0 threads means hardware_concurrency() - 1, the calling thread is the last one
+	explicit ThreadPool(size_t threads = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// Queues a task. Exceptions must not leave it.
+	void submit(std::function<void()> task);
+	// Runs queued tasks on the calling thread as well until every submitted task is finished
+	void wait();
+
+	// Calls fn(i) for every i in [0, count) on the workers and the calling thread, returns when all are done.
+	// The first exception thrown by fn is rethrown here.
+	void parallelFor(size_t count, const std::function<void(size_t)>& fn);
+
+	size_t threads() const { return m_threads.size(); }
+
+	// Pool used by S63 for large cells
+	static ThreadPool& shared();
+
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	void work(size_t index);
+	// Own queue first (newest task), then the others (oldest task)
+	bool pop(size_t self, std::function<void()>& task);
+	void run(std::function<void()>& task);
+
+	std::vector<std::unique_ptr<Queue>> m_queues;	// one per worker, the last one for other threads
+	std::vector<std::thread> m_threads;
+	std::atomic<size_t> m_queued{ 0 };
+	std::atomic<size_t> m_unfinished{ 0 };
+	std::atomic<size_t> m_next_queue{ 0 };
+	std::mutex m_mutex;
+	std::condition_variable m_work_cv;
+	std::condition_variable m_done_cv;
+	bool m_stop = false;
+};
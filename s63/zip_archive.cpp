@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "zip_archive.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+#include "crc32_simd.h"
+#include "mapped_file.h"
+#include "simple_zip.h"
+
+#define ZIP_LOCAL_HEADER_SIGNATURE 0x04034b50
+#define ZIP_CENTRAL_DIR_SIGNATURE 0x02014b50
+#define ZIP_EOCD_RECORD_SIGNATURE 0x06054b50
+#define ZIP64_EOCD_LOCATOR_SIGNATURE 0x07064b50
+#define ZIP64_EOCD_RECORD_SIGNATURE 0x06064b50
+#define ZIP64_EXTRA_FIELD 0x0001
+#define ZIP_ZIP64 0xffffffff
+#define ZIP_FLAG_ENCRYPTED 0x0001
+#define ZIP_METHOD_STORED 0
+#define ZIP_METHOD_DEFLATED 8
+
+// Fixed parts of the records, the names, extra fields and comments follow them
+static const size_t LOCAL_HEADER_SIZE = 30;
+static const size_t CENTRAL_DIR_SIZE = 46;
+static const size_t EOCD_SIZE = 22;
+static const size_t ZIP64_LOCATOR_SIZE = 20;
+static const size_t ZIP64_EOCD_SIZE = 56;
+static const size_t MAX_COMMENT = 0xffff;
+
+// Little endian field at any alignment
+template <class T>
+static T get(const char* p) {
+	T v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+bool ZipArchive::open(const std::string& path) {
+
+	close();
+	auto file = std::make_shared<MappedFile>();
+	if (!file->open(path, false)) {
+		printf("Could not open %s\n", path.c_str());
+		return false;
+	}
+	if (!open(CellBuffer::wrap(file, file->data(), file->size())))
+		return false;
+	m_path = path;
+	return true;
+}
+
+bool ZipArchive::open(const CellBuffer& data) {
+
+	close();
+	m_data = data;
+	if (!readDirectory()) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+void ZipArchive::close() {
+
+	m_path.clear();
+	m_data = CellBuffer();
+	m_entries.clear();
+	m_index.clear();
+}
+
+bool ZipArchive::fail(const char* msg) {
+	puts(msg);
+	return false;
+}
+
+bool ZipArchive::readDirectory() {
+
+	const char* buf = m_data.data();
+	const size_t len = m_data.size();
+	if (len < EOCD_SIZE)
+		return fail("Not a zip archive\n");
+
+	// The end of central directory record is only followed by the archive comment. The signature
+	// may show up inside the comment as well, so the comment length must also lead to the end.
+	size_t eocd = len - EOCD_SIZE;
+	const size_t lowest = eocd > MAX_COMMENT ? eocd - MAX_COMMENT : 0;
+	while (get<uint32_t>(buf + eocd) != ZIP_EOCD_RECORD_SIGNATURE || eocd + EOCD_SIZE + get<uint16_t>(buf + eocd + 20) != len) {
+		if (eocd == lowest)
+			return fail("cant find end of dirrectory record\n");
+		--eocd;
+	}
+
+	bool split = get<uint16_t>(buf + eocd + 4) != 0 || get<uint16_t>(buf + eocd + 6) != 0;
+	uint64_t count = get<uint16_t>(buf + eocd + 10);
+	uint64_t cd_size = get<uint32_t>(buf + eocd + 12);
+	uint64_t cd_offset = get<uint32_t>(buf + eocd + 16);
+	size_t cd_end = eocd;
+
+	// ZIP64: a locator right before the record points to the ZIP64 record with the 64 bit values
+	if (eocd >= ZIP64_LOCATOR_SIZE && get<uint32_t>(buf + eocd - ZIP64_LOCATOR_SIZE) == ZIP64_EOCD_LOCATOR_SIGNATURE) {
+		const size_t locator = eocd - ZIP64_LOCATOR_SIZE;
+		const uint64_t record = get<uint64_t>(buf + locator + 8);
+		if (record > locator || locator - record < ZIP64_EOCD_SIZE || get<uint32_t>(buf + record) != ZIP64_EOCD_RECORD_SIGNATURE)
+			return fail("wrong ZIP64 end of central directory record\n");
+		split = get<uint32_t>(buf + record + 16) != 0 || get<uint32_t>(buf + record + 20) != 0;
+		count = get<uint64_t>(buf + record + 32);
+		cd_size = get<uint64_t>(buf + record + 40);
+		cd_offset = get<uint64_t>(buf + record + 48);
+		cd_end = static_cast<size_t>(record);
+	}
+
+	if (split)
+		return fail("Archives split over several disks are not supported\n");
+	if (cd_offset > cd_end || cd_size > cd_end - cd_offset)
+		return fail("wrong CD offset value\n");
+
+	// A broken count must not reserve more than the directory can hold
+	m_entries.reserve(static_cast<size_t>(std::min<uint64_t>(count, cd_size / CENTRAL_DIR_SIZE)));
+	const char* p = buf + cd_offset;
+	const char* end = p + cd_size;
+	for (uint64_t i = 0; i < count; ++i) {
+		if (size_t(end - p) < CENTRAL_DIR_SIZE || get<uint32_t>(p) != ZIP_CENTRAL_DIR_SIGNATURE)
+			return fail("wrong central dir signature\n");
+
+		const size_t name_len = get<uint16_t>(p + 28);
+		const size_t extra_len = get<uint16_t>(p + 30);
+		const size_t record_len = CENTRAL_DIR_SIZE + name_len + extra_len + get<uint16_t>(p + 32);
+		if (size_t(end - p) < record_len)
+			return fail("wrong central dir record\n");
+
+		Entry entry;
+		entry.flags = get<uint16_t>(p + 8);
+		entry.method = get<uint16_t>(p + 10);
+		entry.crc = get<uint32_t>(p + 16);
+		entry.compressed_size = get<uint32_t>(p + 20);
+		entry.uncompressed_size = get<uint32_t>(p + 24);
+		entry.header_offset = get<uint32_t>(p + 42);
+		entry.name.assign(p + CENTRAL_DIR_SIZE, name_len);
+		std::replace(entry.name.begin(), entry.name.end(), '\\', '/');
+
+		// The ZIP64 extra field has the 64 bit values of the fields which are saturated, in this order
+		const char* extra = p + CENTRAL_DIR_SIZE + name_len;
+		const char* extra_end = extra + extra_len;
+		while (extra_end - extra >= 4) {
+			const size_t field_len = get<uint16_t>(extra + 2);
+			if (size_t(extra_end - extra - 4) < field_len)
+				break;
+			if (get<uint16_t>(extra) == ZIP64_EXTRA_FIELD) {
+				const char* value = extra + 4;
+				for (uint64_t* field : { &entry.uncompressed_size, &entry.compressed_size, &entry.header_offset }) {
+					if (*field != ZIP_ZIP64)
+						continue;
+					if (size_t(extra + 4 + field_len - value) < 8)
+						return fail("wrong ZIP64 extra field\n");
+					*field = get<uint64_t>(value);
+					value += 8;
+				}
+			}
+			extra += 4 + field_len;
+		}
+		p += record_len;
+
+		if (entry.name.empty() || entry.name.back() == '/')
+			continue;
+		// A name written twice stands for its last version, as with the zip tools
+		m_index[entry.name] = m_entries.size();
+		m_entries.push_back(std::move(entry));
+	}
+	return true;
+}
+
+const ZipArchive::Entry* ZipArchive::find(const std::string& name) const {
+
+	auto it = m_index.find(name);
+	if (it == m_index.end() && name.find('\\') != std::string::npos) {
+		std::string normal = name;
+		std::replace(normal.begin(), normal.end(), '\\', '/');
+		it = m_index.find(normal);
+	}
+	return it == m_index.end() ? nullptr : &m_entries[it->second];
+}
+
+bool ZipArchive::raw(const Entry& entry, CellBuffer& out) const {
+
+	// Sizes are taken from the central directory, the local header may not have them (data descriptor).
+	// Its name and extra field can differ from the central directory ones, the data starts after them.
+	const size_t len = m_data.size();
+	if (entry.header_offset > len || len - entry.header_offset < LOCAL_HEADER_SIZE) {
+		puts("wrong local header offset\n");
+		return false;
+	}
+	const char* header = m_data.data() + entry.header_offset;
+	if (get<uint32_t>(header) != ZIP_LOCAL_HEADER_SIGNATURE) {
+		puts("wrong zip signature\n");
+		return false;
+	}
+	const uint64_t data_offset = entry.header_offset + LOCAL_HEADER_SIZE + get<uint16_t>(header + 26) + get<uint16_t>(header + 28);
+	if (data_offset > len || entry.compressed_size > len - data_offset) {
+		puts("wrong entry size\n");
+		return false;
+	}
+	out = m_data.view(static_cast<size_t>(data_offset), static_cast<size_t>(entry.compressed_size));
+	return true;
+}
+
+bool ZipArchive::extract(const Entry& entry, CellBuffer& out) const {
+
+	if (entry.flags & ZIP_FLAG_ENCRYPTED) {
+		printf("%s is encrypted\n", entry.name.c_str());
+		return false;
+	}
+	if (entry.method != ZIP_METHOD_STORED && entry.method != ZIP_METHOD_DEFLATED) {
+		puts("unsupported compression method\n");
+		return false;
+	}
+
+	CellBuffer data;
+	if (!raw(entry, data))
+		return false;
+
+	CellBuffer result;
+	if (entry.method == ZIP_METHOD_STORED) {
+		if (entry.compressed_size != entry.uncompressed_size) {
+			puts("wrong entry size\n");
+			return false;
+		}
+		result = data;
+	}
+	else {
+		if (entry.uncompressed_size != static_cast<size_t>(entry.uncompressed_size)) {
+			puts("Entry too big for this platform\n");
+			return false;
+		}
+		// Inflate overwrites every byte, no need to zero them first
+		char* buf;
+		result = CellBuffer::allocate(static_cast<size_t>(entry.uncompressed_size), buf);
+		if (!SimpleZip::inflate(data.data(), data.size(), buf, result.size()))
+			return false;
+	}
+
+	if (Crc32::update(0, result.data(), result.size()) != entry.crc) {
+		puts("wrong crc\n");
+		return false;
+	}
+	out = std::move(result);
+	return true;
+}
+
+bool ZipArchive::extract(const std::string& name, CellBuffer& out) const {
+
+	const Entry* entry = find(name);
+	if (!entry) {
+		printf("There is no %s in the archive\n", name.c_str());
+		return false;
+	}
+	return extract(*entry, out);
+}
@@ -0,0 +1,84 @@
+#pragma once
+/*
+ * Copyright (c) 2021 Pavel Saenko <pasha03.92@mail.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cell_buffer.h"
+
+// Read-only zip archive with many entries, such as an exchange set delivered as one zip of its ENC_ROOT.
+// The central directory is read once into an index, so finding an entry is a hash lookup and nothing
+// else of the archive is touched until an entry is extracted. The archive is memory mapped: a stored
+// entry comes out as a view into the mapping, a deflated one is inflated straight into its buffer.
+// ZIP64 archives and entries written with data descriptors are supported, encrypted and split ones are not.
+// Once opened, an archive can be read from several threads at once.
+class ZipArchive
+{
+public:
+	struct Entry {
+		std::string name;	// path inside the archive, with '/' separators
+		uint64_t header_offset;	// of the local header
+		uint64_t compressed_size;
+		uint64_t uncompressed_size;
+		uint32_t crc;
+		uint16_t method;
+		uint16_t flags;
+	};
+
+	ZipArchive() = default;
+	ZipArchive(const ZipArchive&) = delete;
+	ZipArchive& operator=(const ZipArchive&) = delete;
+
+	// Maps the file and reads its central directory. Closes the previous archive, if any.
+	bool open(const std::string& path);
+	// Same for an archive which is already in memory
+	bool open(const CellBuffer& data);
+	void close();
+	bool isOpen() const { return !m_data.empty(); }
+
+	// Path given to open(), empty for an archive in memory
+	const std::string& path() const { return m_path; }
+	// Files of the archive in the order of the central directory, directories are left out
+	const std::vector<Entry>& entries() const { return m_entries; }
+	// Entry by its name, '\' is taken for '/'. Null if there is none.
+	const Entry* find(const std::string& name) const;
+
+	// Data of the entry as it is stored in the archive, without a copy
+	bool raw(const Entry& entry, CellBuffer& out) const;
+	// Uncompressed data of the entry, checked against its CRC
+	bool extract(const Entry& entry, CellBuffer& out) const;
+	bool extract(const std::string& name, CellBuffer& out) const;
+
+private:
+	bool readDirectory();
+	bool fail(const char* msg);
+
+	std::string m_path;
+	CellBuffer m_data;
+	std::vector<Entry> m_entries;
+	std::unordered_map<std::string, size_t> m_index;
+};